@@ -0,0 +1,241 @@
+#include "batch.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MANIFEST_LINE_LENGTH 1024
+
+static char* next_field(char** lp);
+static Status read_number(char* str, int* n);
+
+/* parses a NAME=value override. the value may be decimal, $hex or %binary
+   and defaults to 1 if only NAME is given */
+Status parse_define(char* spec, Define* define) {
+  char* equals = strchr(spec, '=');
+  int len = equals ? equals - spec : strlen(spec);
+
+  if(!len || isdigit(*spec)) {
+    fprintf(stderr, "Error: invalid symbol name in definition %s\n", spec);
+    return ERROR;
+  }
+  define->name = malloc(len + 1);
+  memcpy(define->name, spec, len);
+  define->name[len] = '\0';
+
+  define->val = 1;
+  if(equals && read_number(equals + 1, &define->val) != OK) {
+    fprintf(stderr, "Error: invalid value in definition %s\n", spec);
+    return ERROR;
+  }
+  return OK;
+}
+
+/* parses a variant given as <out-file>[:NAME=value[,NAME=value...]] */
+Status parse_variant(char* spec, Variant* variant) {
+  char* colon = strrchr(spec, ':');
+  char* lp;
+
+  variant->defines = NULL;
+  variant->define_count = 0;
+  if(!colon) {
+    variant->out_file = spec;
+    return OK;
+  }
+
+  variant->out_file = malloc(colon - spec + 1);
+  memcpy(variant->out_file, spec, colon - spec);
+  variant->out_file[colon - spec] = '\0';
+
+  lp = colon + 1;
+  while(*lp) {
+    char* comma = strchr(lp, ',');
+    int len = comma ? comma - lp : strlen(lp);
+    char* define = malloc(len + 1);
+    memcpy(define, lp, len);
+    define[len] = '\0';
+
+    variant->defines = realloc(variant->defines,
+                               (variant->define_count + 1) * sizeof(Define));
+    if(parse_define(define, &variant->defines[variant->define_count]) != OK)
+      return ERROR;
+    variant->define_count++;
+    free(define);
+
+    lp += len;
+    if(*lp == ',')
+      lp++;
+  }
+  return OK;
+}
+
+/* reads a manifest describing a batch of jobs. Each non-blank line is
+   <in-file> <out-file> [<sym-file>]; anything after a ';' is a comment.
+   jobs is set to a freshly allocated array of count entries */
+Status read_manifest(char* filename, Job** jobs, int* count) {
+  FILE* fp;
+  char l[MANIFEST_LINE_LENGTH];
+  int capacity = 16;
+  int manifest_line = 0;
+
+  fp = fopen(filename, "r");
+  if(!fp) {
+    fprintf(stderr, "Error: could not open manifest %s for reading\n",
+            filename);
+    return ERROR;
+  }
+
+  *count = 0;
+  *jobs = malloc(capacity * sizeof(Job));
+  while(fgets(l, MANIFEST_LINE_LENGTH, fp)) {
+    char* lp = l;
+    char* comment = strchr(l, ';');
+    Job* job;
+
+    manifest_line++;
+    if(comment)
+      *comment = '\0';
+
+    if(*count == capacity) {
+      capacity *= 2;
+      *jobs = realloc(*jobs, capacity * sizeof(Job));
+    }
+    job = &(*jobs)[*count];
+
+    job->in_file = next_field(&lp);
+    if(!job->in_file)
+      continue;
+    job->out_file = next_field(&lp);
+    if(!job->out_file) {
+      fprintf(stderr, "%s: expected output file on line %d\n",
+              filename, manifest_line);
+      fclose(fp);
+      return ERROR;
+    }
+    job->sym_file = next_field(&lp);
+    if(next_field(&lp)) {
+      fprintf(stderr, "%s: too many fields on line %d\n",
+              filename, manifest_line);
+      fclose(fp);
+      return ERROR;
+    }
+    (*count)++;
+  }
+  fclose(fp);
+  return OK;
+}
+
+/* runs count jobs, with at most max_workers of them at once. Every job
+   runs in its own forked worker, so it starts with whatever state the
+   caller had already set up (e.g. the instruction table) and can't disturb
+   the globals of any other job. Failures are reported per job; returns
+   ERROR if any job failed */
+Status run_jobs(int count, int max_workers, Job_runner run, char** names) {
+  pid_t* pids;
+  int next = 0;
+  int running = 0;
+  int failed = 0;
+
+  if(max_workers < 1)
+    max_workers = 1;
+
+  pids = malloc(count * sizeof(pid_t));
+
+  /* don't let the workers inherit (and repeat) any buffered output */
+  fflush(stdout);
+  fflush(stderr);
+
+  while(next < count || running) {
+    int status;
+    pid_t pid;
+    int i;
+
+    /* keep the pool full */
+    while(running < max_workers && next < count) {
+      pid = fork();
+      if(pid < 0) {
+        fprintf(stderr, "Error: could not start job %s\n", names[next]);
+        pids[next++] = 0;
+        failed++;
+        continue;
+      }
+      if(pid == 0)
+        exit(run(next) == OK ? 0 : 1);
+      pids[next++] = pid;
+      running++;
+    }
+
+    if(!running)
+      break;
+
+    /* reap a finished worker and report on it */
+    pid = wait(&status);
+    if(pid < 0)
+      break;
+    for(i = 0; i < next && pids[i] != pid; i++);
+    if(i == next)
+      continue;
+    running--;
+    if(WIFSIGNALED(status)) {
+      fprintf(stderr, "Error: job %s killed by signal %d\n",
+              names[i], WTERMSIG(status));
+      failed++;
+    }
+    else if(WEXITSTATUS(status)) {
+      fprintf(stderr, "Error: job %s failed\n", names[i]);
+      failed++;
+    }
+  }
+
+  free(pids);
+
+  if(failed) {
+    fprintf(stderr, "%d of %d jobs failed\n", failed, count);
+    return ERROR;
+  }
+  return OK;
+}
+
+/* reads a whole numerical constant in the same notation as the source */
+static Status read_number(char* str, int* n) {
+  char* end;
+  int base = 10;
+
+  if(*str == '$') {
+    base = 16;
+    str++;
+  }
+  else if(*str == '%') {
+    base = 2;
+    str++;
+  }
+  if(!isxdigit(*str))
+    return ERROR;
+  *n = strtol(str, &end, base);
+  return *end ? ERROR : OK;
+}
+
+/* splits off the next whitespace-delimited field of a manifest line.
+   returns a copy of it, or NULL if the line has no more fields */
+static char* next_field(char** lp) {
+  char* start;
+  char* field;
+  int len;
+
+  while(**lp && isspace(**lp)) (*lp)++;
+  if(!**lp)
+    return NULL;
+
+  start = *lp;
+  while(**lp && !isspace(**lp)) (*lp)++;
+
+  len = *lp - start;
+  field = malloc(len + 1);
+  memcpy(field, start, len);
+  field[len] = '\0';
+  return field;
+}
@@ -0,0 +1,32 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "error.h"
+
+typedef struct {
+  char* in_file;
+  char* out_file;
+  char* sym_file;
+} Job;
+
+/* a NAME=value override given on the command line */
+typedef struct {
+  char* name;
+  int val;
+} Define;
+
+/* one output built from a shared parse, differing only in its overrides */
+typedef struct {
+  char* out_file;
+  Define* defines;
+  int define_count;
+} Variant;
+
+typedef Status (*Job_runner)(int job);
+
+Status parse_define(char* spec, Define* define);
+Status parse_variant(char* spec, Variant* variant);
+Status read_manifest(char* filename, Job** jobs, int* count);
+Status run_jobs(int count, int max_workers, Job_runner run, char** names);
+
+#endif
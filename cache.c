@@ -0,0 +1,273 @@
+#include "cache.h"
+
+#include "files.h"
+#include "hash.h"
+#include "lines.h"
+#include "precomp.h"
+#include "snap.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* the build cache keeps the output of each build under a key hashed from
+   everything that went into it. the files a build reads aren't known
+   until it's been parsed, so there are two levels: the main file, its
+   contents, the options and the version pick out a list of the files the
+   last such build read (<root>.deps), and hashing those as they are now
+   gives the key its outputs are stored under (<key>.rom, <key>.sym) */
+#define CACHE_MAGIC "snap-cache 1"
+
+typedef struct {
+  char* path;
+  unsigned long long hash;
+} Dep;
+
+static int root_key(char* in_file, unsigned long long options,
+                    unsigned long long* key);
+static int build_key(unsigned long long root, Dep* deps, int count,
+                     unsigned long long* key);
+static int hash_file(char* filename, unsigned long long* hash);
+static Dep* find_deps(int* count);
+static Status copy_file(char* from, char* to);
+static char* cache_path(char* dir, unsigned long long key, char* ext);
+
+/* if a build of in_file with these options is in the cache and nothing
+   it read has changed since, copies its outputs into place, and gives the
+   names of the files it read if names isn't NULL. returns whether it
+   did */
+int cache_fetch(char* dir, char* in_file, unsigned long long options,
+                char* out_file, char* sym_file, char*** names, int* count) {
+  unsigned long long root;
+  unsigned long long key;
+  unsigned long long stored;
+  char l[PATH_MAX + 32];
+  Dep* deps = NULL;
+  int dep_count = 0;
+  char* path;
+  FILE* fp;
+  int hit;
+  int i;
+
+  if(!root_key(in_file, options, &root))
+    return 0;
+  path = cache_path(dir, root, ".deps");
+  fp = fopen(path, "r");
+  free(path);
+  if(!fp)
+    return 0;
+
+  /* the dependency list is the magic line, the key, then the files */
+  hit = fgets(l, sizeof(l), fp) && strncmp(l, CACHE_MAGIC, 12) == 0 &&
+        fgets(l, sizeof(l), fp) && sscanf(l, "%llx", &stored) == 1;
+  while(hit && fgets(l, sizeof(l), fp)) {
+    char* name = strchr(l, ' ');
+    if(!name) {
+      hit = 0;
+      break;
+    }
+    name[strcspn(name, "\n")] = '\0';
+    deps = realloc(deps, (dep_count + 1) * sizeof(Dep));
+    deps[dep_count].path = strdup(name + 1);
+    sscanf(l, "%llx", &deps[dep_count].hash);
+    dep_count++;
+  }
+  fclose(fp);
+
+  hit = hit && build_key(root, deps, dep_count, &key) && key == stored;
+  if(hit) {
+    path = cache_path(dir, key, ".rom");
+    hit = copy_file(path, out_file) == OK;
+    free(path);
+  }
+  if(hit && sym_file) {
+    path = cache_path(dir, key, ".sym");
+    hit = copy_file(path, sym_file) == OK;
+    free(path);
+  }
+
+  if(hit && names) {
+    *names = malloc((dep_count + 1) * sizeof(char*));
+    for(i = 0; i < dep_count; i++)
+      (*names)[i] = deps[i].path;
+    *count = dep_count;
+  }
+  else {
+    for(i = 0; i < dep_count; i++)
+      free(deps[i].path);
+  }
+  free(deps);
+  return hit;
+}
+
+/* puts the outputs of the build that's just finished into the cache,
+   along with the list of files it read */
+void cache_store(char* dir, char* in_file, unsigned long long options,
+                 char* out_file, char* sym_file) {
+  unsigned long long root;
+  unsigned long long key;
+  Dep* deps;
+  int count;
+  char* path;
+  char* temp;
+  FILE* fp;
+  int ok;
+  int i;
+
+  if(!root_key(in_file, options, &root))
+    return;
+  mkdir(dir, 0777);
+  deps = find_deps(&count);
+  if(!build_key(root, deps, count, &key)) {
+    free(deps);
+    return;
+  }
+
+  /* outputs first, so a dependency list never names missing ones */
+  path = cache_path(dir, key, ".rom");
+  ok = copy_file(out_file, path) == OK;
+  free(path);
+  if(ok && sym_file) {
+    path = cache_path(dir, key, ".sym");
+    ok = copy_file(sym_file, path) == OK;
+    free(path);
+  }
+
+  if(ok) {
+    path = cache_path(dir, root, ".deps");
+    temp = malloc(strlen(path) + 32);
+    sprintf(temp, "%s.%d", path, (int)getpid());
+    fp = fopen(temp, "w");
+    if(fp) {
+      fprintf(fp, "%s\n%016llx\n", CACHE_MAGIC, key);
+      for(i = 0; i < count; i++)
+        fprintf(fp, "%016llx %s\n", deps[i].hash, deps[i].path);
+      if(fclose(fp) != 0 || rename(temp, path) != 0)
+        unlink(temp);
+    }
+    free(temp);
+    free(path);
+  }
+  free(deps);
+}
+
+/* hashes what picks out the dependency list */
+static int root_key(char* in_file, unsigned long long options,
+                    unsigned long long* key) {
+  unsigned long long contents;
+  Hash_state h;
+
+  if(!hash_file(in_file, &contents))
+    return 0;
+  hash_init(&h);
+  hash_update(&h, SNAP_VERSION, sizeof(SNAP_VERSION));
+  hash_update(&h, in_file, strlen(in_file) + 1);
+  hash_update(&h, &options, sizeof(options));
+  hash_update(&h, &contents, sizeof(contents));
+  *key = hash_final(&h);
+  return 1;
+}
+
+/* hashes the dependencies as they are now, checking them against what
+   they were. returns 0 if one's gone or changed */
+static int build_key(unsigned long long root, Dep* deps, int count,
+                     unsigned long long* key) {
+  Hash_state h;
+  int i;
+
+  hash_init(&h);
+  hash_update(&h, &root, sizeof(root));
+  for(i = 0; i < count; i++) {
+    unsigned long long hash;
+    if(!hash_file(deps[i].path, &hash))
+      return 0;
+    if(deps[i].hash && deps[i].hash != hash)
+      return 0;
+    deps[i].hash = hash;
+    hash_update(&h, deps[i].path, strlen(deps[i].path) + 1);
+    hash_update(&h, &hash, sizeof(hash));
+  }
+  *key = hash_final(&h);
+  return 1;
+}
+
+static int hash_file(char* filename, unsigned long long* hash) {
+  long long size;
+  void* p = map_file(filename, &size);
+
+  if(!p)
+    return 0;
+  *hash = hash_bytes(p, size);
+  if(size)
+    munmap(p, size);
+  return 1;
+}
+
+/* every file the loaded program was read from, sorted by name */
+static Dep* find_deps(int* count) {
+  char** names = list_dependencies(count);
+  Dep* deps = malloc((*count + 1) * sizeof(Dep));
+  int i;
+
+  for(i = 0; i < *count; i++) {
+    deps[i].path = names[i];
+    deps[i].hash = 0;
+  }
+  free(names);
+  return deps;
+}
+
+/* copies a file, sharing its blocks instead if the filesystem can. the
+   copy appears all at once */
+static Status copy_file(char* from, char* to) {
+  char* temp = malloc(strlen(to) + 32);
+  char buffer[65536];
+  int in;
+  int out;
+  int ok = 1;
+  ssize_t n;
+
+  in = open(from, O_RDONLY);
+  if(in < 0) {
+    free(temp);
+    return ERROR;
+  }
+  sprintf(temp, "%s.%d", to, (int)getpid());
+  out = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(out < 0) {
+    close(in);
+    free(temp);
+    return ERROR;
+  }
+
+#ifdef FICLONE
+  if(ioctl(out, FICLONE, in) != 0)
+#endif
+  {
+    while(ok && (n = read(in, buffer, sizeof(buffer))) > 0)
+      ok = write(out, buffer, n) == n;
+    ok = ok && n == 0;
+  }
+
+  close(in);
+  ok = close(out) == 0 && ok;
+  if(ok)
+    ok = rename(temp, to) == 0;
+  if(!ok)
+    unlink(temp);
+  free(temp);
+  return ok ? OK : ERROR;
+}
+
+static char* cache_path(char* dir, unsigned long long key, char* ext) {
+  char* path = malloc(strlen(dir) + strlen(ext) + 20);
+  sprintf(path, "%s/%016llx%s", dir, key, ext);
+  return path;
+}
@@ -0,0 +1,9 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+int cache_fetch(char* dir, char* in_file, unsigned long long options,
+                char* out_file, char* sym_file, char*** names, int* count);
+void cache_store(char* dir, char* in_file, unsigned long long options,
+                 char* out_file, char* sym_file);
+
+#endif
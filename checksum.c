@@ -0,0 +1,143 @@
+#include "checksum.h"
+
+#include "error.h"
+#include "image.h"
+#include "rom.h"
+
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* the cartridge header has the 16-bit sum of every byte in the ROM, and
+   its complement, so the pair always adds 2 * $FF to that sum, whatever
+   it is. a ROM whose size isn't a power of two is summed as the console
+   sees it, mirrored up to one: the part past the biggest power of two
+   that fits is repeated to fill out the rest */
+#define COMPLEMENT CHECKSUM_FIELDS
+#define CHECKSUM (CHECKSUM_FIELDS + 2)
+
+/* rebuilds compare a block at a time, and only sum the blocks that
+   differ */
+#define COMPARE_BLOCK 64
+
+static unsigned long long sum_bytes(unsigned char* p, long n);
+static unsigned long long mirrored_sum(unsigned char* rom, long size);
+static long byte_weight(long offset, long size);
+static Status find_header(Image* image, Rom_map map, int* header);
+static void write_checksum(Image* image, int header, unsigned int sum);
+
+/* works out the checksum of the whole image, and fills it in */
+Status set_checksum(Image* image, Rom_map map) {
+  int header;
+
+  if(find_header(image, map, &header) != OK)
+    return ERROR;
+  write_checksum(image, header, 0);
+  write_checksum(image, header, mirrored_sum(image->bytes, image->size));
+  return OK;
+}
+
+/* fills in the checksum of new from that of old, the last build, which is
+   the same size, adding in only how the bytes that changed differ */
+Status update_checksum(Image* old, Image* new, Rom_map map) {
+  unsigned long long sum;
+  int header;
+  long i;
+
+  if(find_header(new, map, &header) != OK)
+    return ERROR;
+  sum = old->bytes[header + CHECKSUM] | old->bytes[header + CHECKSUM+1] << 8;
+  memcpy(new->bytes + header + COMPLEMENT, old->bytes + header + COMPLEMENT, 4);
+
+  for(i = 0; i < new->size; i += COMPARE_BLOCK) {
+    long n = new->size - i < COMPARE_BLOCK ? new->size - i : COMPARE_BLOCK;
+    long j;
+
+    if(memcmp(old->bytes + i, new->bytes + i, n) == 0)
+      continue;
+    for(j = i; j < i + n; j++)
+      if(old->bytes[j] != new->bytes[j])
+        sum += (new->bytes[j] - old->bytes[j]) * byte_weight(j, new->size);
+  }
+  write_checksum(new, header, sum);
+  return OK;
+}
+
+/* adds up n bytes, 16 at a time where the CPU can */
+static unsigned long long sum_bytes(unsigned char* p, long n) {
+  unsigned long long total = 0;
+  long i = 0;
+
+#ifdef __SSE2__
+  __m128i zero = _mm_setzero_si128();
+  __m128i sums = zero;
+
+  /* each step adds each half's eight bytes into that half's total */
+  for(; i + 16 <= n; i += 16)
+    sums = _mm_add_epi64(sums, _mm_sad_epu8(
+                                 _mm_loadu_si128((__m128i*)(p + i)), zero));
+  total = _mm_cvtsi128_si64(sums) +
+          _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+#endif
+  for(; i < n; i++)
+    total += p[i];
+  return total;
+}
+
+static unsigned long long mirrored_sum(unsigned char* rom, long size) {
+  long base = 1;
+  long span = 1;
+
+  if(!size)
+    return 0;
+  while(base * 2 <= size)
+    base *= 2;
+  if(base == size)
+    return sum_bytes(rom, size);
+  while(span < size - base)
+    span *= 2;
+  return sum_bytes(rom, base) +
+         mirrored_sum(rom + base, size - base) * (base / span);
+}
+
+/* how many times the console sees the byte at offset */
+static long byte_weight(long offset, long size) {
+  long weight = 1;
+
+  for(;;) {
+    long base = 1;
+    long span = 1;
+
+    while(base * 2 <= size)
+      base *= 2;
+    if(base == size || offset < base)
+      return weight;
+    offset -= base;
+    size -= base;
+    while(span < size)
+      span *= 2;
+    weight *= base / span;
+  }
+}
+
+static Status find_header(Image* image, Rom_map map, int* header) {
+  *header = rom_header_offset(map);
+  if(image->size < *header + 0x20) {
+    fprintf(stderr, "Error: the ROM is too small to have a header at $%X\n",
+            *header);
+    return ERROR;
+  }
+  return OK;
+}
+
+static void write_checksum(Image* image, int header, unsigned int sum) {
+  unsigned char* p = image->bytes + header;
+
+  sum &= 0xFFFF;
+  p[COMPLEMENT] = ~sum;
+  p[COMPLEMENT+1] = ~sum >> 8;
+  p[CHECKSUM] = sum;
+  p[CHECKSUM+1] = sum >> 8;
+}
@@ -0,0 +1,14 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "error.h"
+#include "image.h"
+#include "rom.h"
+
+/* where in the header the checksum and its complement are */
+#define CHECKSUM_FIELDS 0x1C
+
+Status set_checksum(Image* image, Rom_map map);
+Status update_checksum(Image* old, Image* new, Rom_map map);
+
+#endif
@@ -0,0 +1,396 @@
+#include "dedup.h"
+
+#include "error.h"
+#include "expr.h"
+#include "handlers.h"
+#include "image.h"
+#include "instructions.h"
+#include "lines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* with --dedup, a labelled block of data - a global label followed by
+   nothing but DB, DW, ASCII and INCBIN lines - that's the same as another
+   is left out, and its label made to point at the other copy instead. a
+   block of text that's the tail of a longer one (as NUL terminated strings
+   often are) is pointed into the longer one the same way. blocks are
+   compared by a polynomial hash over their bytes, computed from the end,
+   so that the hash of every tail of a block comes out on the way to the
+   hash of the whole of it */
+
+#define HASH_BASE 0x100000001B3ULL
+
+typedef struct {
+  Line* head;
+  Line* prev; /* the line before head, NULL if it's the first */
+  Line* end; /* the first line after the block */
+  char* label;
+  unsigned char* bytes;
+  int size;
+  unsigned long long hash;
+  int symbolic; /* its values depend on labels */
+  int text; /* it has an ASCII string in it */
+  int host; /* the block it's merged into, or -1 */
+  int offset; /* and where in that block */
+} Data_block;
+
+/* a block, or the tail of one, indexed by its hash */
+typedef struct {
+  unsigned long long hash;
+  int size;
+  int block; /* -1 if the entry's empty */
+  int offset;
+} Entry;
+
+static Data_block* blocks = NULL;
+static int block_count = 0;
+static int block_capacity = 0;
+static Entry* entries = NULL;
+static int entry_buckets = 0;
+
+static Status find_blocks();
+static Status add_block(Line* prev, Line* head, Line* end);
+static int is_data(Line* lp);
+static int uses_symbols(Expr* e);
+static void merge_copies();
+static void merge_tails();
+static int same_block(Data_block* a, Data_block* b);
+static int same_expr(Expr* a, Expr* b);
+static void clear_entries(int count);
+static int first_entry(unsigned long long hash, int size);
+static void add_entry(int i, unsigned long long hash, int size, int block,
+                      int offset);
+static int compare_sizes(const void* a, const void* b);
+static void alias(Data_block* b);
+
+/* merges the data blocks that are the same as, or the end of, another,
+   reporting the bytes saved. the program then needs assembling again */
+Status merge_duplicates(FILE* report) {
+  int merged = 0;
+  int saved = 0;
+  int i;
+
+  if(find_blocks() != OK)
+    return ERROR;
+  merge_copies();
+  merge_tails();
+
+  for(i = 0; i < block_count; i++) {
+    Data_block* b = &blocks[i];
+    if(b->host >= 0) {
+      if(report)
+        fprintf(report, "dedup: %s is %s+%d (%d bytes)\n", b->label,
+                blocks[b->host].label, b->offset, b->size);
+      alias(b);
+      merged++;
+      saved += b->size;
+    }
+    free(b->bytes);
+  }
+  if(report)
+    fprintf(report, "dedup: merged %d of %d data blocks, saving %d bytes\n",
+            merged, block_count, saved);
+  return OK;
+}
+
+/* collects every labelled block of data, along with its bytes */
+static Status find_blocks() {
+  Line* prev = NULL;
+  Line* head = NULL;
+  Line* head_prev = NULL;
+  Line* lp;
+
+  block_count = 0;
+  for(lp = first_line; lp; prev = lp, lp = lp->next) {
+    if(head && (lp->label || !is_data(lp))) {
+      /* a local label in the middle means code may point into it */
+      if(!lp->label || lp->label[0] != '.')
+        if(add_block(head_prev, head, lp) != OK)
+          return ERROR;
+      head = NULL;
+    }
+    if(lp->label && lp->label[0] != '.' && is_data(lp)) {
+      head = lp;
+      head_prev = prev;
+    }
+  }
+  if(head)
+    return add_block(head_prev, head, NULL);
+  return OK;
+}
+
+static Status add_block(Line* prev, Line* head, Line* end) {
+  Data_block* b;
+  Line* lp;
+  int size = 0;
+  int symbolic = 0;
+  int text = 0;
+  int i;
+
+  for(lp = head; lp != end; lp = lp->next) {
+    Expr* e;
+    size += lp->byte_size;
+    for(e = lp->expr1; e; e = e->next)
+      symbolic |= uses_symbols(e);
+    for(e = lp->expr2; e; e = e->next)
+      symbolic |= uses_symbols(e);
+    if(lp->instruction && get_handler(lp->instruction) == ascii)
+      text = 1;
+  }
+  if(!size)
+    return OK;
+
+  if(block_count == block_capacity) {
+    block_capacity = block_capacity ? block_capacity * 2 : 256;
+    blocks = realloc(blocks, block_capacity * sizeof(Data_block));
+  }
+  b = &blocks[block_count++];
+  b->head = head;
+  b->prev = prev;
+  b->end = end;
+  b->label = head->label;
+  b->size = size;
+  b->bytes = malloc(size);
+  b->symbolic = symbolic;
+  b->text = text;
+  b->host = -1;
+  b->offset = 0;
+
+  size = 0;
+  for(lp = head; lp != end; lp = lp->next) {
+    if(line_bytes(lp, b->bytes + size) != OK)
+      return ERROR;
+    size += lp->byte_size;
+  }
+
+  b->hash = 0;
+  for(i = 0; i < b->size; i++)
+    b->hash = b->hash * HASH_BASE + b->bytes[i];
+  return OK;
+}
+
+/* a line that can be part of a block of data */
+static int is_data(Line* lp) {
+  Handler f;
+
+  if(lp->dead)
+    return 0;
+  if(!lp->instruction)
+    return 1;
+  f = get_handler(lp->instruction);
+  return f == db || f == dw || f == ascii || f == incbin;
+}
+
+/* whether an expression refers to a symbol */
+static int uses_symbols(Expr* e) {
+  switch(e->type) {
+  case SYMBOL:
+    return 1;
+  case ADD:
+  case SUB:
+    return uses_symbols(e->e.subexpr[0]) | uses_symbols(e->e.subexpr[1]);
+  default:
+    return 0;
+  }
+}
+
+/* points each block at the first block it's a copy of */
+static void merge_copies() {
+  int i;
+  int j;
+
+  clear_entries(block_count);
+  for(i = 0; i < block_count; i++) {
+    Data_block* b = &blocks[i];
+
+    for(j = first_entry(b->hash, b->size); entries[j].block >= 0;
+        j = (j + 1) & (entry_buckets - 1)) {
+      if(entries[j].hash == b->hash && entries[j].size == b->size &&
+         same_block(&blocks[entries[j].block], b)) {
+        b->host = entries[j].block;
+        break;
+      }
+    }
+    if(b->host < 0)
+      add_entry(j, b->hash, b->size, i, 0);
+  }
+}
+
+/* points each string at the longer one it's the end of. the longest go
+   first, each looking for itself among the tails of those before it, then
+   adding its own tails if it's not there */
+static void merge_tails() {
+  int* order = malloc((block_count + 1) * sizeof(int));
+  int count = 0;
+  int bytes = 0;
+  int i;
+  int j;
+
+  for(i = 0; i < block_count; i++) {
+    if(blocks[i].text && !blocks[i].symbolic && blocks[i].host < 0) {
+      order[count++] = i;
+      bytes += blocks[i].size;
+    }
+  }
+  qsort(order, count, sizeof(int), compare_sizes);
+
+  clear_entries(bytes);
+  for(i = 0; i < count; i++) {
+    Data_block* b = &blocks[order[i]];
+    unsigned long long hash = 0;
+    unsigned long long power = 1;
+
+    for(j = first_entry(b->hash, b->size); entries[j].block >= 0;
+        j = (j + 1) & (entry_buckets - 1)) {
+      Entry* entry = &entries[j];
+      if(entry->hash == b->hash && entry->size == b->size &&
+         memcmp(blocks[entry->block].bytes + entry->offset, b->bytes,
+                b->size) == 0) {
+        b->host = entry->block;
+        b->offset = entry->offset;
+        break;
+      }
+    }
+    if(b->host >= 0)
+      continue;
+
+    /* the hash of each tail is worked out from the one after it */
+    for(j = b->size - 1; j > 0; j--) {
+      int k;
+      hash += b->bytes[j] * power;
+      power *= HASH_BASE;
+      for(k = first_entry(hash, b->size - j); entries[k].block >= 0;
+          k = (k + 1) & (entry_buckets - 1));
+      add_entry(k, hash, b->size - j, order[i], j);
+    }
+  }
+  free(order);
+}
+
+/* whether two blocks can be merged. blocks whose values depend on labels
+   have to be written the same way, to stay the same once things move */
+static int same_block(Data_block* a, Data_block* b) {
+  Line* la = a->head;
+  Line* lb = b->head;
+
+  if(a->size != b->size || memcmp(a->bytes, b->bytes, a->size) != 0)
+    return 0;
+  if(!a->symbolic && !b->symbolic)
+    return 1;
+
+  for(;;) {
+    while(la != a->end && !la->instruction) la = la->next;
+    while(lb != b->end && !lb->instruction) lb = lb->next;
+    if(la == a->end || lb == b->end)
+      return la == a->end && lb == b->end;
+    if(get_handler(la->instruction) != get_handler(lb->instruction) ||
+       la->addr_mode != lb->addr_mode ||
+       !same_expr(la->expr1, lb->expr1) || !same_expr(la->expr2, lb->expr2))
+      return 0;
+    la = la->next;
+    lb = lb->next;
+  }
+}
+
+/* compares two expressions, and the rest of their lists */
+static int same_expr(Expr* a, Expr* b) {
+  for(; a && b; a = a->next, b = b->next) {
+    if(a->type != b->type)
+      return 0;
+    switch(a->type) {
+    case SYMBOL:
+      if(strcmp(a->e.sym, b->e.sym) != 0)
+        return 0;
+      break;
+    case NUMBER:
+      if(a->e.num != b->e.num)
+        return 0;
+      break;
+    case STRING_EXPR:
+      if(strcmp(a->e.str, b->e.str) != 0)
+        return 0;
+      break;
+    case ADD:
+    case SUB:
+      if(!same_expr(a->e.subexpr[0], b->e.subexpr[0]) ||
+         !same_expr(a->e.subexpr[1], b->e.subexpr[1]))
+        return 0;
+      break;
+    }
+  }
+  return !a && !b;
+}
+
+static void clear_entries(int count) {
+  int i;
+
+  for(entry_buckets = 256; entry_buckets < count * 2; entry_buckets *= 2);
+  entries = realloc(entries, entry_buckets * sizeof(Entry));
+  for(i = 0; i < entry_buckets; i++)
+    entries[i].block = -1;
+}
+
+/* where to start looking for a hash and size */
+static int first_entry(unsigned long long hash, int size) {
+  return (hash ^ hash >> 32 ^ size) & (entry_buckets - 1);
+}
+
+static void add_entry(int i, unsigned long long hash, int size, int block,
+                      int offset) {
+  entries[i].hash = hash;
+  entries[i].size = size;
+  entries[i].block = block;
+  entries[i].offset = offset;
+}
+
+/* longest first */
+static int compare_sizes(const void* a, const void* b) {
+  int sa = blocks[*(int*)a].size;
+  int sb = blocks[*(int*)b].size;
+
+  if(sa != sb)
+    return sb - sa;
+  return *(int*)a - *(int*)b;
+}
+
+/* drops a block's lines, and makes its label an EQU for where it was
+   merged into */
+static void alias(Data_block* b) {
+  Line* eq = alloc_line();
+  Expr* host = alloc_expr();
+  Line* lp;
+
+  host->type = SYMBOL;
+  host->e.sym = blocks[b->host].label;
+  if(b->offset) {
+    Expr* sum = alloc_expr();
+    sum->type = ADD;
+    sum->e.subexpr[0] = host;
+    sum->e.subexpr[1] = alloc_expr();
+    sum->e.subexpr[1]->type = NUMBER;
+    sum->e.subexpr[1]->e.num = b->offset;
+    host = sum;
+  }
+
+  eq->filename = b->head->filename;
+  eq->line_num = b->head->line_num;
+  eq->source = b->head->source;
+  eq->label = b->label;
+  eq->instruction = "equ";
+  eq->addr_mode = ABSOLUTE;
+  eq->expr1 = host;
+  b->head->label = NULL;
+
+  eq->next = b->head;
+  if(b->prev)
+    b->prev->next = eq;
+  else
+    first_line = eq;
+
+  for(lp = b->head; lp != b->end; lp = lp->next) {
+    lp->dead = 1;
+    lp->byte_size = 0;
+  }
+}
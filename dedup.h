@@ -0,0 +1,10 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "error.h"
+
+#include <stdio.h>
+
+Status merge_duplicates(FILE* report);
+
+#endif
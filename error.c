@@ -2,24 +2,133 @@
 
 #include "lines.h"
 #include "snap.h"
+#include "table.h"
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* if set, errors are handed to this instead of being printed */
+Error_handler error_handler = NULL;
+
+/* how many errors have been reported, and how many to stop after (0 for
+   no limit) */
+int error_count = 0;
+int error_limit = DEFAULT_ERROR_LIMIT;
+
+/* the errors reported, so that passes going over the same lines again
+   don't report them again */
+typedef struct {
+  unsigned int hash;
+  int line;
+  char* filename; /* or NULL */
+  char* message;
+} Report;
+
+static Report** reported = NULL;
+static int reported_buckets = 0;
+
+static int first_report(char* message);
+static int same_report(Report* r, unsigned int h, char* message);
 
 /* prints an error message, along with position information, to stderr.
    return ERROR */
 Status error(const char * format, ...) {
+  char message[1024];
   va_list args;
   va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
 
-  fprintf(stderr, "%s: ", current_filename ? current_filename : "Error");
-  vfprintf(stderr, format, args);
-  fprintf(stderr, " on line %d\n", line_num);
+  if(too_many_errors() || !first_report(message))
+    return ERROR;
+  error_count++;
 
-  va_end(args);
+  if(error_handler)
+    error_handler(current_filename, line_num, message);
+  else {
+    fprintf(stderr, "%s: %s on line %d\n",
+            current_filename ? current_filename : "Error", message,
+            line_num);
+    if(too_many_errors())
+      fprintf(stderr, "Error: stopping after %d error%s\n", error_count,
+              error_count == 1 ? "" : "s");
+  }
   return ERROR;
 }
 
+/* forgets the errors reported, before the program's built again */
+void reset_errors() {
+  int b;
+
+  error_count = 0;
+  for(b = 0; b < reported_buckets; b++) {
+    if(reported[b]) {
+      free(reported[b]->filename);
+      free(reported[b]->message);
+      free(reported[b]);
+      reported[b] = NULL;
+    }
+  }
+}
+
+int too_many_errors() {
+  return error_limit && error_count >= error_limit;
+}
+
+/* whether an error for this file and line with this message is new, and
+   notes it if it is */
+static int first_report(char* message) {
+  unsigned int h = hash_str(message) * 31 + line_num;
+  Report* r;
+  int mask;
+  int b;
+
+  if(current_filename)
+    h = h * 31 + hash_str(current_filename);
+
+  /* kept under half full */
+  if((error_count + 1) * 2 > reported_buckets) {
+    Report** old = reported;
+    int old_buckets = reported_buckets;
+    int i;
+
+    reported_buckets = reported_buckets ? reported_buckets * 2 : 64;
+    reported = calloc(reported_buckets, sizeof(Report*));
+    for(i = 0; i < old_buckets; i++) {
+      if(!old[i])
+        continue;
+      for(b = old[i]->hash & (reported_buckets - 1); reported[b];
+          b = (b + 1) & (reported_buckets - 1));
+      reported[b] = old[i];
+    }
+    free(old);
+  }
+
+  mask = reported_buckets - 1;
+  for(b = h & mask; reported[b]; b = (b + 1) & mask)
+    if(same_report(reported[b], h, message))
+      return 0;
+
+  r = malloc(sizeof(Report));
+  r->hash = h;
+  r->line = line_num;
+  r->filename = current_filename ? strdup(current_filename) : NULL;
+  r->message = strdup(message);
+  reported[b] = r;
+  return 1;
+}
+
+static int same_report(Report* r, unsigned int h, char* message) {
+  if(r->hash != h || r->line != line_num ||
+     strcmp(r->message, message) != 0)
+    return 0;
+  if(!r->filename || !current_filename)
+    return !r->filename && !current_filename;
+  return strcmp(r->filename, current_filename) == 0;
+}
+
 Status expected(char e, char c) {
   return error("expected '%c', instead found '%c'", e, c);
 }
@@ -5,7 +5,19 @@
 
 typedef enum {ERROR, OK} Status;
 
+/* stop reporting errors after this many, unless -ferror-limit says
+   otherwise */
+#define DEFAULT_ERROR_LIMIT 20
+
+typedef void (*Error_handler)(char* filename, int line, char* message);
+
+extern Error_handler error_handler;
+extern int error_count;
+extern int error_limit;
+
 Status error(const char * format, ...);
+void reset_errors();
+int too_many_errors();
 Status expected(char e, char c);
 Status invalid_operand(Line* l);
 Status redefined_label(char* l);
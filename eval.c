@@ -2,6 +2,7 @@
 
 #include "expr.h"
 #include "labels.h"
+#include "object.h"
 #include "snap.h"
 
 Status eval(Expr* e, int* result) {
@@ -16,7 +17,13 @@ Status eval(Expr* e, int* result) {
     *result = e->e.num;
     return OK;
   case SYMBOL:
-    if(sym_val(e->e.sym, result) != OK) {
+    if(sym_val(e->e.sym, &e->cache, result) != OK) {
+      /* once every label's been seen, what's still missing from an object
+         file is imported, and worth 0 until it's linked */
+      if(relocating && pass) {
+        *result = 0;
+        return OK;
+      }
       missing_labels = 1;
       if(pass) 
           return error("undefined symbol '%s'", e->e.sym);
@@ -1,5 +1,12 @@
 #include "expr.h"
 
+#include <stdlib.h>
+
+/* allocates a new, zeroed Expr. returns NULL on failure */
+Expr* alloc_expr() {
+  return calloc(1, sizeof(Expr));
+}
+
 Expr_class expr_class(Expr* e) {
   Expr_class l, r;
   switch(e->type) {
@@ -2,7 +2,15 @@
 #define EXPR_H
 
 typedef enum {SYMBOL, NUMBER, ADD, SUB, STRING_EXPR} Expr_type;
-typedef enum {NUMERIC, SYMBOLIC} Expr_class;
+/* a RELOCATABLE value isn't known until an object file is linked */
+typedef enum {NUMERIC, SYMBOLIC, RELOCATABLE} Expr_class;
+
+/* remembers where a symbol was found in the symbol table, so it needn't be
+   looked up by name every pass */
+typedef struct {
+  int slot;
+  int generation;
+} Symbol_cache;
 
 typedef struct Expr_t {
   Expr_type type;
@@ -13,8 +21,10 @@ typedef struct Expr_t {
     struct Expr_t* subexpr[2];
   } e;
   struct Expr_t* next; /* for a list */
+  Symbol_cache cache; /* for a SYMBOL */
 } Expr;
 
+Expr* alloc_expr();
 Expr_class expr_class(Expr* expr);
 
 #endif
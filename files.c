@@ -0,0 +1,272 @@
+#include "files.h"
+
+#include "error.h"
+#include "lines.h"
+#include "precomp.h"
+#include "table.h"
+#include "watch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* files are found by name through a cache of what stat() said about each
+   name, which is trusted until the stats are forgotten (when something
+   might have changed). the files themselves are kept by device and inode,
+   so different names for one file find the same one */
+#define NAME_BUCKETS 256
+#define FILE_BUCKETS 256
+
+typedef struct {
+  char* name;
+  File* file;
+  int generation;
+} Name;
+
+static Name* names = NULL;
+static int name_buckets = 0;
+static int name_count = 0;
+
+static File* files[FILE_BUCKETS];
+static File* all_files = NULL;
+static File* last_file = NULL;
+
+static int generation = 1;
+
+static Name* find_name(char* filename);
+static File* find_inode(struct stat* st, char* filename);
+static int compare_names(const void* a, const void* b);
+static void write_make_name(FILE* fp, char* name);
+
+/* the file filename names, or NULL if there's no such file */
+File* find_file(char* filename) {
+  Name* n = find_name(filename);
+  struct stat st;
+  File* file;
+
+  if(n->generation == generation)
+    return n->file;
+
+  n->generation = generation;
+  n->file = NULL;
+  if(stat(filename, &st) != 0)
+    return NULL;
+  file = find_inode(&st, filename);
+
+  /* whatever was parsed from it is out of date if it's changed since */
+  if(file->size != st.st_size ||
+     file->mtime.tv_sec != st.st_mtim.tv_sec ||
+     file->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+    file->size = st.st_size;
+    file->mtime = st.st_mtim;
+    if(file->cached) {
+      free_records(&file->records);
+      file->cached = 0;
+    }
+    file->once = 0;
+  }
+
+  n->file = file;
+  return file;
+}
+
+/* files might have changed, so they'll have to be looked at again */
+void forget_file_stats() {
+  generation++;
+}
+
+/* has file been read in, as part of the program as it stands? */
+int already_included(File* file) {
+  Source* s;
+
+  for(s = first_source; s; s = s->next)
+    if(s->file == file && !is_kept(s))
+      return 1;
+  return 0;
+}
+
+/* the names of every file the loaded program was read from, INCSRC'd or
+   INCBIN'd, sorted and without repeats. the names themselves belong to
+   the program */
+char** list_dependencies(int* count) {
+  char** names = NULL;
+  Source* s;
+  Line* lp;
+  int i;
+  int j;
+
+  *count = 0;
+  for(s = first_source; s; s = s->next) {
+    /* stdin isn't a file */
+    if(strcmp(s->filename, "-") == 0)
+      continue;
+    names = realloc(names, (*count + 1) * sizeof(char*));
+    names[(*count)++] = s->filename;
+  }
+  for(lp = first_line; lp; lp = lp->next) {
+    if(lp->instruction && strcasecmp(lp->instruction, "incbin") == 0 &&
+       lp->addr_mode == STRING) {
+      names = realloc(names, (*count + 1) * sizeof(char*));
+      names[(*count)++] = lp->expr1->e.str;
+    }
+  }
+
+  qsort(names, *count, sizeof(char*), compare_names);
+  for(i = j = 0; i < *count; i++)
+    if(!j || strcmp(names[j - 1], names[i]) != 0)
+      names[j++] = names[i];
+  *count = j;
+  return names;
+}
+
+/* writes a makefile rule saying target depends on the named files, with
+   an empty rule for each of them but main_file if phony is set, so an
+   included file that's since been deleted doesn't stop make */
+Status write_depfile(char* filename, char* target, char* main_file,
+                     char** names, int count, int phony) {
+  char* temp = malloc(strlen(filename) + 32);
+  FILE* fp;
+  int ok;
+  int i;
+
+  sprintf(temp, "%s.%d", filename, (int)getpid());
+  fp = fopen(temp, "w");
+  if(!fp) {
+    fprintf(stderr, "Error: could not open file %s for writing\n", temp);
+    free(temp);
+    return ERROR;
+  }
+
+  write_make_name(fp, target);
+  fputc(':', fp);
+  for(i = 0; i < count; i++) {
+    fputs(" \\\n ", fp);
+    write_make_name(fp, names[i]);
+  }
+  fputc('\n', fp);
+  if(phony) {
+    for(i = 0; i < count; i++) {
+      if(strcmp(names[i], main_file) == 0)
+        continue;
+      fputc('\n', fp);
+      write_make_name(fp, names[i]);
+      fputs(":\n", fp);
+    }
+  }
+
+  ok = !ferror(fp);
+  ok = fclose(fp) == 0 && ok;
+  if(ok)
+    ok = rename(temp, filename) == 0;
+  if(!ok) {
+    fprintf(stderr, "Error: writing %s\n", filename);
+    unlink(temp);
+  }
+  free(temp);
+  return ok ? OK : ERROR;
+}
+
+void print_include_stats(FILE* fp) {
+  File* file;
+
+  fprintf(fp, "%8s %8s %8s  %s\n", "reads", "hits", "skips", "file");
+  for(file = all_files; file; file = file->next)
+    if(file->reads || file->hits || file->skips)
+      fprintf(fp, "%8d %8d %8d  %s\n",
+              file->reads, file->hits, file->skips, file->filename);
+}
+
+/* starts counting how files are included over again */
+void reset_include_stats() {
+  File* file;
+
+  for(file = all_files; file; file = file->next)
+    file->reads = file->hits = file->skips = 0;
+}
+
+static Name* find_name(char* filename) {
+  unsigned int hash = hash_str(filename);
+  int i;
+
+  if((name_count + 1) * 2 > name_buckets) {
+    Name* old = names;
+    int old_buckets = name_buckets;
+    int j;
+
+    name_buckets = old_buckets ? old_buckets * 2 : NAME_BUCKETS;
+    names = calloc(name_buckets, sizeof(Name));
+    for(j = 0; j < old_buckets; j++) {
+      if(old[j].name) {
+        int k = hash_str(old[j].name) % name_buckets;
+        while(names[k].name)
+          k = (k + 1) % name_buckets;
+        names[k] = old[j];
+      }
+    }
+    free(old);
+  }
+
+  for(i = hash % name_buckets; names[i].name; i = (i + 1) % name_buckets)
+    if(strcmp(names[i].name, filename) == 0)
+      return &names[i];
+
+  names[i].name = strdup(filename);
+  names[i].file = NULL;
+  names[i].generation = 0;
+  name_count++;
+  return &names[i];
+}
+
+static File* find_inode(struct stat* st, char* filename) {
+  int i = (st->st_dev * 31 + st->st_ino) % FILE_BUCKETS;
+  File* file;
+
+  for(file = files[i]; file; file = file->chain)
+    if(file->dev == st->st_dev && file->ino == st->st_ino)
+      return file;
+
+  file = calloc(1, sizeof(File));
+  file->filename = strdup(filename);
+  file->dev = st->st_dev;
+  file->ino = st->st_ino;
+  file->size = st->st_size;
+  file->mtime = st->st_mtim;
+  init_records(&file->records);
+  file->chain = files[i];
+  files[i] = file;
+
+  if(last_file)
+    last_file->next = file;
+  else
+    all_files = file;
+  last_file = file;
+  return file;
+}
+
+static int compare_names(const void* a, const void* b) {
+  return strcmp(*(char**)a, *(char**)b);
+}
+
+/* writes a file name the way make will read it back: spaces (and any
+   backslashes before them) and #s escaped with backslashes, and $s
+   doubled */
+static void write_make_name(FILE* fp, char* name) {
+  char* p;
+
+  for(p = name; *p; p++) {
+    if(*p == ' ' || *p == '\t') {
+      char* q;
+      for(q = p - 1; q >= name && *q == '\\'; q--)
+        fputc('\\', fp);
+      fputc('\\', fp);
+    }
+    else if(*p == '$')
+      fputc('$', fp);
+    else if(*p == '#')
+      fputc('\\', fp);
+    fputc(*p, fp);
+  }
+}
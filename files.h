@@ -0,0 +1,48 @@
+#ifndef FILES_H
+#define FILES_H
+
+#include "error.h"
+#include "lines.h"
+#include "precomp.h"
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* a file on disk, however many names it's included by */
+typedef struct File_tag {
+  /* list of every file found, in the order found */
+  struct File_tag* next;
+
+  /* the next file in the same bucket */
+  struct File_tag* chain;
+
+  char* filename; /* the name it was first found by */
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+
+  /* it's only ever included once */
+  int once;
+
+  /* its lines as last parsed, to replay instead of parsing it again */
+  int cached;
+  Records records;
+
+  /* how it's been included */
+  int reads;
+  int hits;
+  int skips;
+} File;
+
+File* find_file(char* filename);
+void forget_file_stats();
+int already_included(File* file);
+char** list_dependencies(int* count);
+Status write_depfile(char* filename, char* target, char* main_file,
+                     char** names, int count, int phony);
+void print_include_stats(FILE* fp);
+void reset_include_stats();
+
+#endif
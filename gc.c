@@ -0,0 +1,249 @@
+#include "gc.h"
+
+#include "error.h"
+#include "expr.h"
+#include "handlers.h"
+#include "instructions.h"
+#include "lines.h"
+#include "table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* with --gc, code and data that nothing uses are left out. the program is
+   split into blocks, each starting at a global label, or at an ORG or PAD
+   for code that can't be named. a block is kept if it's a root - unnamed, like
+   the reset code and the vector table, or named by --keep - or if a kept
+   block refers to it or runs on into it. the rest is dropped, all but the
+   directives later lines depend on, and the program assembled again
+   without it */
+
+/* what a line contributes to a block */
+typedef enum {NOTHING, KEEP, CODE, JUMP, DATA} Line_kind;
+
+typedef struct {
+  Line* first;
+  Line* end; /* the first line of the next block */
+  char* label; /* NULL if it's a root */
+  int origin; /* starts with an ORG or PAD, so nothing runs on into it */
+  Line_kind starts; /* its first and last lines that make bytes */
+  Line_kind ends;
+  int live;
+} Block;
+
+static Block* blocks = NULL;
+static int block_count = 0;
+static int block_capacity = 0;
+static int* buckets = NULL;
+static int bucket_count = 0;
+static int* pending = NULL;
+static int pending_count = 0;
+
+static void split_blocks();
+static void add_block(Line* lp, char* label, int origin);
+static Line_kind line_kind(Line* lp);
+static int runs_on(int b);
+static int find_block(char* name);
+static void mark(int b);
+static void mark_line(Line* lp);
+static void mark_refs(Expr* e);
+
+/* drops the blocks that can't be reached from the roots, reporting what
+   went. the program then needs assembling again */
+Status collect_garbage(char** roots, int root_count, FILE* report) {
+  int dropped = 0;
+  int saved = 0;
+  int total = 0;
+  Line* lp;
+  int i;
+
+  split_blocks();
+  pending = realloc(pending, (block_count + 1) * sizeof(int));
+  pending_count = 0;
+
+  for(i = 0; i < root_count; i++) {
+    int b = find_block(roots[i]);
+    if(b < 0) {
+      fprintf(stderr, "Error: --keep label %s isn't defined\n", roots[i]);
+      return ERROR;
+    }
+    mark(b);
+  }
+  for(i = 0; i < block_count; i++)
+    if(!blocks[i].label)
+      mark(i);
+
+  /* the directives that stay either way keep what they refer to */
+  for(lp = first_line; lp; lp = lp->next)
+    if(line_kind(lp) == KEEP)
+      mark_line(lp);
+
+  while(pending_count) {
+    int b = pending[--pending_count];
+    for(lp = blocks[b].first; lp != blocks[b].end; lp = lp->next)
+      mark_line(lp);
+    if(runs_on(b))
+      mark(b + 1);
+  }
+
+  for(i = 0; i < block_count; i++) {
+    int size = 0;
+
+    for(lp = blocks[i].first; lp != blocks[i].end; lp = lp->next)
+      if(line_kind(lp) != KEEP)
+        size += lp->byte_size;
+    total += size;
+    if(blocks[i].live)
+      continue;
+
+    for(lp = blocks[i].first; lp != blocks[i].end; lp = lp->next) {
+      if(line_kind(lp) != KEEP) {
+        lp->dead = 1;
+        lp->byte_size = 0;
+      }
+    }
+    if(report)
+      fprintf(report, "gc: dropped %s (%d bytes)\n", blocks[i].label, size);
+    dropped++;
+    saved += size;
+  }
+  if(report)
+    fprintf(report, "gc: dropped %d of %d blocks, saving %d of %d bytes\n",
+            dropped, block_count, saved, total);
+  return OK;
+}
+
+/* splits the lines into blocks, and indexes them by label */
+static void split_blocks() {
+  Line* lp;
+  int i;
+
+  block_count = 0;
+  for(lp = first_line; lp; lp = lp->next) {
+    int origin = lp->instruction && (get_handler(lp->instruction) == org ||
+                                     get_handler(lp->instruction) == pad);
+    int global = lp->label && lp->label[0] != '.' &&
+                 (!lp->instruction || get_handler(lp->instruction) != equ);
+    Line_kind kind = line_kind(lp);
+
+    if(global || origin || !block_count)
+      add_block(lp, global ? lp->label : NULL, origin);
+    if(kind >= CODE) {
+      Block* b = &blocks[block_count-1];
+      if(b->starts == NOTHING)
+        b->starts = kind;
+      b->ends = kind;
+    }
+  }
+
+  for(bucket_count = 256; bucket_count < block_count * 2; bucket_count *= 2);
+  buckets = realloc(buckets, bucket_count * sizeof(int));
+  memset(buckets, -1, bucket_count * sizeof(int));
+  for(i = 0; i < block_count; i++) {
+    int j;
+    if(!blocks[i].label)
+      continue;
+    j = hash_str(blocks[i].label) & (bucket_count - 1);
+    while(buckets[j] >= 0)
+      j = (j + 1) & (bucket_count - 1);
+    buckets[j] = i;
+  }
+}
+
+static void add_block(Line* lp, char* label, int origin) {
+  Block* b;
+
+  if(block_count == block_capacity) {
+    block_capacity = block_capacity ? block_capacity * 2 : 256;
+    blocks = realloc(blocks, block_capacity * sizeof(Block));
+  }
+  if(block_count)
+    blocks[block_count-1].end = lp;
+  b = &blocks[block_count++];
+  b->first = lp;
+  b->end = NULL;
+  b->label = label;
+  b->origin = origin;
+  b->starts = b->ends = NOTHING;
+  b->live = 0;
+}
+
+static Line_kind line_kind(Line* lp) {
+  Handler f;
+
+  if(!lp->instruction)
+    return NOTHING;
+  f = get_handler(lp->instruction);
+  if(f == equ || f == org || f == pad || f == setd || f == setdbr ||
+     f == longa || f == longi)
+    return KEEP;
+  if(!lp->byte_size)
+    return NOTHING;
+  if(f == jmp || f == jml || f == bra || f == brl || f == rts ||
+     f == rtl || f == rti || f == stp)
+    return JUMP;
+  if(f == db || f == dw || f == ascii || f == incbin)
+    return DATA;
+  return CODE;
+}
+
+/* whether the code at the end of a block carries on into the next. a
+   table may be read past its end into the next table, but not into
+   code */
+static int runs_on(int b) {
+  if(b + 1 == block_count || blocks[b+1].origin)
+    return 0;
+  if(blocks[b].ends == JUMP)
+    return 0;
+  return blocks[b].ends != DATA || blocks[b+1].starts == DATA ||
+         blocks[b+1].starts == NOTHING;
+}
+
+/* the block a global label starts, or -1 */
+static int find_block(char* name) {
+  int i = hash_str(name) & (bucket_count - 1);
+
+  while(buckets[i] >= 0) {
+    if(strcmp(blocks[buckets[i]].label, name) == 0)
+      return buckets[i];
+    i = (i + 1) & (bucket_count - 1);
+  }
+  return -1;
+}
+
+static void mark(int b) {
+  if(blocks[b].live)
+    return;
+  blocks[b].live = 1;
+  pending[pending_count++] = b;
+}
+
+static void mark_line(Line* lp) {
+  Expr* e;
+
+  for(e = lp->expr1; e; e = e->next)
+    mark_refs(e);
+  for(e = lp->expr2; e; e = e->next)
+    mark_refs(e);
+}
+
+/* marks the blocks an expression refers to. EQUs are kept anyway, along
+   with whatever they refer to */
+static void mark_refs(Expr* e) {
+  int b;
+
+  switch(e->type) {
+  case ADD:
+  case SUB:
+    mark_refs(e->e.subexpr[0]);
+    mark_refs(e->e.subexpr[1]);
+    break;
+  case SYMBOL:
+    if((b = find_block(e->e.sym)) >= 0)
+      mark(b);
+    break;
+  default:
+    break;
+  }
+}
@@ -0,0 +1,10 @@
+#ifndef GC_H
+#define GC_H
+
+#include "error.h"
+
+#include <stdio.h>
+
+Status collect_garbage(char** roots, int root_count, FILE* report);
+
+#endif
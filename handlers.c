@@ -4,10 +4,12 @@
 #include "eval.h"
 #include "labels.h"
 #include "lines.h"
+#include "object.h"
 #include "snap.h"
 
 #include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
 
 #define PRIMARY_IMM 0x09
 #define PRIMARY_ABS 0x0D
@@ -290,9 +292,43 @@ static int immediate(int operand, Addressing_modifier mod, int sixteen) {
   }
 }
 
+/* a value the linker fills in is assumed to be an absolute address in
+   the data bank, which snaplink checks */
+static Expr_class operand_class(Line* line) {
+  if(reloc_target(line->expr1))
+    return RELOCATABLE;
+  return expr_class(line->expr1);
+}
+
+/* whether the operand can be measured from pc yet. it can't if the linker
+   is going to place one of them */
+static int placed_with_pc(Line* line) {
+  return reloc_target(line->expr1) == current_section;
+}
+
+/* the directives that say where the linker may put the current section
+   only mean something for a relocatable one */
+static Status in_section(Line* line, char* directive) {
+  line->byte_size = 0;
+  if(!relocating || !current_section)
+    return error("%s needs a relocatable section in an object file",
+                 directive);
+  return OK;
+}
+
+/* evaluates the operand of a placement directive, which has to be known
+   from the start */
+static Status placement(Expr* e, int* operand, char* directive) {
+  if(eval(e, operand) != OK || reloc_target(e))
+    return error("%s operand must be a fixed value known on first pass",
+                 directive);
+  return OK;
+}
+
 static int is_direct_page(int* operand, Expr_class expr_class) {
   switch(expr_class) {
   case NUMERIC: return *operand <= 0xFF;
+  case RELOCATABLE: return 0;
   case SYMBOLIC:
     if(*operand <= 0xFFFF && *operand >= d && *operand - d <= 0xFF) {
       *operand = *operand - d;
@@ -307,6 +343,7 @@ static int is_near(int operand, Expr_class expr_class) {
   switch(expr_class) {
   case NUMERIC: return operand <= 0xFFFF;
   case SYMBOLIC: return operand >> 16 == dbr;
+  case RELOCATABLE: return 1;
   }
 }
 
@@ -360,7 +397,7 @@ static Status primary(Line* line, int base, int sixteen_bit) {
     break;
   case ABSOLUTE:
   case ABSOLUTE_INDEXED_X:
-    if(is_direct_page(&operand, expr_class(line->expr1))) {
+    if(is_direct_page(&operand, operand_class(line))) {
       line->byte_size = 2;
       switch(line->addr_mode) {
       case ABSOLUTE: line->bytes[0] = base + PRIMARY_DP; break;
@@ -368,7 +405,7 @@ static Status primary(Line* line, int base, int sixteen_bit) {
       default:;
       }
     }
-    else if(is_near(operand, expr_class(line->expr1))) {
+    else if(is_near(operand, operand_class(line))) {
       line->byte_size = 3;
       switch(line->addr_mode) {
       case ABSOLUTE: line->bytes[0] = base + PRIMARY_ABS; break;
@@ -390,7 +427,7 @@ static Status primary(Line* line, int base, int sixteen_bit) {
     break;
   case ABSOLUTE_INDEXED_Y:
     line->byte_size = 3;
-    if(!is_near(operand, expr_class(line->expr1)))
+    if(!is_near(operand, operand_class(line)))
       return operand_out_of_range(operand);
     line->bytes[0] = base + PRIMARY_ABS_INDEXED_Y;
     break;
@@ -468,11 +505,11 @@ Status group2(Line* line, int base) {
    }
    break;
   case ABSOLUTE:
-    if(is_direct_page(&operand, expr_class(line->expr1))) {
+    if(is_direct_page(&operand, operand_class(line))) {
       line->byte_size = 2;
       line->bytes[0] = base | (G2_DP << 2);
     }
-    else if(is_near(operand, expr_class(line->expr1))) {
+    else if(is_near(operand, operand_class(line))) {
       line->byte_size = 3;
       line->bytes[0] = base | (G2_ABS << 2);
     }
@@ -486,11 +523,11 @@ Status group2(Line* line, int base) {
     if(line->addr_mode == ABSOLUTE_INDEXED_X && base == STX_BASE)
       return invalid_operand(line);
 
-    if(is_direct_page(&operand, expr_class(line->expr1))) {
+    if(is_direct_page(&operand, operand_class(line))) {
       line->byte_size = 2;
       line->bytes[0] = base | (G2_DP_INDEXED << 2);
     }
-    else if(is_near(operand, expr_class(line->expr1))) {
+    else if(is_near(operand, operand_class(line))) {
       line->byte_size = 3;
       line->bytes[0] = base | (G2_ABS_INDEXED << 2);
     }
@@ -539,11 +576,11 @@ Status indexld(Line* line, int base) {
     line->bytes[0] = base + INDEX_LOAD_IMM;
     break;
   case ABSOLUTE:
-    if(is_direct_page(&operand, expr_class(line->expr1))) {
+    if(is_direct_page(&operand, operand_class(line))) {
       line->byte_size = 2;
       line->bytes[0] = base + INDEX_LOAD_DP;
     }
-    else if(is_near(operand, expr_class(line->expr1))) {
+    else if(is_near(operand, operand_class(line))) {
       line->byte_size = 3;
       line->bytes[0] = base + INDEX_LOAD_ABS;
     }
@@ -555,11 +592,11 @@ Status indexld(Line* line, int base) {
     if((line->addr_mode == ABSOLUTE_INDEXED_X && base == LDX_BASE) ||
        (line->addr_mode == ABSOLUTE_INDEXED_Y && base == LDY_BASE))
       return invalid_operand(line);
-    if(is_direct_page(&operand, expr_class(line->expr1))) {
+    if(is_direct_page(&operand, operand_class(line))) {
       line->byte_size = 2;
       line->bytes[0] = base + INDEX_LOAD_DP_INDEXED;
     }
-    else if(is_near(operand, expr_class(line->expr1))) {
+    else if(is_near(operand, operand_class(line))) {
       line->byte_size = 3;
       line->bytes[0] = base + INDEX_LOAD_ABS_INDEXED;
     }
@@ -603,11 +640,11 @@ Status indexcmp(Line* line, int base) {
     line->bytes[0] = base + INDEX_CMP_IMM;
     break;
   case ABSOLUTE:
-    if(is_direct_page(&operand, expr_class(line->expr1))) {
+    if(is_direct_page(&operand, operand_class(line))) {
       line->byte_size = 2;
       line->bytes[0] = base + INDEX_CMP_DP;
     }
-    else if(is_near(operand, expr_class(line->expr1))) {
+    else if(is_near(operand, operand_class(line))) {
       line->byte_size = 3;
       line->bytes[0] = base + INDEX_CMP_ABS;
     }
@@ -636,11 +673,11 @@ Status testbits(Line* line, int base) {
 
   if(line->addr_mode != ABSOLUTE)
     return invalid_operand(line);
-  if(is_direct_page(&operand, expr_class(line->expr1))) {
+  if(is_direct_page(&operand, operand_class(line))) {
     line->bytes[0] = base + TEST_DP;
     line->byte_size = 2;
   }
-  else if(is_near(operand, expr_class(line->expr1))) {
+  else if(is_near(operand, operand_class(line))) {
     line->bytes[0] = base + TEST_ABS;
     line->byte_size = 3;
   }
@@ -681,7 +718,8 @@ Status branch(Line* line, int op) {
 
   switch(line->addr_mode) {
   case ABSOLUTE:
-    if(operand - pc - 2 >= 128 || operand - pc - 2 < -128)
+    if(placed_with_pc(line) &&
+       (operand - pc - 2 >= 128 || operand - pc - 2 < -128))
       return branch_out_of_bounds(line);
     dest = (char)(operand - pc - 2);
     line->bytes[0] = op;
@@ -750,6 +788,21 @@ Status constant(Line* line, int op) {
 }
 
 Status adc(Line* line) { return primary(line, ADC_BASE, acc16); }
+
+Status align(Line* line) {
+  int operand;
+
+  if(in_section(line, "ALIGN") != OK)
+    return ERROR;
+  if(line->addr_mode != ABSOLUTE)
+    return invalid_operand(line);
+  if(placement(line->expr1, &operand, "ALIGN") != OK)
+    return ERROR;
+  if(operand < 1 || operand > 0x10000)
+    return operand_out_of_range(operand);
+  return OK;
+}
+
 Status and(Line* line) { return primary(line, AND_BASE, acc16); }
 
 Status ascii(Line* line) {
@@ -762,6 +815,48 @@ Status ascii(Line* line) {
 }
 
 Status asl(Line* line) { return group2(line, ASL_BASE); }
+
+Status at(Line* line) {
+  int operand;
+
+  if(in_section(line, "AT") != OK)
+    return ERROR;
+  if(line->addr_mode != ABSOLUTE)
+    return invalid_operand(line);
+  if(placement(line->expr1, &operand, "AT") != OK)
+    return ERROR;
+  if(operand < 0 || operand > 0xFFFFFF)
+    return operand_out_of_range(operand);
+  return OK;
+}
+
+/* BANK b, or BANK first,last */
+Status bank(Line* line) {
+  int first;
+  int last;
+
+  if(in_section(line, "BANK") != OK)
+    return ERROR;
+  if(line->addr_mode == ABSOLUTE) {
+    if(placement(line->expr1, &first, "BANK") != OK)
+      return ERROR;
+    last = first;
+  }
+  else if(line->addr_mode == LIST && line->expr1->e.num == 2) {
+    if(placement(line->expr2, &first, "BANK") != OK ||
+       placement(line->expr2->next, &last, "BANK") != OK)
+      return ERROR;
+  }
+  else
+    return invalid_operand(line);
+
+  if(first < 0 || first > 0xFF)
+    return operand_out_of_range(first);
+  if(last < first || last > 0xFF)
+    return operand_out_of_range(last);
+  return OK;
+}
+
 Status bcc(Line* line) { return branch(line, BCC); }
 Status bcs(Line* line) { return branch(line, BCS); }
 Status beq(Line* line) { return branch(line, BEQ); }
@@ -795,7 +890,7 @@ Status bit(Line* line) {
     break;
   case ABSOLUTE:
   case ABSOLUTE_INDEXED_X:
-    if(is_direct_page(&operand, expr_class(line->expr1))) {
+    if(is_direct_page(&operand, operand_class(line))) {
       line->byte_size = 2;
       switch(line->addr_mode) {
       case ABSOLUTE: line->bytes[0] = BIT_DP; break;
@@ -803,7 +898,7 @@ Status bit(Line* line) {
       default:;
       }
     }
-    else if(is_near(operand, expr_class(line->expr1))) {
+    else if(is_near(operand, operand_class(line))) {
       line->byte_size = 3;
       switch(line->addr_mode) {
       case ABSOLUTE: line->bytes[0] = BIT_ABS; break;
@@ -843,7 +938,8 @@ Status brl(Line* line) {
 
   switch(line->addr_mode) {
   case ABSOLUTE:
-    if(operand - pc - 3 >= 32768 || operand - pc - 8 < -32768)
+    if(placed_with_pc(line) &&
+       (operand - pc - 3 >= 32768 || operand - pc - 8 < -32768))
       return branch_out_of_bounds(line);
     dest = (char)(operand - pc - 3);
     line->bytes[0] = BRL;;
@@ -898,8 +994,6 @@ Status db(Line* line) {
       }
       if(operand > 0xFF)
         return operand_out_of_range(operand);
-      e->type = NUMBER;
-      e->e.num = operand;
       e = e->next;
     }
     /* leave it to the final assembler to write them */
@@ -941,8 +1035,6 @@ Status dw(Line* line) {
       }
       if(operand > 0xFFFF)
         return operand_out_of_range(operand);
-      e->type = NUMBER;
-      e->e.num = operand;
       e = e->next;
     }
     /* leave it to the final assembler to write them */
@@ -972,7 +1064,7 @@ Status equ(Line* line) {
     if(!line->label)
       return error("Must specify label for EQU");
     else
-      return set_val(line->label, operand);
+      return set_val(line->label, &line->label_cache, operand);
   }
   else
     return invalid_operand(line);
@@ -980,20 +1072,16 @@ Status equ(Line* line) {
 
 Status inc(Line* line) { return group2(line, INC_BASE); }
 
+/* only the file's size is needed until the program's written out */
 Status incbin(Line* line) {
-  FILE* fp;
+  struct stat st;
 
   if(line->addr_mode != STRING)
     return invalid_operand(line);
 
-  fp = fopen(line->expr1->e.str, "rb");
-  if(!fp)
+  if(stat(line->expr1->e.str, &st) != 0 || S_ISDIR(st.st_mode))
     return error("cannot open included file %s", line->expr1->e.str);
-
-  fseek(fp, 0L, SEEK_END);
-  line->byte_size = ftell(fp);
-
-  fclose(fp);
+  line->byte_size = st.st_size;
 
   return OK;
 }
@@ -1017,7 +1105,7 @@ Status jmp(Line* line) {
   case ABSOLUTE:
   case INDIRECT:
   case INDEXED_INDIRECT_X:
-    if(HI(operand) != HI(pc))
+    if(placed_with_pc(line) && HI(operand) != HI(pc))
       return jump_out_of_bounds(line);
     switch(line->addr_mode) {
     case ABSOLUTE: line->bytes[0] = JMP_ABS; break;
@@ -1062,7 +1150,7 @@ Status jml(Line* line) {
     break;
   case INDIRECT_LONG:
     line->byte_size = 3;
-    if(!is_near(operand, expr_class(line->expr1)))
+    if(!is_near(operand, operand_class(line)))
       return operand_out_of_range(operand);
     line->bytes[0] = JML_INDIRECT;
     line->bytes[1] = LO(operand);
@@ -1117,12 +1205,12 @@ Status jsr(Line* line) {
 
   switch(line->addr_mode) {
   case ABSOLUTE:
-    if(HI(operand) != HI(pc))
+    if(placed_with_pc(line) && HI(operand) != HI(pc))
       return jump_out_of_bounds(line);
     line->bytes[0] = JSR_ABS;
     break;
   case INDEXED_INDIRECT_X:
-    if(!is_near(operand, expr_class(line->expr1)))
+    if(!is_near(operand, operand_class(line)))
       return operand_out_of_range(operand);
     line->bytes[0] = JSR_ABS_INDEXED_INDIRECT;
     break;
@@ -1181,13 +1269,17 @@ Status org(Line* line) {
 
   if(eval(line->expr1, &operand) != OK) 
     return error("ORG operand must be known on first pass");
+  if(reloc_target(line->expr1))
+    return error("ORG operand must be a fixed address");
 
   line->byte_size = 0;
 
   switch(line->addr_mode) {
   case ABSOLUTE:
-    if(operand <= 0xFFFFFF)
+    if(operand <= 0xFFFFFF) {
       pc = operand;
+      current_section = 0;
+    }
     else
       return operand_out_of_range(operand);
     break;
@@ -1203,6 +1295,8 @@ Status pad(Line* line) {
 
   if(eval(line->expr1, &operand1) != OK)
     return error("PAD operand must be known on first pass");
+  if(!placed_with_pc(line))
+    return error("PAD operand must be in the same section");
 
   switch(line->addr_mode) {
   case ABSOLUTE:
@@ -1253,7 +1347,7 @@ Status pei(Line* line) {
 
   if(line->addr_mode != INDIRECT)
     return invalid_operand(line);
-  if(!is_direct_page(&operand, expr_class(line->expr1)))
+  if(!is_direct_page(&operand, operand_class(line)))
     return operand_out_of_range(operand);
 
   line->bytes[0] = PEI;
@@ -1273,7 +1367,7 @@ Status per(Line* line) {
       return OK;
   }
 
-  if(HI(pc) != HI(operand))
+  if(placed_with_pc(line) && HI(pc) != HI(operand))
     return relative_addr_out_of_bounds(line);
 
   displace = operand - pc;
@@ -1305,7 +1399,29 @@ Status rti(Line* line) { return implicit(line, RTI); }
 Status rtl(Line* line) { return implicit(line, RTL); }
 Status rts(Line* line) { return implicit(line, RTS); }
 Status sbc(Line* line) { return primary(line, SBC_BASE, acc16); }
+
+Status samebank(Line* line) {
+  if(in_section(line, "SAMEBANK") != OK)
+    return ERROR;
+  if(line->addr_mode != STRING)
+    return invalid_operand(line);
+  return OK;
+}
+
 Status sec(Line* line) { return implicit(line, SEC); }
+
+/* starts a new relocatable section, which the linker places on its own */
+Status section(Line* line) {
+  line->byte_size = 0;
+  if(line->addr_mode != STRING)
+    return invalid_operand(line);
+  if(!relocating)
+    return error("SECTION is only allowed in an object file (-c)");
+  pc = 0;
+  current_section = ++section_count;
+  return OK;
+}
+
 Status sed(Line* line) { return implicit(line, SED); }
 Status sei(Line* line) { return implicit(line, SEI); }
 Status sep(Line* line) { return constant(line, SEP); }
@@ -1322,6 +1438,8 @@ Status setd(Line* line) {
     else
       return OK;
   }
+  if(reloc_target(line->expr1))
+    return error("SETD operand must be a fixed value");
   switch(line->modifier) {
   case IMMEDIATE_HI: operand = (operand & 0xFFFF00) >> 8; break;
   case IMMEDIATE_MID: operand = operand & 0xFFFF; break;
@@ -1346,6 +1464,8 @@ Status setdbr(Line* line) {
     else
       return OK;
   }
+  if(reloc_target(line->expr1))
+    return error("SETDBR operand must be a fixed value");
   switch(line->modifier) {
   case IMMEDIATE_HI: operand = (operand & 0xFF0000) >> 16; break;
   case IMMEDIATE_MID: operand = (operand & 0x00FF00) >> 8; break;
@@ -1378,7 +1498,7 @@ Status stz(Line* line) {
   switch(line->addr_mode) {
   case ABSOLUTE:
   case ABSOLUTE_INDEXED_X:
-    if(is_direct_page(&operand, expr_class(line->expr1))) {
+    if(is_direct_page(&operand, operand_class(line))) {
       line->byte_size = 2;
       switch(line->addr_mode) {
       case ABSOLUTE: line->bytes[0] = STZ_DP; break;
@@ -1386,7 +1506,7 @@ Status stz(Line* line) {
       default:;
       }
     }
-    else if(is_near(operand, expr_class(line->expr1))) {
+    else if(is_near(operand, operand_class(line))) {
       line->byte_size = 3;
       switch(line->addr_mode) {
       case ABSOLUTE: line->bytes[0] = STZ_ABS; break;
@@ -5,9 +5,12 @@
 #include "lines.h"
 
 Status adc(Line* line);
+Status align(Line* line);
 Status and(Line* line);
 Status ascii(Line* line);
 Status asl(Line* line);
+Status at(Line* line);
+Status bank(Line* line);
 Status bcc(Line* line);
 Status bcs(Line* line);
 Status beq(Line* line);
@@ -84,7 +87,9 @@ Status rti(Line* line);
 Status rtl(Line* line);
 Status rts(Line* line);
 Status sbc(Line* line);
+Status samebank(Line* line);
 Status sec(Line* line);
+Status section(Line* line);
 Status sed(Line* line);
 Status sei(Line* line);
 Status sep(Line* line);
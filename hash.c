@@ -0,0 +1,120 @@
+#include "hash.h"
+
+#include <string.h>
+
+/* hashes file contents, for telling whether anything changed. data is
+   consumed in 32 byte stripes, one 8 byte word into each of four
+   independent lanes, so the compiler can keep them all in flight at once
+   (or in vector registers) */
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+
+static unsigned long long mix_lane(unsigned long long lane,
+                                    unsigned long long word);
+static unsigned long long read_word(const unsigned char* p);
+static void stripes(Hash_state* h, const unsigned char* p, size_t count);
+
+void hash_init(Hash_state* h) {
+  h->lanes[0] = PRIME1 + PRIME2;
+  h->lanes[1] = PRIME2;
+  h->lanes[2] = 0;
+  h->lanes[3] = -PRIME1;
+  h->len = 0;
+  h->tail_len = 0;
+}
+
+void hash_update(Hash_state* h, const void* data, size_t len) {
+  const unsigned char* p = data;
+
+  h->len += len;
+
+  /* finish off a partial stripe from last time */
+  if(h->tail_len) {
+    size_t n = 32 - h->tail_len;
+    if(n > len)
+      n = len;
+    memcpy(h->tail + h->tail_len, p, n);
+    h->tail_len += n;
+    p += n;
+    len -= n;
+    if(h->tail_len < 32)
+      return;
+    stripes(h, h->tail, 1);
+    h->tail_len = 0;
+  }
+
+  stripes(h, p, len / 32);
+  p += len & ~(size_t)31;
+  len &= 31;
+
+  memcpy(h->tail, p, len);
+  h->tail_len = len;
+}
+
+unsigned long long hash_final(Hash_state* h) {
+  unsigned long long hash;
+  int i;
+
+  hash = (h->lanes[0] << 1 | h->lanes[0] >> 63) +
+         (h->lanes[1] << 7 | h->lanes[1] >> 57) +
+         (h->lanes[2] << 12 | h->lanes[2] >> 52) +
+         (h->lanes[3] << 18 | h->lanes[3] >> 46);
+  hash += h->len;
+
+  for(i = 0; i + 8 <= h->tail_len; i += 8) {
+    hash ^= mix_lane(0, read_word(h->tail + i));
+    hash = (hash << 27 | hash >> 37) * PRIME1 + PRIME3;
+  }
+  for(; i < h->tail_len; i++) {
+    hash ^= h->tail[i] * PRIME3;
+    hash = (hash << 11 | hash >> 53) * PRIME1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= PRIME2;
+  hash ^= hash >> 29;
+  hash *= PRIME3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+unsigned long long hash_bytes(const void* data, size_t len) {
+  Hash_state h;
+  hash_init(&h);
+  hash_update(&h, data, len);
+  return hash_final(&h);
+}
+
+static unsigned long long mix_lane(unsigned long long lane,
+                                    unsigned long long word) {
+  lane += word * PRIME2;
+  lane = lane << 31 | lane >> 33;
+  return lane * PRIME1;
+}
+
+static unsigned long long read_word(const unsigned char* p) {
+  unsigned long long word;
+  memcpy(&word, p, 8);
+  return word;
+}
+
+static void stripes(Hash_state* h, const unsigned char* p, size_t count) {
+  unsigned long long l0 = h->lanes[0];
+  unsigned long long l1 = h->lanes[1];
+  unsigned long long l2 = h->lanes[2];
+  unsigned long long l3 = h->lanes[3];
+
+  for(; count; count--, p += 32) {
+    l0 = mix_lane(l0, read_word(p));
+    l1 = mix_lane(l1, read_word(p + 8));
+    l2 = mix_lane(l2, read_word(p + 16));
+    l3 = mix_lane(l3, read_word(p + 24));
+  }
+
+  h->lanes[0] = l0;
+  h->lanes[1] = l1;
+  h->lanes[2] = l2;
+  h->lanes[3] = l3;
+}
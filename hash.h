@@ -0,0 +1,19 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+
+/* the state of a content hash being fed data a piece at a time */
+typedef struct {
+  unsigned long long lanes[4];
+  unsigned long long len;
+  unsigned char tail[32];
+  int tail_len;
+} Hash_state;
+
+void hash_init(Hash_state* h);
+void hash_update(Hash_state* h, const void* data, size_t len);
+unsigned long long hash_final(Hash_state* h);
+unsigned long long hash_bytes(const void* data, size_t len);
+
+#endif
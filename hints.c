@@ -0,0 +1,201 @@
+#include "hints.h"
+
+#include "error.h"
+#include "expr.h"
+#include "hash.h"
+#include "lines.h"
+#include "precomp.h"
+#include "snap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* a hints file remembers the size each line with a forward reference
+   settled on last build, so the first pass can guess them instead of
+   assuming the worst. it's a header then the hints, sorted by key so they
+   can be binary searched straight out of the mapping. a line's key hashes its
+   file, line number and contents, so a line that's changed or moved just
+   finds no hint. a hint is only ever a guess - it's checked before it's
+   relied on */
+#define HINTS_MAGIC "SNAPHNT"
+#define HINTS_FORMAT 1
+
+typedef struct {
+  char magic[8];
+  char version[16];
+  int format;
+  int count;
+} Hints_header;
+
+typedef struct {
+  unsigned long long key;
+  int byte_size;
+  int pad;
+} Hint;
+
+static void* image = NULL;
+static long long image_size = 0;
+static Hint* hints = NULL;
+static int count = 0;
+
+static unsigned long long line_key(Line* line);
+static void hash_expr(Hash_state* h, Expr* e);
+static int compare_hints(const void* a, const void* b);
+
+/* maps in the hints file, if there's a usable one */
+void load_hints(char* filename) {
+  Hints_header* header;
+
+  free_hints();
+  image = map_file(filename, &image_size);
+  if(!image)
+    return;
+  header = image;
+  if(image_size < sizeof(Hints_header) ||
+     memcmp(header->magic, HINTS_MAGIC, sizeof(header->magic)) != 0 ||
+     strncmp(header->version, SNAP_VERSION, sizeof(header->version)) != 0 ||
+     header->format != HINTS_FORMAT ||
+     image_size != sizeof(Hints_header) +
+                   (long long)header->count * sizeof(Hint)) {
+    free_hints();
+    return;
+  }
+  hints = (Hint*)(header + 1);
+  count = header->count;
+}
+
+void free_hints() {
+  if(image && image_size)
+    munmap(image, image_size);
+  image = NULL;
+  image_size = 0;
+  hints = NULL;
+  count = 0;
+}
+
+int hint_count() {
+  return count;
+}
+
+/* the size line settled on last time, or -1 if there's no hint for it */
+int find_hint(Line* line) {
+  unsigned long long key = line_key(line);
+  int lo = 0;
+  int hi = count;
+
+  while(lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if(hints[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if(lo < count && hints[lo].key == key)
+    return hints[lo].byte_size;
+  return -1;
+}
+
+/* records the sizes lines settled on */
+Status save_hints(char* filename, Line** lines, int line_count) {
+  Hints_header header;
+  Hint* out;
+  char* temp;
+  FILE* fp;
+  int n = 0;
+  int ok;
+  int i;
+  int j;
+
+  out = malloc((line_count + 1) * sizeof(Hint));
+  for(i = 0; i < line_count; i++) {
+    out[i].key = line_key(lines[i]);
+    out[i].byte_size = lines[i]->byte_size;
+    out[i].pad = 0;
+  }
+
+  /* lines that look the same can't be told apart, so aren't hinted */
+  qsort(out, line_count, sizeof(Hint), compare_hints);
+  for(i = 0; i < line_count; i = j) {
+    for(j = i + 1; j < line_count && out[j].key == out[i].key; j++);
+    if(j == i + 1)
+      out[n++] = out[i];
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, HINTS_MAGIC, sizeof(header.magic));
+  strncpy(header.version, SNAP_VERSION, sizeof(header.version) - 1);
+  header.format = HINTS_FORMAT;
+  header.count = n;
+
+  /* the old file might still be mapped, so write a new one over it */
+  temp = malloc(strlen(filename) + 32);
+  sprintf(temp, "%s.%d", filename, (int)getpid());
+  fp = fopen(temp, "wb");
+  if(!fp) {
+    fprintf(stderr, "Error: could not open file %s for writing\n", temp);
+    free(temp);
+    free(out);
+    return ERROR;
+  }
+  ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+       fwrite(out, sizeof(Hint), n, fp) == n;
+  ok = fclose(fp) == 0 && ok;
+  if(ok)
+    ok = rename(temp, filename) == 0;
+  if(!ok) {
+    fprintf(stderr, "Error: writing %s\n", filename);
+    unlink(temp);
+  }
+  free(temp);
+  free(out);
+  return ok ? OK : ERROR;
+}
+
+static unsigned long long line_key(Line* line) {
+  Hash_state h;
+
+  hash_init(&h);
+  hash_update(&h, line->filename, strlen(line->filename) + 1);
+  hash_update(&h, &line->line_num, sizeof(line->line_num));
+  if(line->label)
+    hash_update(&h, line->label, strlen(line->label));
+  hash_update(&h, ":", 1);
+  hash_update(&h, line->instruction, strlen(line->instruction) + 1);
+  hash_update(&h, &line->addr_mode, sizeof(line->addr_mode));
+  hash_update(&h, &line->modifier, sizeof(line->modifier));
+  hash_expr(&h, line->expr1);
+  hash_expr(&h, line->expr2);
+  return hash_final(&h);
+}
+
+static void hash_expr(Hash_state* h, Expr* e) {
+  for(; e; e = e->next) {
+    hash_update(h, &e->type, sizeof(e->type));
+    switch(e->type) {
+    case NUMBER:
+      hash_update(h, &e->e.num, sizeof(e->e.num));
+      break;
+    case STRING_EXPR:
+      hash_update(h, e->e.str, strlen(e->e.str) + 1);
+      break;
+    case SYMBOL:
+      hash_update(h, e->e.sym, strlen(e->e.sym) + 1);
+      break;
+    case ADD:
+    case SUB:
+      hash_expr(h, e->e.subexpr[0]);
+      hash_expr(h, e->e.subexpr[1]);
+      break;
+    }
+  }
+  hash_update(h, ";", 1);
+}
+
+static int compare_hints(const void* a, const void* b) {
+  unsigned long long ka = ((Hint*)a)->key;
+  unsigned long long kb = ((Hint*)b)->key;
+  return ka < kb ? -1 : ka > kb;
+}
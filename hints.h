@@ -0,0 +1,16 @@
+#ifndef HINTS_H
+#define HINTS_H
+
+#include "error.h"
+#include "lines.h"
+
+/* added to an output file's name to give its hints file's */
+#define HINTS_SUFFIX ".hints"
+
+void load_hints(char* filename);
+void free_hints();
+int hint_count();
+int find_hint(Line* line);
+Status save_hints(char* filename, Line** lines, int count);
+
+#endif
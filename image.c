@@ -0,0 +1,276 @@
+#include "image.h"
+
+#include "error.h"
+#include "eval.h"
+#include "lines.h"
+#include "rom.h"
+#include "snap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+/* runs of matching bytes shorter than this don't split a changed range */
+#define CHANGE_GAP 16
+
+/* a stretch of the ROM the program fills, and the line it starts with */
+typedef struct {
+  int offset;
+  int size;
+  Line* line;
+} Span;
+
+/* the spans of the last ROM image built, in order */
+static Span* spans = NULL;
+static int span_count = 0;
+static int span_capacity = 0;
+
+static unsigned char* reserve(Image* image, int n);
+static int compare_spans(const void* a, const void* b);
+
+void init_image(Image* image) {
+  image->bytes = NULL;
+  image->size = 0;
+  image->capacity = 0;
+}
+
+void free_image(Image* image) {
+  free(image->bytes);
+  init_image(image);
+}
+
+/* iterates through the assembled lines, laying each out in the image */
+Status build_image(Image* image) {
+  Line* lp;
+
+  image->size = 0;
+  for(lp = first_line; lp; lp = lp->next)
+    if(!lp->dead && line_bytes(lp, reserve(image, lp->byte_size)) != OK)
+      return ERROR;
+  return OK;
+}
+
+/* writes the byte_size bytes an assembled line produces to dest */
+Status line_bytes(Line* lp, unsigned char* dest) {
+  int operand;
+
+  if(!lp->instruction) {
+    memcpy(dest, lp->bytes, lp->byte_size);
+    return OK;
+  }
+
+  line_num = lp->line_num;
+  current_filename = lp->filename;
+  if(strcasecmp(lp->instruction, "pad") == 0)
+    memset(dest, 0, lp->byte_size);
+  else if(strcasecmp(lp->instruction, "ascii") == 0)
+    memcpy(dest, lp->expr1->e.str, lp->byte_size);
+  else if(strcasecmp(lp->instruction, "incbin") == 0) {
+    FILE* fp = fopen(lp->expr1->e.str, "rb");
+    if(!fp)
+      return error("cannot open included file %s", lp->expr1->e.str);
+    if(fread(dest, 1, lp->byte_size, fp) != lp->byte_size) {
+      fclose(fp);
+      return error("included file %s changed size", lp->expr1->e.str);
+    }
+    fclose(fp);
+  }
+  else if(lp->addr_mode == LIST && strcasecmp(lp->instruction, "db") == 0) {
+    Expr* e;
+    for(e = lp->expr2; e; e = e->next) {
+      if(eval(e, &operand) != OK)
+        return ERROR;
+      *dest++ = operand;
+    }
+  }
+  else if(lp->addr_mode == LIST && strcasecmp(lp->instruction, "dw") == 0) {
+    Expr* e;
+    for(e = lp->expr2; e; e = e->next) {
+      if(eval(e, &operand) != OK)
+        return ERROR;
+      *dest++ = operand;
+      *dest++ = operand >> 8;
+    }
+  }
+  else
+    memcpy(dest, lp->bytes, lp->byte_size);
+  return OK;
+}
+
+Status write_image(Image* image, FILE* fp) {
+  if(fwrite(image->bytes, 1, image->size, fp) != image->size) {
+    fprintf(stderr, "Error: writing output file\n");
+    return ERROR;
+  }
+  return OK;
+}
+
+/* lays the assembled lines out in a ROM image, each at the offset in the
+   ROM its address maps to, rather than one after another. the gaps are
+   filled with fill, or zero if it's negative */
+Status build_rom_image(Image* image, Rom_map map, int fill) {
+  int bank_size = rom_bank_size(map);
+  Line* lp;
+
+  if(place_rom_lines(map) != OK)
+    return ERROR;
+
+  /* the ROM's made of whole banks */
+  image->size = 0;
+  if(span_count) {
+    Span* last = &spans[span_count-1];
+    reserve(image, (last->offset + last->size + bank_size - 1) / bank_size *
+                   bank_size);
+    memset(image->bytes, fill < 0 ? 0 : fill, image->size);
+  }
+  for(lp = first_line; lp; lp = lp->next) {
+    if(!lp->dead && lp->byte_size &&
+       line_bytes(lp, image->bytes + rom_offset(map, lp->addr)) != OK)
+      return ERROR;
+  }
+  return OK;
+}
+
+/* works out the spans of the ROM the assembled lines fill, without
+   needing their bytes. it's an error for a line to be anywhere but ROM,
+   or to overlap another */
+Status place_rom_lines(Rom_map map) {
+  Line* lp;
+  int i;
+
+  span_count = 0;
+  for(lp = first_line; lp; lp = lp->next) {
+    int offset;
+    Span* last = span_count ? &spans[span_count-1] : NULL;
+
+    if(lp->dead || !lp->byte_size)
+      continue;
+    line_num = lp->line_num;
+    current_filename = lp->filename;
+    offset = rom_offset(map, lp->addr);
+    if(offset < 0 ||
+       (lp->addr + lp->byte_size - 1) >> 16 != lp->addr >> 16 ||
+       rom_offset(map, lp->addr + lp->byte_size - 1) !=
+       offset + lp->byte_size - 1)
+      return error("address $%06X isn't in ROM", lp->addr);
+
+    if(last && last->offset + last->size == offset)
+      last->size += lp->byte_size;
+    else
+      add_rom_span(offset, lp->byte_size, lp);
+  }
+
+  /* once they're in order, anything overlapping is next to what it
+     overlaps */
+  qsort(spans, span_count, sizeof(Span), compare_spans);
+  for(i = 1; i < span_count; i++) {
+    Span* a = &spans[i-1];
+    Span* b = &spans[i];
+    if(b->offset < a->offset + a->size) {
+      line_num = b->line->line_num;
+      current_filename = b->line->filename;
+      return error("code at $%06X overlaps the code from line %d of %s",
+                   b->line->addr, a->line->line_num, a->line->filename);
+    }
+  }
+  return OK;
+}
+
+/* writes a ROM image. unless its gaps are to be filled, it's written a
+   span at a time into a file that's the ROM's size to begin with, so the
+   filesystem can leave the gaps as holes */
+Status write_rom_image(Image* image, FILE* fp, int fill) {
+  int fd = fileno(fp);
+  int i;
+
+  if(fill >= 0 || fp == stdout || fflush(fp) != 0 ||
+     ftruncate(fd, image->size) != 0)
+    return write_image(image, fp);
+  for(i = 0; i < span_count; i++) {
+    if(pwrite(fd, image->bytes + spans[i].offset, spans[i].size,
+              spans[i].offset) != spans[i].size) {
+      fprintf(stderr, "Error: writing output file\n");
+      return ERROR;
+    }
+  }
+  return OK;
+}
+
+/* notes that part of the ROM image has to be written, even if no line
+   puts anything there */
+void add_rom_span(int offset, int size, Line* line) {
+  if(span_count == span_capacity) {
+    span_capacity = span_capacity ? span_capacity * 2 : 256;
+    spans = realloc(spans, span_capacity * sizeof(Span));
+  }
+  spans[span_count].offset = offset;
+  spans[span_count].size = size;
+  spans[span_count].line = line;
+  span_count++;
+}
+
+/* brings the file at fd, which holds old, up to date with new by
+   rewriting only the ranges that differ. returns the number of bytes
+   written, or -1 on failure */
+int write_image_changes(Image* old, Image* new, int fd) {
+  int common = old->size < new->size ? old->size : new->size;
+  int written = 0;
+  int i = 0;
+
+  while(i < common) {
+    int start;
+    int end;
+
+    /* find the next differing byte */
+    while(i < common && old->bytes[i] == new->bytes[i]) i++;
+    if(i == common)
+      break;
+
+    /* extend the range until a long enough run matches again */
+    start = end = i;
+    while(i < common && i - end < CHANGE_GAP) {
+      if(old->bytes[i] != new->bytes[i])
+        end = i + 1;
+      i++;
+    }
+
+    if(pwrite(fd, new->bytes + start, end - start, start) != end - start)
+      return -1;
+    written += end - start;
+  }
+
+  /* the tail, if the image grew or shrank */
+  if(new->size > common) {
+    if(pwrite(fd, new->bytes + common, new->size - common, common) !=
+       new->size - common)
+      return -1;
+    written += new->size - common;
+  }
+  if(new->size != old->size && ftruncate(fd, new->size) != 0)
+    return -1;
+
+  return written;
+}
+
+/* makes room for n more bytes at the end of the image and returns a
+   pointer to them */
+static unsigned char* reserve(Image* image, int n) {
+  unsigned char* dest;
+
+  if(image->size + n > image->capacity) {
+    if(!image->capacity)
+      image->capacity = 0x8000;
+    while(image->size + n > image->capacity)
+      image->capacity *= 2;
+    image->bytes = realloc(image->bytes, image->capacity);
+  }
+  dest = image->bytes + image->size;
+  image->size += n;
+  return dest;
+}
+
+static int compare_spans(const void* a, const void* b) {
+  return ((Span*)a)->offset - ((Span*)b)->offset;
+}
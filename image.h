@@ -0,0 +1,28 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "error.h"
+#include "lines.h"
+#include "rom.h"
+
+#include <stdio.h>
+
+/* the assembled program, as it will appear on disk */
+typedef struct {
+  unsigned char* bytes;
+  int size;
+  int capacity;
+} Image;
+
+void init_image(Image* image);
+void free_image(Image* image);
+Status build_image(Image* image);
+Status line_bytes(Line* lp, unsigned char* dest);
+Status write_image(Image* image, FILE* fp);
+Status build_rom_image(Image* image, Rom_map map, int fill);
+Status place_rom_lines(Rom_map map);
+Status write_rom_image(Image* image, FILE* fp, int fill);
+void add_rom_span(int offset, int size, Line* line);
+int write_image_changes(Image* old, Image* new, int fd);
+
+#endif
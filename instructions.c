@@ -24,9 +24,12 @@ void init_instructions() {
   int i;
   Instruction_entry default_table[] = {
     {"adc", adc},
+    {"align", align},
     {"and", and},
     {"ascii", ascii},
     {"asl", asl},
+    {"at", at},
+    {"bank", bank},
     {"bcc", bcc},
     {"bcs", bcs},
     {"beq", beq},
@@ -99,8 +102,10 @@ void init_instructions() {
     {"rti", rti},
     {"rtl", rtl},
     {"rts", rts},
+    {"samebank", samebank},
     {"sbc", sbc},
     {"sec", sec},
+    {"section", section},
     {"sed", sed},
     {"sei", sei},
     {"sep", sep},
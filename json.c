@@ -0,0 +1,284 @@
+#include "json.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static Json* parse_value(char** lp);
+static char* parse_string(char** lp);
+static void skip_space(char** lp);
+static void put_utf8(char** dest, unsigned int c);
+
+/* parses text into a tree of values. returns NULL if it isn't valid JSON */
+Json* json_parse(char* text) {
+  char* lp = text;
+  Json* json = parse_value(&lp);
+
+  skip_space(&lp);
+  if(json && *lp) {
+    json_free(json);
+    return NULL;
+  }
+  return json;
+}
+
+void json_free(Json* json) {
+  while(json) {
+    Json* next = json->next;
+    json_free(json->child);
+    free(json->key);
+    free(json->str);
+    free(json);
+    json = next;
+  }
+}
+
+/* the member of an object called key, or NULL */
+Json* json_get(Json* json, char* key) {
+  Json* member;
+
+  if(!json || json->type != JSON_OBJECT)
+    return NULL;
+  for(member = json->child; member; member = member->next)
+    if(strcmp(member->key, key) == 0)
+      return member;
+  return NULL;
+}
+
+int json_int(Json* json, int fallback) {
+  if(!json || json->type != JSON_NUMBER)
+    return fallback;
+  return (int)json->num;
+}
+
+/* the value of a string, or NULL if it isn't one */
+char* json_str(Json* json) {
+  if(!json || json->type != JSON_STRING)
+    return NULL;
+  return json->str;
+}
+
+void json_init(Json_buffer* b) {
+  b->capacity = 256;
+  b->len = 0;
+  b->text = malloc(b->capacity);
+  b->text[0] = '\0';
+}
+
+/* appends to the buffer */
+void json_printf(Json_buffer* b, const char* format, ...) {
+  va_list args;
+  int n;
+
+  for(;;) {
+    va_start(args, format);
+    n = vsnprintf(b->text + b->len, b->capacity - b->len, format, args);
+    va_end(args);
+    if(b->len + n < b->capacity)
+      break;
+    while(b->len + n >= b->capacity)
+      b->capacity *= 2;
+    b->text = realloc(b->text, b->capacity);
+  }
+  b->len += n;
+}
+
+/* appends str as a quoted JSON string */
+void json_string(Json_buffer* b, char* str) {
+  json_printf(b, "\"");
+  for(; *str; str++) {
+    switch(*str) {
+    case '"': json_printf(b, "\\\""); break;
+    case '\\': json_printf(b, "\\\\"); break;
+    case '\n': json_printf(b, "\\n"); break;
+    case '\r': json_printf(b, "\\r"); break;
+    case '\t': json_printf(b, "\\t"); break;
+    default:
+      if((unsigned char)*str < 0x20)
+        json_printf(b, "\\u%04x", *str);
+      else
+        json_printf(b, "%c", *str);
+    }
+  }
+  json_printf(b, "\"");
+}
+
+static Json* parse_value(char** lp) {
+  Json* json = calloc(1, sizeof(Json));
+  Json** tail;
+
+  skip_space(lp);
+  switch(**lp) {
+  case '{':
+  case '[':
+    json->type = **lp == '{' ? JSON_OBJECT : JSON_ARRAY;
+    (*lp)++;
+    tail = &json->child;
+    skip_space(lp);
+    if(**lp == (json->type == JSON_OBJECT ? '}' : ']')) {
+      (*lp)++;
+      return json;
+    }
+    for(;;) {
+      char* key = NULL;
+      Json* member;
+
+      if(json->type == JSON_OBJECT) {
+        skip_space(lp);
+        if(**lp != '"' || !(key = parse_string(lp)))
+          break;
+        skip_space(lp);
+        if(**lp != ':') {
+          free(key);
+          break;
+        }
+        (*lp)++;
+      }
+      member = parse_value(lp);
+      if(!member) {
+        free(key);
+        break;
+      }
+      member->key = key;
+      *tail = member;
+      tail = &member->next;
+
+      skip_space(lp);
+      if(**lp == ',') {
+        (*lp)++;
+        continue;
+      }
+      if(**lp == (json->type == JSON_OBJECT ? '}' : ']')) {
+        (*lp)++;
+        return json;
+      }
+      break;
+    }
+    json_free(json);
+    return NULL;
+  case '"':
+    json->type = JSON_STRING;
+    json->str = parse_string(lp);
+    if(!json->str) {
+      json_free(json);
+      return NULL;
+    }
+    return json;
+  case 't':
+  case 'f':
+  case 'n':
+    if(strncmp(*lp, "true", 4) == 0) {
+      json->type = JSON_BOOL;
+      json->num = 1;
+      *lp += 4;
+    }
+    else if(strncmp(*lp, "false", 5) == 0) {
+      json->type = JSON_BOOL;
+      *lp += 5;
+    }
+    else if(strncmp(*lp, "null", 4) == 0)
+      *lp += 4;
+    else
+      break;
+    return json;
+  default: {
+    char* end;
+    json->type = JSON_NUMBER;
+    json->num = strtod(*lp, &end);
+    if(end == *lp)
+      break;
+    *lp = end;
+    return json;
+  }
+  }
+  free(json);
+  return NULL;
+}
+
+/* reads a quoted string, undoing its escapes. returns a copy of it, or
+   NULL if it's malformed */
+static char* parse_string(char** lp) {
+  char* str;
+  char* dest;
+  char* p;
+
+  /* escapes only ever shrink */
+  for(p = *lp + 1; *p && *p != '"'; p++)
+    if(*p == '\\' && p[1])
+      p++;
+  str = dest = malloc(p - *lp);
+  p = *lp + 1;
+
+  while(*p && *p != '"') {
+    if(*p != '\\') {
+      *dest++ = *p++;
+      continue;
+    }
+    p++;
+    switch(*p) {
+    case 'b': *dest++ = '\b'; break;
+    case 'f': *dest++ = '\f'; break;
+    case 'n': *dest++ = '\n'; break;
+    case 'r': *dest++ = '\r'; break;
+    case 't': *dest++ = '\t'; break;
+    case 'u': {
+      unsigned int c;
+      if(sscanf(p + 1, "%4x", &c) != 1) {
+        free(str);
+        return NULL;
+      }
+      p += 4;
+      /* surrogate pairs */
+      if(c >= 0xD800 && c < 0xDC00 && p[1] == '\\' && p[2] == 'u') {
+        unsigned int lo;
+        if(sscanf(p + 3, "%4x", &lo) == 1 && lo >= 0xDC00 && lo < 0xE000) {
+          c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+          p += 6;
+        }
+      }
+      put_utf8(&dest, c);
+      break;
+    }
+    case '\0':
+      free(str);
+      return NULL;
+    default: *dest++ = *p;
+    }
+    p++;
+  }
+  if(*p != '"') {
+    free(str);
+    return NULL;
+  }
+  *dest = '\0';
+  *lp = p + 1;
+  return str;
+}
+
+static void skip_space(char** lp) {
+  while(isspace(**lp)) (*lp)++;
+}
+
+static void put_utf8(char** dest, unsigned int c) {
+  char* d = *dest;
+  if(c < 0x80)
+    *d++ = c;
+  else if(c < 0x800) {
+    *d++ = 0xC0 | (c >> 6);
+    *d++ = 0x80 | (c & 0x3F);
+  }
+  else if(c < 0x10000) {
+    *d++ = 0xE0 | (c >> 12);
+    *d++ = 0x80 | ((c >> 6) & 0x3F);
+    *d++ = 0x80 | (c & 0x3F);
+  }
+  else {
+    *d++ = 0xF0 | (c >> 18);
+    *d++ = 0x80 | ((c >> 12) & 0x3F);
+    *d++ = 0x80 | ((c >> 6) & 0x3F);
+    *d++ = 0x80 | (c & 0x3F);
+  }
+  *dest = d;
+}
@@ -0,0 +1,40 @@
+#ifndef JSON_H
+#define JSON_H
+
+typedef enum {JSON_NULL,
+              JSON_BOOL,
+              JSON_NUMBER,
+              JSON_STRING,
+              JSON_ARRAY,
+              JSON_OBJECT
+} Json_type;
+
+/* a parsed JSON value. the members of an array or object are a linked list
+   of children */
+typedef struct Json_t {
+  Json_type type;
+  char* key; /* if it's a member of an object */
+  double num; /* also used for booleans */
+  char* str;
+  struct Json_t* child;
+  struct Json_t* next;
+} Json;
+
+/* a growable string that JSON is written into */
+typedef struct {
+  char* text;
+  int len;
+  int capacity;
+} Json_buffer;
+
+Json* json_parse(char* text);
+void json_free(Json* json);
+Json* json_get(Json* json, char* key);
+int json_int(Json* json, int fallback);
+char* json_str(Json* json);
+
+void json_init(Json_buffer* b);
+void json_printf(Json_buffer* b, const char* format, ...);
+void json_string(Json_buffer* b, char* str);
+
+#endif
@@ -12,40 +12,305 @@
 
 typedef struct {
   char* name;
+  unsigned int hash;
   int val;
   int defined;
+  char overridden;
+  char orphaned; /* its line was thrown away, and nothing's defined it since */
+  Line* line; /* where it was defined */
 } Symbol_entry;
 
-Symbol_entry symbol_table[SYMBOL_BUCKETS];
+/* the table doubles whenever it becomes half full */
+Symbol_entry* symbol_table = NULL;
+static int symbol_buckets = 0;
+static int symbol_count = 0;
 
+/* changes whenever symbols move to a different slot, invalidating every
+   Symbol_cache */
+static int generation = 0;
+
+/* the pass before lines were last thrown away. only definitions made
+   since then still point at lines that exist */
+static int lines_freed_serial = 0;
+
+/* every time a line used a symbol's value from before it was defined in
+   the current pass (i.e. a forward reference) */
+typedef struct {
+  Line* line;
+  char* name;
+  int val;
+} Early_read;
+
+static Early_read* early_reads = NULL;
+static int early_count = 0;
+static int early_capacity = 0;
+
+/* while relaxing, the symbols whose values change are noted, with when
+   they did, since the lines assembled after that have already seen it */
+typedef struct {
+  char* name;
+  Symbol_cache cache; /* its slot, unless the table's grown since */
+  int serial; /* line_serial as it moved */
+} Moved;
+
+static int relaxing = 0;
+static Moved* moved = NULL;
+static int moved_count = 0;
+static int moved_capacity = 0;
+
+/* the lines whose expressions use each symbol, by slot, while they're
+   being kept. apart from the table so as not to slow down lookups */
+typedef struct {
+  Line** lines;
+  int count;
+  int capacity;
+} Readers;
+
+static Readers* readers = NULL;
+
+static int find_symbol(char* sym, Symbol_cache* cache);
+static int insert_symbol(char* sym);
 static int lookup_symbol(char* sym);
 static char* add_namespace(char* sym);
+static void grow_symtable();
+static void note_moved(int i);
+static void add_reader(Expr* e, Line* lp);
+static void drop_reader(Expr* e, Line* lp);
 
-Status sym_val(char* sym, int* dest) {
-  int i = lookup_symbol(sym);
+Status sym_val(char* sym, Symbol_cache* cache, int* dest) {
+  int i = find_symbol(sym, cache);
 
   if(symbol_table[i].name && symbol_table[i].defined) {
     *dest = symbol_table[i].val;
+
+    /* remember forward references, in case the symbol moves this pass */
+    if(symbol_table[i].defined > 0 && symbol_table[i].defined != pass_serial
+       && current_line) {
+      if(early_count == early_capacity) {
+        early_capacity = early_capacity ? early_capacity * 2 : 1024;
+        early_reads = realloc(early_reads, early_capacity*sizeof(Early_read));
+      }
+      early_reads[early_count].line = current_line;
+      early_reads[early_count].name = symbol_table[i].name;
+      early_reads[early_count].val = *dest;
+      early_count++;
+    }
     return OK;
   }
   else return ERROR;
 }
 
-Status set_val(char* sym, int val) {
-  int i = lookup_symbol(sym);
+Status set_val(char* sym, Symbol_cache* cache, int val) {
+  int i = find_symbol(sym, cache);
+
+  if(!symbol_table[i].name) {
+    i = insert_symbol(sym);
+    if(cache) {
+      cache->slot = i;
+      cache->generation = generation;
+    }
+  }
 
-  if(symbol_table[i].name && symbol_table[i].defined == pass + 1)
+  /* values given on the command line win over the source */
+  if(symbol_table[i].overridden)
+    return OK;
+
+  /* while relaxing, a symbol other lines define keeps their older serial,
+     but a line can define its own label again */
+  if(relaxing ? symbol_table[i].defined > 0 && !symbol_table[i].orphaned &&
+                symbol_table[i].line != current_line
+              : symbol_table[i].defined == pass_serial)
     return redefined_label(sym);
   else {
-    intern_symbol(sym);
-    symbol_table[i].defined = pass + 1;
+    if(relaxing && (!symbol_table[i].defined || symbol_table[i].val != val))
+      note_moved(i);
+    symbol_table[i].orphaned = 0;
+    symbol_table[i].defined = pass_serial;
     symbol_table[i].val = val;
+    symbol_table[i].line = current_line;
     return OK;
   }
 }
 
+/* gives sym a fixed value that any definition in the source is ignored in
+   favour of */
+void override_symbol(char* sym, int val) {
+  int i = insert_symbol(sym);
+
+  symbol_table[i].defined = -1;
+  symbol_table[i].overridden = 1;
+  symbol_table[i].val = val;
+}
+
+/* undefines every symbol that hasn't been defined since the pass numbered
+   serial, i.e. the ones that have since been removed from the source.
+   returns how many there were */
+int forget_stale_symbols(int serial) {
+  int count = 0;
+  int i;
+
+  for(i = 0; i < symbol_buckets; i++) {
+    if(symbol_table[i].name && symbol_table[i].defined > 0 &&
+       symbol_table[i].defined < serial) {
+      symbol_table[i].defined = 0;
+      count++;
+    }
+  }
+  return count;
+}
+
+/* starts or stops relaxing, see reassemble() */
+void relax(int on) {
+  relaxing = on;
+  moved_count = 0;
+}
+
+/* finds the lines that use a symbol whose value has changed since the
+   last call, and that haven't been assembled since it did. lines is set
+   to an array of count of them, which the caller frees */
+int moved_readers(Line*** lines) {
+  int count = 0;
+  int i;
+  int j;
+
+  for(i = 0; i < moved_count && readers; i++)
+    count += readers[find_symbol(moved[i].name, &moved[i].cache)].count;
+  *lines = malloc((count + 1) * sizeof(Line*));
+  count = 0;
+  for(i = 0; i < moved_count && readers; i++) {
+    Readers* r = &readers[find_symbol(moved[i].name, &moved[i].cache)];
+    for(j = 0; j < r->count; j++)
+      if(r->lines[j]->assembled <= moved[i].serial)
+        (*lines)[count++] = r->lines[j];
+  }
+  moved_count = 0;
+  return count;
+}
+
+/* undefines the symbols whose lines were thrown away and that nothing's
+   defined since, noting them as moved. returns how many there were */
+int forget_orphans() {
+  int count = 0;
+  int i;
+
+  for(i = 0; i < symbol_buckets; i++) {
+    if(symbol_table[i].name && symbol_table[i].orphaned) {
+      symbol_table[i].orphaned = 0;
+      if(symbol_table[i].defined > 0) {
+        symbol_table[i].defined = 0;
+        note_moved(i);
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+/* starts keeping track of which lines use each symbol, from the program
+   as it is now */
+void index_readers() {
+  Line* lp;
+  int i;
+
+  if(!readers)
+    readers = calloc(symbol_buckets, sizeof(Readers));
+  for(i = 0; i < symbol_buckets; i++)
+    readers[i].count = 0;
+  for(lp = first_line; lp; lp = lp->next)
+    add_readers(lp);
+}
+
+/* notes the symbols a new line uses */
+void add_readers(Line* lp) {
+  Expr* e;
+
+  if(!readers)
+    return;
+  for(e = lp->expr1; e; e = e->next)
+    add_reader(e, lp);
+  for(e = lp->expr2; e; e = e->next)
+    add_reader(e, lp);
+}
+
+/* must be called before a line is freed. it no longer uses anything, and
+   if it defined a symbol, the symbol is an orphan until it's defined
+   somewhere else */
+void forget_line(Line* lp) {
+  char* backup_label = current_label;
+  int backup_len = current_label_len;
+  Expr* e;
+  int i;
+
+  if(readers) {
+    for(e = lp->expr1; e; e = e->next)
+      drop_reader(e, lp);
+    for(e = lp->expr2; e; e = e->next)
+      drop_reader(e, lp);
+  }
+  if(!lp->label || !lp->assembled || !lp->scope)
+    return;
+
+  /* a local label is named after the global one it was assembled under */
+  current_label = lp->scope;
+  current_label_len = strlen(lp->scope);
+  i = find_symbol(lp->label, &lp->label_cache);
+  current_label = backup_label;
+  current_label_len = backup_len;
+  if(symbol_table[i].name && symbol_table[i].line == lp) {
+    symbol_table[i].line = NULL;
+    symbol_table[i].orphaned = 1;
+  }
+}
+
+/* the line a symbol was defined on, or NULL if that isn't known */
+Line* sym_line(char* sym) {
+  int i = lookup_symbol(sym);
+
+  if(!symbol_table[i].name || symbol_table[i].defined <= lines_freed_serial)
+    return NULL;
+  return symbol_table[i].line;
+}
+
+/* must be called whenever lines are freed */
+void lines_freed() {
+  lines_freed_serial = pass_serial;
+}
+
+void clear_early_reads() {
+  early_count = 0;
+}
+
+/* finds the lines that were assembled against a value a symbol no longer
+   has. lines is set to an array of count of them, which the caller frees */
+int find_stale_lines(Line*** lines) {
+  int count = 0;
+  int i;
+
+  *lines = malloc((early_count + 1) * sizeof(Line*));
+  for(i = 0; i < early_count; i++) {
+    int val;
+    if(sym_val(early_reads[i].name, NULL, &val) != OK ||
+       val != early_reads[i].val) {
+      /* a line's reads are all logged together */
+      if(!count || (*lines)[count-1] != early_reads[i].line)
+        (*lines)[count++] = early_reads[i].line;
+    }
+  }
+  return count;
+}
+
 void init_symtable() {
-  bzero(symbol_table, sizeof(symbol_table));
+  int i;
+
+  for(i = 0; readers && i < symbol_buckets; i++)
+    free(readers[i].lines);
+  free(readers);
+  readers = NULL;
+  free(symbol_table);
+  symbol_buckets = SYMBOL_BUCKETS;
+  symbol_count = 0;
+  symbol_table = calloc(symbol_buckets, sizeof(Symbol_entry));
+  generation++;
 }
 
 /* adds a copy of sym to the symbol table, with no value.
@@ -53,59 +318,198 @@ void init_symtable() {
    if symbol is already in the table, do nothing; simply return a pointer
    to the copy.*/
 char* intern_symbol(char* sym) {
-  int i = lookup_symbol(sym);
-  if(symbol_table[i].name)
-    return symbol_table[i].name;
-  else {
-    char* name_copy;
-    if(sym[0] == '.')
-      name_copy = add_namespace(sym);
-    else
-      name_copy = strdup(sym);
-    symbol_table[i].name = name_copy;
-    return name_copy;
-  }
+  int i = insert_symbol(sym);
+  return symbol_table[i].name;
+}
+
+/* like intern_symbol, but quicker for a symbol that's cached */
+char* intern_cached(char* sym, Symbol_cache* cache) {
+  int i = find_symbol(sym, cache);
+  if(!symbol_table[i].name)
+    i = insert_symbol(sym);
+  return symbol_table[i].name;
 }
 
 void dump_symbols(FILE* fp) {
   int i;
-  for(i = 0; i < SYMBOL_BUCKETS; i++) {
+  for(i = 0; i < symbol_buckets; i++) {
     if(symbol_table[i].name && symbol_table[i].defined)
       fprintf(fp, "%s: $%X\n", symbol_table[i].name, symbol_table[i].val);
   }
 }
 
-int lookup_symbol(char* sym) {
-  char* name_copy;
+/* sets list to a new array of every defined symbol, and returns how many
+   there are. the names stay valid as long as the table does */
+int list_symbols(Symbol_value** list) {
+  int count = 0;
+  int i;
+
+  *list = malloc((symbol_count ? symbol_count : 1) * sizeof(Symbol_value));
+  for(i = 0; i < symbol_buckets; i++) {
+    if(symbol_table[i].name && symbol_table[i].defined) {
+      (*list)[count].name = symbol_table[i].name;
+      (*list)[count].val = symbol_table[i].val;
+      (*list)[count].line = symbol_table[i].defined > lines_freed_serial ?
+                            symbol_table[i].line : NULL;
+      count++;
+    }
+  }
+  return count;
+}
+
+/* like lookup_symbol, but tries where the symbol was found last time
+   first */
+static int find_symbol(char* sym, Symbol_cache* cache) {
+  int i;
+
+  if(cache && cache->generation == generation)
+    return cache->slot;
+
+  i = lookup_symbol(sym);
+  if(cache && symbol_table[i].name) {
+    cache->slot = i;
+    cache->generation = generation;
+  }
+  return i;
+}
+
+/* like lookup_symbol, but adds sym to the table if it isn't there yet */
+static int insert_symbol(char* sym) {
+  int i;
+
+  if((symbol_count + 1) * 2 > symbol_buckets)
+    grow_symtable();
+
+  i = lookup_symbol(sym);
+  if(!symbol_table[i].name) {
+    if(sym[0] == '.')
+      symbol_table[i].name = add_namespace(sym);
+    else
+      symbol_table[i].name = strdup(sym);
+    symbol_table[i].hash = hash_str(symbol_table[i].name);
+    symbol_count++;
+  }
+  return i;
+}
+
+static int lookup_symbol(char* sym) {
+  char* name = sym;
+  unsigned int hash;
   int i;
 
   if(sym[0] == '.')
-    name_copy = add_namespace(sym);
-  else
-    name_copy = strdup(sym);
+    name = add_namespace(sym);
 
-  i = hash_str(name_copy) % SYMBOL_BUCKETS;
-  while(symbol_table[i].name && 
-        strcmp(name_copy, symbol_table[i].name))
-    i = (i + 1) % SYMBOL_BUCKETS;
+  /* comparing the full hashes first saves chasing most of the names */
+  hash = hash_str(name);
+  i = hash % symbol_buckets;
+  while(symbol_table[i].name &&
+        (symbol_table[i].hash != hash || strcmp(name, symbol_table[i].name)))
+    i = (i + 1) % symbol_buckets;
 
-  free(name_copy);
+  if(name != sym)
+    free(name);
 
   return i;
 }
 
+/* doubles the number of buckets, rehashing everything into them */
+static void grow_symtable() {
+  Symbol_entry* old = symbol_table;
+  Readers* old_readers = readers;
+  int old_buckets = symbol_buckets;
+  int i;
+
+  symbol_buckets *= 2;
+  symbol_table = calloc(symbol_buckets, sizeof(Symbol_entry));
+  if(old_readers)
+    readers = calloc(symbol_buckets, sizeof(Readers));
+  for(i = 0; i < old_buckets; i++) {
+    if(old[i].name) {
+      int j = old[i].hash % symbol_buckets;
+      while(symbol_table[j].name)
+        j = (j + 1) % symbol_buckets;
+      symbol_table[j] = old[i];
+      if(old_readers)
+        readers[j] = old_readers[i];
+    }
+  }
+  free(old);
+  free(old_readers);
+  generation++;
+}
+
+static void note_moved(int i) {
+  if(moved_count == moved_capacity) {
+    moved_capacity = moved_capacity ? moved_capacity * 2 : 256;
+    moved = realloc(moved, moved_capacity * sizeof(Moved));
+  }
+  moved[moved_count].name = symbol_table[i].name;
+  moved[moved_count].cache.slot = i;
+  moved[moved_count].cache.generation = generation;
+  moved[moved_count].serial = line_serial;
+  moved_count++;
+}
+
+static void add_reader(Expr* e, Line* lp) {
+  Readers* r;
+  int i;
+
+  switch(e->type) {
+  case SYMBOL:
+    i = find_symbol(e->e.sym, &e->cache);
+    if(!symbol_table[i].name)
+      return;
+    r = &readers[i];
+    if(r->count == r->capacity) {
+      r->capacity = r->capacity ? r->capacity * 2 : 4;
+      r->lines = realloc(r->lines, r->capacity * sizeof(Line*));
+    }
+    r->lines[r->count++] = lp;
+    break;
+  case ADD:
+  case SUB:
+    add_reader(e->e.subexpr[0], lp);
+    add_reader(e->e.subexpr[1], lp);
+    break;
+  default:
+    break;
+  }
+}
+
+static void drop_reader(Expr* e, Line* lp) {
+  Readers* r;
+  int i;
+
+  switch(e->type) {
+  case SYMBOL:
+    r = &readers[find_symbol(e->e.sym, &e->cache)];
+    for(i = 0; i < r->count; i++)
+      if(r->lines[i] == lp)
+        r->lines[i--] = r->lines[--r->count];
+    break;
+  case ADD:
+  case SUB:
+    drop_reader(e->e.subexpr[0], lp);
+    drop_reader(e->e.subexpr[1], lp);
+    break;
+  default:
+    break;
+  }
+}
+
 /* if we have a local label like .loop, and a global label like Function,
    return Function:loop.
    The user cannot accidentally create this label because : is forbidden in
    labels */
-char* add_namespace(char* sym) {
+static char* add_namespace(char* sym) {
   char* copy;
   int len = strlen(sym) + current_label_len;
-  
+
   copy = malloc(len + 1);
-  memcpy(copy, current_label, len);
+  memcpy(copy, current_label, current_label_len);
   copy[current_label_len] = ':';
-  strcpy(&copy[current_label_len+1], &sym[1]); 
+  strcpy(&copy[current_label_len+1], &sym[1]);
 
   return copy;
 }
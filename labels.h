@@ -2,13 +2,35 @@
 #define LABELS_H
 
 #include "error.h"
+#include "lines.h"
 
 #include <stdio.h>
 
+/* a defined symbol and its value */
+typedef struct {
+  char* name;
+  int val;
+  Line* line; /* where it was defined, or NULL if that isn't known */
+} Symbol_value;
+
 void init_symtable();
+void clear_early_reads();
+int find_stale_lines(Line*** lines);
 char* intern_symbol(char* sym);
-Status set_val(char* sym, int val);
-Status sym_val(char* sym, int* dest);
+char* intern_cached(char* sym, Symbol_cache* cache);
+void lines_freed();
+int forget_stale_symbols(int serial);
+void relax(int on);
+int moved_readers(Line*** lines);
+int forget_orphans();
+void index_readers();
+void add_readers(Line* lp);
+void forget_line(Line* lp);
+void override_symbol(char* sym, int val);
+Status set_val(char* sym, Symbol_cache* cache, int val);
+Status sym_val(char* sym, Symbol_cache* cache, int* dest);
+Line* sym_line(char* sym);
 void dump_symbols(FILE* fp);
+int list_symbols(Symbol_value** list);
 
 #endif
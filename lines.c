@@ -1,17 +1,31 @@
 #include "lines.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 Line* first_line = NULL;
 Line* last_line = NULL;
 
+Source* first_source = NULL;
+Source* current_source = NULL;
+static Source* last_source = NULL;
+
+static void free_expr(Expr* e);
+
 /* allocates and initializes a new Line. returns NULL on failure */
 Line* alloc_line() {
   Line* l = malloc(sizeof(Line));
   if(l) {
+    l->next = NULL;
+    l->source = current_source;
     l->label = NULL;
+    l->label_cache.generation = 0;
     l->instruction = NULL;
     l->byte_size = 0;
+    l->section = 0;
+    l->scope = NULL;
+    l->assembled = 0;
+    l->dead = 0;
     l->expr1 = NULL;
     l->expr2 = NULL;
     l->modifier = NONE;
@@ -29,3 +43,103 @@ void add_line(Line* line) {
   }
 }
 
+
+/* frees a line along with everything it owns. symbols are interned and
+   are left alone */
+void free_line(Line* line) {
+  free(line->label);
+  free_expr(line->expr1);
+  free_expr(line->expr2);
+  free(line);
+}
+
+/* records that filename is about to be read, included from
+   current_source while label was the current global label */
+Source* add_source(char* filename, char* label) {
+  Source* s = malloc(sizeof(Source));
+  s->next = NULL;
+  s->parent = current_source;
+  s->filename = strdup(filename);
+  s->path = NULL;
+  s->file = NULL;
+  s->label = strdup(label);
+  s->prev = last_line;
+  s->stale = 0;
+  s->capturing = 0;
+  s->text = NULL;
+  s->text_size = 0;
+
+  if(!first_source)
+    first_source = last_source = s;
+  else {
+    last_source->next = s;
+    last_source = s;
+  }
+  return s;
+}
+
+/* takes source out of the list of files read in and frees it */
+void remove_source(Source* source) {
+  Source* s;
+  Source* prev = NULL;
+
+  for(s = first_source; s && s != source; s = s->next)
+    prev = s;
+  if(!s)
+    return;
+
+  if(prev)
+    prev->next = s->next;
+  else
+    first_source = s->next;
+  if(last_source == s)
+    last_source = prev;
+
+  free(s->filename);
+  free(s->path);
+  free(s->label);
+  free(s->text);
+  free(s);
+}
+
+/* was line read from source, or from a file source included? */
+int from_source(Line* line, Source* source) {
+  return within_source(line->source, source);
+}
+
+int within_source(Source* source, Source* ancestor) {
+  for(; source; source = source->parent)
+    if(source == ancestor)
+      return 1;
+  return 0;
+}
+
+/* the canonical path of a source, so it can be matched against other
+   names for the same file */
+char* source_path(Source* source) {
+  if(!source->path) {
+    source->path = realpath(source->filename, NULL);
+    if(!source->path)
+      source->path = strdup(source->filename);
+  }
+  return source->path;
+}
+
+static void free_expr(Expr* e) {
+  while(e) {
+    Expr* next = e->next;
+    switch(e->type) {
+    case ADD:
+    case SUB:
+      free_expr(e->e.subexpr[0]);
+      free_expr(e->e.subexpr[1]);
+      break;
+    case STRING_EXPR:
+      free(e->e.str);
+      break;
+    default:;
+    }
+    free(e);
+    e = next;
+  }
+}
@@ -26,14 +26,45 @@ typedef enum {NONE,
               IMMEDIATE_LO
 } Addressing_modifier;
 
+/* a file that was read in, either the main file or one it INCSRC'd */
+typedef struct Source_tag {
+  /* list of every file read in */
+  struct Source_tag* next;
+
+  /* the file that included this one, NULL for the main file */
+  struct Source_tag* parent;
+
+  char* filename;
+  char* path; /* canonical path, filled in when needed */
+  struct File_tag* file; /* NULL if it couldn't be found */
+
+  /* the global label in effect when it was included */
+  char* label;
+
+  /* the line just before this file's lines, NULL if they start the list */
+  struct Line_tag* prev;
+
+  /* the file has changed since it was read */
+  int stale;
+
+  /* its lines are being recorded, to be replayed next time it's included */
+  int capturing;
+
+  /* its text as it was read, if it's being kept for a listing */
+  char* text;
+  long long text_size;
+} Source;
+
 typedef struct Line_tag {
   /* linked list pointer */
   struct Line_tag* next;
 
   char* filename;
   int line_num;
+  Source* source;
 
   char* label;
+  Symbol_cache label_cache;
 
   char* instruction;
 
@@ -44,14 +75,39 @@ typedef struct Line_tag {
   Expr* expr1;
   Expr* expr2;
 
+  /* where the line was last assembled, and the assumptions in effect */
+  int addr;
+  int section; /* nonzero if placed by the linker, see object.h */
+  int d;
+  int dbr;
+  char acc16;
+  char index16;
+  char* scope; /* the global label in effect after its own label */
+
+  /* the line_serial it was last assembled at, or 0 if it hasn't been
+     since it was read, see reassemble() */
+  int assembled;
+
   /* the assembled machine code for this line */
   int byte_size;
   char bytes[4];
+
+  /* left out of the program by --gc, see gc.c */
+  int dead;
 } Line;
 
 extern Line* first_line;
+extern Line* last_line;
+extern Source* first_source;
+extern Source* current_source;
 
 Line* alloc_line();
 void add_line(Line* line);
+void free_line(Line* line);
+Source* add_source(char* filename, char* label);
+void remove_source(Source* source);
+int from_source(Line* line, Source* source);
+int within_source(Source* source, Source* ancestor);
+char* source_path(Source* source);
 
 #endif
@@ -0,0 +1,233 @@
+#include "linetable.h"
+
+#include "error.h"
+#include "lines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  int addr;
+  int file;
+  int line;
+  int order; /* where it is in the program, so ties keep that order */
+} Row;
+
+typedef struct {
+  unsigned char* bytes;
+  int size;
+  int capacity;
+} Buffer;
+
+static int file_id(char* filename);
+static void add_range(int file, int line, int block, int block_start);
+static void put_byte(Buffer* b, int byte);
+static void put_unsigned(Buffer* b, unsigned int n);
+static void put_signed(Buffer* b, int n);
+static int compare_rows(const void* a, const void* b);
+static int compare_ranges(const void* a, const void* b);
+
+static char** files = NULL;
+static int file_count = 0;
+static int last_file = -1;
+
+static Linetable_range* ranges = NULL;
+static int range_count = 0;
+static int range_capacity = 0;
+
+/* writes the line table for the assembled program, in one sweep over the
+   lines and one over the rows */
+Status write_line_table(FILE* fp) {
+  Linetable_header header;
+  Linetable_block* blocks;
+  Buffer program = {NULL, 0, 0};
+  Buffer strings = {NULL, 0, 0};
+  int* file_names;
+  Row* rows = NULL;
+  int row_count = 0;
+  int row_capacity = 0;
+  int block_count;
+  Line* lp;
+  int i;
+
+  file_count = 0;
+  last_file = -1;
+  range_count = 0;
+  for(lp = first_line; lp; lp = lp->next) {
+    if(lp->dead || !lp->byte_size)
+      continue;
+    if(row_count == row_capacity) {
+      row_capacity = row_capacity ? row_capacity * 2 : 0x1000;
+      rows = realloc(rows, row_capacity * sizeof(Row));
+    }
+    rows[row_count].addr = lp->addr;
+    rows[row_count].file = file_id(lp->filename);
+    rows[row_count].line = lp->line_num;
+    rows[row_count].order = row_count;
+    row_count++;
+  }
+  qsort(rows, row_count, sizeof(Row), compare_rows);
+
+  block_count = (row_count + LINETABLE_BLOCK - 1) / LINETABLE_BLOCK;
+  blocks = malloc((block_count + 1) * sizeof(Linetable_block));
+  for(i = 0; i < row_count; i++) {
+    Row* r = &rows[i];
+    int block = i / LINETABLE_BLOCK;
+
+    if(i % LINETABLE_BLOCK == 0) {
+      blocks[block].addr = r->addr;
+      blocks[block].file = r->file;
+      blocks[block].line = r->line;
+      blocks[block].program = program.size;
+    }
+    else {
+      int changed = r->file != r[-1].file;
+      put_unsigned(&program, (unsigned int)(r->addr - r[-1].addr) << 1 |
+                             changed);
+      if(changed)
+        put_unsigned(&program, r->file);
+      put_signed(&program, r->line - r[-1].line);
+    }
+    add_range(r->file, r->line, block, i % LINETABLE_BLOCK == 0);
+  }
+
+  /* sort the ranges for searching by line, and work out how far back each
+     file's overlap */
+  qsort(ranges, range_count, sizeof(Linetable_range), compare_ranges);
+  for(i = 0; i < range_count; i++) {
+    Linetable_range* r = &ranges[i];
+    r->reach = r->last_line;
+    if(i && r[-1].file == r->file && r[-1].reach > r->reach)
+      r->reach = r[-1].reach;
+  }
+
+  file_names = malloc((file_count + 1) * sizeof(int));
+  for(i = 0; i < file_count; i++) {
+    char* c;
+    file_names[i] = strings.size;
+    for(c = files[i]; *c; c++)
+      put_byte(&strings, *c);
+    put_byte(&strings, 0);
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LINETABLE_MAGIC, sizeof(header.magic));
+  header.format = LINETABLE_FORMAT;
+  header.file_count = file_count;
+  header.row_count = row_count;
+  header.block_count = block_count;
+  header.range_count = range_count;
+  header.program_size = program.size;
+  header.strings_size = strings.size;
+
+  fwrite(&header, sizeof(header), 1, fp);
+  fwrite(file_names, sizeof(int), file_count, fp);
+  fwrite(blocks, sizeof(Linetable_block), block_count, fp);
+  fwrite(ranges, sizeof(Linetable_range), range_count, fp);
+  fwrite(program.bytes, 1, program.size, fp);
+  fwrite(strings.bytes, 1, strings.size, fp);
+
+  free(rows);
+  free(blocks);
+  free(file_names);
+  free(program.bytes);
+  free(strings.bytes);
+  return OK;
+}
+
+/* the number of a file's name. lines from the same file come together, so
+   the last one's tried first */
+static int file_id(char* filename) {
+  int i;
+
+  if(last_file >= 0 && (files[last_file] == filename ||
+                        strcmp(files[last_file], filename) == 0))
+    return last_file;
+  for(i = 0; i < file_count; i++)
+    if(strcmp(files[i], filename) == 0)
+      return last_file = i;
+  files = realloc(files, (file_count + 1) * sizeof(char*));
+  files[file_count] = filename;
+  return last_file = file_count++;
+}
+
+/* widens the block's range for file to take in line */
+static void add_range(int file, int line, int block, int block_start) {
+  static int first = 0; /* the block's first range */
+  Linetable_range* r;
+  int i;
+
+  if(block_start)
+    first = range_count;
+  for(i = first; i < range_count; i++) {
+    r = &ranges[i];
+    if(r->file == file) {
+      if(line < r->first_line)
+        r->first_line = line;
+      if(line > r->last_line)
+        r->last_line = line;
+      return;
+    }
+  }
+
+  if(range_count == range_capacity) {
+    range_capacity = range_capacity ? range_capacity * 2 : 256;
+    ranges = realloc(ranges, range_capacity * sizeof(Linetable_range));
+  }
+  r = &ranges[range_count++];
+  r->file = file;
+  r->first_line = line;
+  r->last_line = line;
+  r->block = block;
+}
+
+static void put_byte(Buffer* b, int byte) {
+  if(b->size == b->capacity) {
+    b->capacity = b->capacity ? b->capacity * 2 : 0x1000;
+    b->bytes = realloc(b->bytes, b->capacity);
+  }
+  b->bytes[b->size++] = byte;
+}
+
+static void put_unsigned(Buffer* b, unsigned int n) {
+  while(n >= 0x80) {
+    put_byte(b, (n & 0x7F) | 0x80);
+    n >>= 7;
+  }
+  put_byte(b, n);
+}
+
+static void put_signed(Buffer* b, int n) {
+  for(;;) {
+    int byte = n & 0x7F;
+    n >>= 7;
+    if((n == 0 && !(byte & 0x40)) || (n == -1 && (byte & 0x40))) {
+      put_byte(b, byte);
+      return;
+    }
+    put_byte(b, byte | 0x80);
+  }
+}
+
+/* by address, then where they are in the program */
+static int compare_rows(const void* a, const void* b) {
+  Row* ra = (Row*)a;
+  Row* rb = (Row*)b;
+
+  if(ra->addr != rb->addr)
+    return ra->addr < rb->addr ? -1 : 1;
+  return ra->order - rb->order;
+}
+
+/* by file, then first line, then block */
+static int compare_ranges(const void* a, const void* b) {
+  Linetable_range* ra = (Linetable_range*)a;
+  Linetable_range* rb = (Linetable_range*)b;
+
+  if(ra->file != rb->file)
+    return ra->file - rb->file;
+  if(ra->first_line != rb->first_line)
+    return ra->first_line - rb->first_line;
+  return ra->block - rb->block;
+}
@@ -0,0 +1,61 @@
+#ifndef LINETABLE_H
+#define LINETABLE_H
+
+#include "error.h"
+
+#include <stdio.h>
+
+/* with --line-table, snap writes which source line each byte of the
+   program came from, for debuggers. each line that assembles to something
+   is a row - its address, file and line number - and the rows, in order
+   of address, are encoded as a program of deltas, a couple of bytes a row.
+   they're split into blocks, each starting from a known row, so a
+   debugger can binary search the blocks and decode just the one it
+   wants. each block also has a range of lines for each file in it, sorted
+   by file and line, for finding the addresses a line went to */
+#define LINETABLE_MAGIC "SNAPLNT"
+#define LINETABLE_FORMAT 1
+
+/* rows per block */
+#define LINETABLE_BLOCK 64
+
+/* the file is the header, then the files' names, the blocks, the ranges,
+   the program and then the strings. names are offsets into the strings */
+typedef struct {
+  char magic[8];
+  int format;
+  int file_count;
+  int row_count;
+  int block_count;
+  int range_count;
+  int program_size;
+  int strings_size;
+} Linetable_header;
+
+/* a block's first row, and where the encoding of the rest starts. each
+   of those is the address's distance from the last row's, shifted left
+   one and or'd with 1 if the file's changed, then if it has the new file,
+   then the line's distance from the last row's. all are LEB128, as in
+   DWARF - unsigned, but for the line, which is signed */
+typedef struct {
+  int addr;
+  int file;
+  int line;
+  int program;
+} Linetable_block;
+
+/* the lines of a file that a block has rows for. reach is the highest
+   last line of this and every range before it for the same file, so a
+   search back from the last range starting at or before a line can stop
+   once it's too low */
+typedef struct {
+  int file;
+  int first_line;
+  int last_line;
+  int reach;
+  int block;
+} Linetable_range;
+
+Status write_line_table(FILE* fp);
+
+#endif
@@ -0,0 +1,350 @@
+#include "listing.h"
+
+#include "error.h"
+#include "handlers.h"
+#include "image.h"
+#include "instructions.h"
+#include "lines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* a listing is written a row at a time into a buffer, with the hex and
+   line numbers put in by hand, and the buffer written out whenever it's
+   nearly full. a row is
+
+     808003  20 03 80      6  1    2    jsr DrawSprite
+
+   the address, up to four bytes, the cycles the instruction takes (with a
+   + if it can take more), the depth of INCSRCs the line was read at, its
+   line number and its text. lines with more bytes have them on the rows
+   after, up to LISTING_MAX_BYTES, and a row naming the file starts each
+   run of lines from a different one */
+
+#define LISTING_BUFFER 0x10000
+
+/* the most any row but the source text can take */
+#define ROW_OVERHEAD 48
+
+#define ROW_BYTES 4
+#define LISTING_MAX_BYTES 16
+
+/* a source file's text, as it was read, and where in it each line
+   starts */
+typedef struct {
+  Source* source;
+  int* starts;
+  int line_count;
+} Text;
+
+static Text* find_text(Source* source);
+static int listed_file(char* filename, char* wanted);
+static int cycles(Line* lp, int* more);
+static void put_row_start(int addr, unsigned char* bytes, int count);
+static void put_decimal(int n, int width);
+static void put_text(char* text, int len);
+static void reserve(int n);
+static void flush();
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+/* base cycles for each opcode, with an 8-bit accumulator and index
+   registers and the direct page register's low byte zero, as in the
+   65816's datasheet */
+static const char base_cycles[256] = {
+  8, 6, 8, 4, 5, 3, 5, 6, 3, 2, 2, 4, 6, 4, 6, 5,
+  2, 5, 5, 7, 5, 4, 6, 6, 2, 4, 2, 2, 6, 4, 7, 5,
+  6, 6, 8, 4, 3, 3, 5, 6, 4, 2, 2, 5, 4, 4, 6, 5,
+  2, 5, 5, 7, 4, 4, 6, 6, 2, 4, 2, 2, 4, 4, 7, 5,
+  7, 6, 2, 4, 7, 3, 5, 6, 3, 2, 2, 3, 3, 4, 6, 5,
+  2, 5, 5, 7, 7, 4, 6, 6, 2, 4, 3, 2, 4, 4, 7, 5,
+  6, 6, 6, 4, 3, 3, 5, 6, 4, 2, 2, 6, 5, 4, 6, 5,
+  2, 5, 5, 7, 4, 4, 6, 6, 2, 4, 4, 2, 6, 4, 7, 5,
+  3, 6, 4, 4, 3, 3, 3, 6, 2, 2, 2, 3, 4, 4, 4, 5,
+  2, 6, 5, 7, 4, 4, 4, 6, 2, 5, 2, 2, 4, 5, 5, 5,
+  2, 6, 2, 4, 3, 3, 3, 6, 2, 2, 2, 4, 4, 4, 4, 5,
+  2, 5, 5, 7, 4, 4, 4, 6, 2, 4, 2, 2, 4, 4, 4, 5,
+  2, 6, 3, 4, 3, 3, 5, 6, 2, 2, 2, 3, 4, 4, 6, 5,
+  2, 5, 5, 7, 6, 4, 6, 6, 2, 4, 3, 3, 6, 4, 7, 5,
+  2, 6, 3, 4, 3, 3, 5, 6, 2, 2, 2, 3, 4, 4, 6, 5,
+  2, 5, 5, 7, 5, 4, 6, 6, 2, 4, 4, 2, 8, 4, 7, 5
+};
+
+/* what else each opcode's cycles depend on: m for one more with a 16-bit
+   accumulator, M for two more (read-modify-write), x for one more with
+   16-bit index registers, b for branches, which take more if taken, and
+   v for block moves, which take the cycles for each byte */
+static const char extra_cycles[] =
+  ".m.mMmMm.m..MmMm"
+  "bmmmMmMm.m..MmMm"
+  ".m.mmmMm.m..mmMm"
+  "bmmmmmMm.m..mmMm"
+  ".m.mvmMmmm...mMm"
+  "bmmmvmMm.mx..mMm"
+  ".m.mmmMmmm...mMm"
+  "bmmmmmMm.mx..mMm"
+  ".m.mxmxm.m..xmxm"
+  "bmmmxmxm.m..mmmm"
+  "xmxmxmxm.m..xmxm"
+  "bmmmxmxm.m..xmxm"
+  "xm.mxmMm.m..xmMm"
+  "bmmm.mMm.mx..mMm"
+  "xm.mxmMm.m..xmMm"
+  "bmmm.mMm.mx..mMm";
+
+static FILE* out_fp;
+static char out[LISTING_BUFFER];
+static int out_size;
+
+static Text* texts = NULL;
+static int text_count = 0;
+static Text* last_text = NULL;
+
+/* writes a listing of the assembled program to fp */
+Status write_listing(FILE* fp, Listing_filter* filter) {
+  unsigned char* bytes = NULL;
+  int bytes_capacity = 0;
+  char* last_file = NULL;
+  char* checked_file = NULL;
+  int listed = 0;
+  Line* lp;
+  int i;
+
+  out_fp = fp;
+  out_size = 0;
+  for(lp = first_line; lp; lp = lp->next) {
+    Source* s;
+    Text* text;
+    int depth = 0;
+    int count;
+    int n;
+    int more;
+
+    if(lp->dead || lp->addr < filter->start || lp->addr > filter->end)
+      continue;
+    if(filter->file && lp->filename != checked_file) {
+      checked_file = lp->filename;
+      listed = listed_file(lp->filename, filter->file);
+    }
+    if(filter->file && !listed)
+      continue;
+
+    if(lp->byte_size > bytes_capacity) {
+      bytes_capacity = lp->byte_size;
+      bytes = realloc(bytes, bytes_capacity);
+    }
+    if(lp->byte_size && line_bytes(lp, bytes) != OK) {
+      free(bytes);
+      return ERROR;
+    }
+
+    if(lp->filename != last_file) {
+      last_file = lp->filename;
+      reserve(3);
+      out[out_size++] = ';';
+      out[out_size++] = ' ';
+      put_text(lp->filename, strlen(lp->filename));
+      reserve(1);
+      out[out_size++] = '\n';
+    }
+
+    /* address, bytes and cycles */
+    count = lp->byte_size < ROW_BYTES ? lp->byte_size : ROW_BYTES;
+    reserve(ROW_OVERHEAD);
+    put_row_start(lp->addr, bytes, count);
+    n = cycles(lp, &more);
+    out[out_size++] = n >= 10 ? '0' + n / 10 : ' ';
+    out[out_size++] = n ? '0' + n % 10 : ' ';
+    out[out_size++] = more ? '+' : ' ';
+    out[out_size++] = ' ';
+
+    /* how deeply it was included, then its line number and text */
+    for(s = lp->source; s && s->parent; s = s->parent)
+      depth++;
+    out[out_size++] = !depth ? ' ' : depth < 10 ? '0' + depth : '*';
+    put_decimal(lp->line_num, 5);
+    out[out_size++] = ' ';
+    out[out_size++] = ' ';
+    text = find_text(lp->source);
+    if(text && lp->line_num > 0 && lp->line_num <= text->line_count) {
+      char* t = lp->source->text;
+      int start = text->starts[lp->line_num - 1];
+      int end = text->starts[lp->line_num];
+      while(end > start && (t[end-1] == '\n' || t[end-1] == '\r'))
+        end--;
+      put_text(t + start, end - start);
+    }
+    reserve(1);
+    out[out_size++] = '\n';
+
+    /* the rest of the bytes */
+    for(i = count; i < lp->byte_size && i < LISTING_MAX_BYTES; i += count) {
+      count = lp->byte_size - i < ROW_BYTES ? lp->byte_size - i : ROW_BYTES;
+      reserve(ROW_OVERHEAD);
+      put_row_start(lp->addr + i, bytes + i, count);
+      if(i + count >= LISTING_MAX_BYTES && i + count < lp->byte_size) {
+        memcpy(out + out_size, "...", 3);
+        out_size += 3;
+      }
+      while(out[out_size-1] == ' ')
+        out_size--;
+      out[out_size++] = '\n';
+    }
+  }
+  flush();
+
+  for(i = 0; i < text_count; i++)
+    free(texts[i].starts);
+  free(texts);
+  texts = last_text = NULL;
+  text_count = 0;
+  free(bytes);
+  return ferror(fp) ? ERROR : OK;
+}
+
+/* the text source was read from, split into lines the first time it's
+   asked for. lines from the same source come together, so the last one's
+   tried first */
+static Text* find_text(Source* source) {
+  Text* t;
+  char* p;
+  char* end;
+  int i;
+
+  if(!source)
+    return NULL;
+  if(last_text && last_text->source == source)
+    return last_text;
+  for(i = 0; i < text_count; i++)
+    if(texts[i].source == source)
+      return last_text = &texts[i];
+
+  texts = realloc(texts, (text_count + 1) * sizeof(Text));
+  t = last_text = &texts[text_count++];
+  t->source = source;
+  t->starts = malloc(sizeof(int));
+  t->starts[0] = 0;
+  t->line_count = 0;
+  if(!source->text)
+    return t;
+
+  for(p = source->text, end = source->text + source->text_size; p < end; ) {
+    char* nl = memchr(p, '\n', end - p);
+    p = nl ? nl + 1 : end;
+    if(!(t->line_count & (t->line_count + 1)))
+      t->starts = realloc(t->starts,
+                          (t->line_count + 1) * 2 * sizeof(int));
+    t->starts[++t->line_count] = p - source->text;
+  }
+  return t;
+}
+
+/* is filename the file wanted, or a path ending in it? */
+static int listed_file(char* filename, char* wanted) {
+  int len = strlen(filename);
+  int wanted_len = strlen(wanted);
+
+  if(len == wanted_len)
+    return strcmp(filename, wanted) == 0;
+  return len > wanted_len && filename[len - wanted_len - 1] == '/' &&
+         strcmp(filename + len - wanted_len, wanted) == 0;
+}
+
+/* how many cycles the line's instruction takes, given the register sizes
+   and direct page it was assembled with, or 0 if it's not an
+   instruction. more is set if it can take more than that */
+static int cycles(Line* lp, int* more) {
+  Handler f;
+  int op = (unsigned char)lp->bytes[0];
+  int low = op & 0xF;
+  int n;
+
+  *more = 0;
+  if(!lp->instruction || !lp->byte_size)
+    return 0;
+  f = get_handler(lp->instruction);
+  if(f == align || f == ascii || f == at || f == bank || f == db ||
+     f == dw || f == equ || f == incbin || f == longa || f == longi ||
+     f == org || f == pad || f == samebank || f == section || f == setd ||
+     f == setdbr)
+    return 0;
+
+  n = base_cycles[op];
+  switch(extra_cycles[op]) {
+  case 'm': n += lp->acc16 ? 1 : 0; break;
+  case 'M': n += lp->acc16 ? 2 : 0; break;
+  case 'x': n += lp->index16 ? 1 : 0; break;
+  case 'b':
+  case 'v': *more = 1; break;
+  }
+
+  /* direct page addressing takes one more if it's not page aligned */
+  if((lp->d & 0xFF) &&
+     (low == 1 || (low == 2 && (op & 0x10)) || low == 5 || low == 6 ||
+      low == 7 || (low == 4 && op != 0x44 && op != 0x54 && op != 0xF4)))
+    n++;
+  return n;
+}
+
+/* the address and up to four bytes, with the bytes' column padded */
+static void put_row_start(int addr, unsigned char* bytes, int count) {
+  char* p = out + out_size;
+  int i;
+
+  for(i = 5; i >= 0; i--, addr >>= 4)
+    p[i] = hex_digits[addr & 0xF];
+  p += 6;
+  *p++ = ' ';
+  *p++ = ' ';
+  for(i = 0; i < ROW_BYTES; i++) {
+    if(i < count) {
+      *p++ = hex_digits[bytes[i] >> 4];
+      *p++ = hex_digits[bytes[i] & 0xF];
+    }
+    else {
+      *p++ = ' ';
+      *p++ = ' ';
+    }
+    *p++ = ' ';
+  }
+  *p++ = ' ';
+  out_size = p - out;
+}
+
+/* n, right aligned in at least width columns */
+static void put_decimal(int n, int width) {
+  char digits[12];
+  int count = 0;
+
+  do {
+    digits[count++] = '0' + n % 10;
+    n /= 10;
+  } while(n);
+  for(; width > count; width--)
+    out[out_size++] = ' ';
+  while(count)
+    out[out_size++] = digits[--count];
+}
+
+static void put_text(char* text, int len) {
+  if(len > LISTING_BUFFER / 2) {
+    flush();
+    fwrite(text, 1, len, out_fp);
+    return;
+  }
+  reserve(len);
+  memcpy(out + out_size, text, len);
+  out_size += len;
+}
+
+/* makes sure there's room for n more characters */
+static void reserve(int n) {
+  if(out_size + n > LISTING_BUFFER)
+    flush();
+}
+
+static void flush() {
+  fwrite(out, 1, out_size, out_fp);
+  out_size = 0;
+}
@@ -0,0 +1,18 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include "error.h"
+
+#include <stdio.h>
+
+/* which lines a listing shows: those at addresses from start to end, and
+   from file if it isn't NULL */
+typedef struct {
+  int start;
+  int end;
+  char* file;
+} Listing_filter;
+
+Status write_listing(FILE* fp, Listing_filter* filter);
+
+#endif
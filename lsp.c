@@ -0,0 +1,788 @@
+#include "lsp.h"
+
+#include "error.h"
+#include "image.h"
+#include "json.h"
+#include "labels.h"
+#include "lines.h"
+#include "snap.h"
+#include "watch.h"
+
+#include <ctype.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+/* don't show more of a line's bytes than this when hovering */
+#define HOVER_BYTES 16
+
+/* a file open in the editor. its text is what gets assembled, rather than
+   what's on disk */
+typedef struct {
+  char* uri;
+  char* path;
+  char* text;
+  int len;
+  int capacity;
+} Document;
+
+typedef struct {
+  char* filename;
+  int line;
+  char* message;
+} Diagnostic;
+
+static char* main_file;
+static int loaded = 0;
+static int dirty = 0;
+static int shutting_down = 0;
+
+/* whether the client agreed to count characters in bytes. otherwise
+   they're UTF-16 code units, as LSP has them by default */
+static int utf8_positions = 0;
+
+static Document* documents = NULL;
+static int document_count = 0;
+
+static Diagnostic* diagnostics = NULL;
+static int diagnostic_count = 0;
+
+/* the files we've published diagnostics for, so they can be cleared */
+static char** published = NULL;
+static int published_count = 0;
+
+/* input is read in through our own buffer, so we can tell when there's
+   more waiting */
+static char in_buffer[65536];
+static int in_start = 0;
+static int in_end = 0;
+
+static void handle(Json* message);
+static void rebuild();
+static void publish_diagnostics();
+static void collect_error(char* filename, int line, char* message);
+static FILE* open_document(Source* source);
+static Document* find_document(char* uri);
+static void apply_change(Document* doc, Json* change);
+static int offset_of(Document* doc, Json* position);
+static int offers_utf8(Json* params);
+static void mark_stale(char* path);
+static int uses_symbol(Expr* e, char* sym);
+static char* qualify(char* name, char* scope);
+static Line* line_at(Document* doc, int line_num, char** scope);
+static char* symbol_at(Json* params, Document** doc, Line** line);
+static char* word_at(Document* doc, Json* position);
+static void definition(Json* id, Json* params);
+static void hover(Json* id, Json* params);
+static void references(Json* id, Json* params);
+static void describe_line(Json_buffer* b, Line* lp);
+static void location(Json_buffer* b, Line* lp);
+static void respond(Json* id, char* result);
+static void send(Json_buffer* b);
+static char* read_message();
+static int read_byte();
+static int input_pending();
+static char* uri_to_path(char* uri);
+static char* path_to_uri(char* filename);
+
+/* serves the Language Server Protocol over stdin and stdout, for the
+   project whose main file is in_file. the project stays loaded, edits are
+   applied by reparsing only the files they touch, and queries are answered
+   from indexes of the assembled lines */
+Status serve_lsp(char* in_file) {
+  main_file = in_file;
+  error_handler = collect_error;
+  source_opener = open_document;
+
+  for(;;) {
+    char* text;
+    Json* message;
+
+    /* catch up with edits once the editor has stopped sending them */
+    if(dirty && !input_pending())
+      rebuild();
+
+    text = read_message();
+    if(!text)
+      return shutting_down ? OK : ERROR;
+    message = json_parse(text);
+    free(text);
+    if(message) {
+      handle(message);
+      json_free(message);
+    }
+  }
+}
+
+static void handle(Json* message) {
+  char* method = json_str(json_get(message, "method"));
+  Json* id = json_get(message, "id");
+  Json* params = json_get(message, "params");
+  Json* doc = json_get(params, "textDocument");
+
+  if(!method)
+    return;
+
+  if(strcmp(method, "initialize") == 0) {
+    char result[512];
+
+    utf8_positions = offers_utf8(params);
+    sprintf(result, "{\"capabilities\":{"
+                    "\"positionEncoding\":\"%s\","
+                    "\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+                    "\"definitionProvider\":true,"
+                    "\"hoverProvider\":true,"
+                    "\"referencesProvider\":true},"
+                    "\"serverInfo\":{\"name\":\"snap\"}}",
+            utf8_positions ? "utf-8" : "utf-16");
+    respond(id, result);
+    dirty = 1;
+  }
+  else if(strcmp(method, "shutdown") == 0) {
+    shutting_down = 1;
+    respond(id, "null");
+  }
+  else if(strcmp(method, "exit") == 0)
+    exit(shutting_down ? 0 : 1);
+  else if(strcmp(method, "textDocument/didOpen") == 0) {
+    char* uri = json_str(json_get(doc, "uri"));
+    char* text = json_str(json_get(doc, "text"));
+    Document* d;
+
+    if(!uri || !text)
+      return;
+    if(!(d = find_document(uri))) {
+      documents = realloc(documents, (document_count + 1) * sizeof(Document));
+      d = &documents[document_count++];
+      d->uri = strdup(uri);
+      d->path = uri_to_path(uri);
+      d->text = NULL;
+    }
+    free(d->text);
+    d->len = strlen(text);
+    d->capacity = d->len + 1;
+    d->text = strdup(text);
+    mark_stale(d->path);
+  }
+  else if(strcmp(method, "textDocument/didChange") == 0) {
+    Document* d = find_document(json_str(json_get(doc, "uri")));
+    Json* change;
+
+    if(!d)
+      return;
+    change = json_get(params, "contentChanges");
+    for(change = change ? change->child : NULL; change; change = change->next)
+      apply_change(d, change);
+    mark_stale(d->path);
+  }
+  else if(strcmp(method, "textDocument/didClose") == 0) {
+    Document* d = find_document(json_str(json_get(doc, "uri")));
+    char* path;
+
+    if(!d)
+      return;
+    /* it goes back to being read from disk */
+    path = d->path;
+    free(d->uri);
+    free(d->text);
+    *d = documents[--document_count];
+    mark_stale(path);
+    free(path);
+  }
+  else if(strcmp(method, "workspace/didChangeWatchedFiles") == 0) {
+    Json* change = json_get(params, "changes");
+    for(change = change ? change->child : NULL; change; change = change->next) {
+      char* uri = json_str(json_get(change, "uri"));
+      char* path;
+      if(!uri || find_document(uri))
+        continue;
+      path = uri_to_path(uri);
+      mark_stale(path);
+      free(path);
+      /* it might be INCBIN'd */
+      dirty = 1;
+    }
+  }
+  else if(strcmp(method, "textDocument/definition") == 0)
+    definition(id, params);
+  else if(strcmp(method, "textDocument/hover") == 0)
+    hover(id, params);
+  else if(strcmp(method, "textDocument/references") == 0)
+    references(id, params);
+  else if(id) {
+    Json_buffer b;
+    json_init(&b);
+    json_printf(&b, "{\"jsonrpc\":\"2.0\",\"id\":");
+    if(id->type == JSON_STRING)
+      json_string(&b, id->str);
+    else
+      json_printf(&b, "%d", json_int(id, 0));
+    json_printf(&b, ",\"error\":{\"code\":-32601,\"message\":");
+    json_string(&b, method);
+    json_printf(&b, "}}");
+    send(&b);
+  }
+}
+
+/* brings the program up to date with the edits made to it: the files that
+   changed are parsed again, then the whole thing is reassembled */
+static void rebuild() {
+  int i;
+
+  for(i = 0; i < diagnostic_count; i++) {
+    free(diagnostics[i].filename);
+    free(diagnostics[i].message);
+  }
+  diagnostic_count = 0;
+  reset_errors();
+
+  if(!loaded) {
+    loaded = 1;
+    if(load_file(main_file) == OK)
+      assemble();
+  }
+  else {
+    reload_stale_sources();
+    if(!diagnostic_count)
+      assemble();
+  }
+
+  publish_diagnostics();
+  dirty = 0;
+}
+
+/* sends the errors found in each file, and clears them from files that no
+   longer have any */
+static void publish_diagnostics() {
+  char** uris = malloc((diagnostic_count + published_count) * sizeof(char*));
+  int uri_count = 0;
+  int i;
+  int j;
+
+  for(i = 0; i < diagnostic_count; i++) {
+    char* uri = path_to_uri(diagnostics[i].filename);
+    for(j = 0; j < uri_count && strcmp(uris[j], uri); j++);
+    if(j < uri_count)
+      free(uri);
+    else
+      uris[uri_count++] = uri;
+  }
+
+  for(i = 0; i < uri_count; i++) {
+    Json_buffer b;
+    int first = 1;
+
+    json_init(&b);
+    json_printf(&b, "{\"jsonrpc\":\"2.0\","
+                    "\"method\":\"textDocument/publishDiagnostics\","
+                    "\"params\":{\"uri\":");
+    json_string(&b, uris[i]);
+    json_printf(&b, ",\"diagnostics\":[");
+    for(j = 0; j < diagnostic_count; j++) {
+      char* uri = path_to_uri(diagnostics[j].filename);
+      int line = diagnostics[j].line > 0 ? diagnostics[j].line - 1 : 0;
+      if(strcmp(uri, uris[i]) == 0) {
+        json_printf(&b, "%s{\"range\":{\"start\":{\"line\":%d,\"character\":0},"
+                        "\"end\":{\"line\":%d,\"character\":0}},"
+                        "\"severity\":1,\"source\":\"snap\",\"message\":",
+                    first ? "" : ",", line, line + 1);
+        json_string(&b, diagnostics[j].message);
+        json_printf(&b, "}");
+        first = 0;
+      }
+      free(uri);
+    }
+    json_printf(&b, "]}}");
+    send(&b);
+  }
+
+  /* clear the files that were fixed */
+  for(i = 0; i < published_count; i++) {
+    for(j = 0; j < uri_count && strcmp(uris[j], published[i]); j++);
+    if(j == uri_count) {
+      Json_buffer b;
+      json_init(&b);
+      json_printf(&b, "{\"jsonrpc\":\"2.0\","
+                      "\"method\":\"textDocument/publishDiagnostics\","
+                      "\"params\":{\"uri\":");
+      json_string(&b, published[i]);
+      json_printf(&b, ",\"diagnostics\":[]}}");
+      send(&b);
+    }
+    free(published[i]);
+  }
+  free(published);
+  published = uris;
+  published_count = uri_count;
+}
+
+static void collect_error(char* filename, int line, char* message) {
+  diagnostics = realloc(diagnostics,
+                        (diagnostic_count + 1) * sizeof(Diagnostic));
+  diagnostics[diagnostic_count].filename = strdup(filename ? filename
+                                                           : main_file);
+  diagnostics[diagnostic_count].line = line;
+  diagnostics[diagnostic_count].message = strdup(message);
+  diagnostic_count++;
+}
+
+/* reads files that are open in the editor from memory */
+static FILE* open_document(Source* source) {
+  int i;
+  for(i = 0; i < document_count; i++) {
+    if(strcmp(documents[i].path, source_path(source)) == 0) {
+      if(!documents[i].len)
+        return fopen("/dev/null", "r");
+      return fmemopen(documents[i].text, documents[i].len, "r");
+    }
+  }
+  return NULL;
+}
+
+static Document* find_document(char* uri) {
+  int i;
+  if(!uri)
+    return NULL;
+  for(i = 0; i < document_count; i++)
+    if(strcmp(documents[i].uri, uri) == 0)
+      return &documents[i];
+  return NULL;
+}
+
+/* applies one of the edits from a didChange */
+static void apply_change(Document* doc, Json* change) {
+  Json* range = json_get(change, "range");
+  char* text = json_str(json_get(change, "text"));
+  int start = 0;
+  int end = doc->len;
+  int len;
+
+  if(!text)
+    return;
+  if(range) {
+    start = offset_of(doc, json_get(range, "start"));
+    end = offset_of(doc, json_get(range, "end"));
+    if(end < start)
+      end = start;
+  }
+
+  len = strlen(text);
+  if(doc->len - (end - start) + len + 1 > doc->capacity) {
+    doc->capacity = (doc->len - (end - start) + len + 1) * 2;
+    doc->text = realloc(doc->text, doc->capacity);
+  }
+  memmove(doc->text + start + len, doc->text + end, doc->len - end + 1);
+  memcpy(doc->text + start, text, len);
+  doc->len += len - (end - start);
+}
+
+/* turns a line and character into an offset into the document's text.
+   unless the client agreed to bytes, characters are UTF-16 code units:
+   one for each UTF-8 sequence, or two for one of four bytes, which needs
+   a surrogate pair */
+static int offset_of(Document* doc, Json* position) {
+  int line = json_int(json_get(position, "line"), 0);
+  int character = json_int(json_get(position, "character"), 0);
+  int i = 0;
+
+  for(; line > 0 && i < doc->len; i++)
+    if(doc->text[i] == '\n')
+      line--;
+  if(utf8_positions) {
+    for(; character > 0 && i < doc->len && doc->text[i] != '\n'; character--)
+      i++;
+    return i;
+  }
+
+  for(; character > 0 && i < doc->len && doc->text[i] != '\n'; i++) {
+    unsigned char c = doc->text[i];
+    if((c & 0xC0) != 0x80)
+      character -= c >= 0xF0 ? 2 : 1;
+  }
+  /* the rest of the last character's sequence goes with it */
+  while(i < doc->len && (doc->text[i] & 0xC0) == 0x80)
+    i++;
+  return i;
+}
+
+/* whether the client can count characters in bytes, which is all they
+   are to the assembler */
+static int offers_utf8(Json* params) {
+  Json* general = json_get(json_get(params, "capabilities"), "general");
+  Json* encoding = json_get(general, "positionEncodings");
+
+  for(encoding = encoding ? encoding->child : NULL; encoding;
+      encoding = encoding->next) {
+    char* name = json_str(encoding);
+    if(name && strcmp(name, "utf-8") == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static void mark_stale(char* path) {
+  Source* s;
+  for(s = first_source; s; s = s->next) {
+    if(strcmp(source_path(s), path) == 0) {
+      s->stale = 1;
+      dirty = 1;
+    }
+  }
+}
+
+/* does the expression refer to sym, which has been interned? */
+static int uses_symbol(Expr* e, char* sym) {
+  for(; e; e = e->next) {
+    if(e->type == SYMBOL && e->e.sym == sym)
+      return 1;
+    if((e->type == ADD || e->type == SUB) &&
+       (uses_symbol(e->e.subexpr[0], sym) || uses_symbol(e->e.subexpr[1], sym)))
+      return 1;
+  }
+  return 0;
+}
+
+/* gives local labels the name the assembler knows them by */
+static char* qualify(char* name, char* scope) {
+  char* full;
+  if(name[0] != '.')
+    return strdup(name);
+  full = malloc(strlen(scope) + strlen(name) + 1);
+  sprintf(full, "%s:%s", scope, name + 1);
+  return full;
+}
+
+/* the line read from a line of an open document, if there is one, along
+   with the global label in effect there. only that file's lines are
+   searched */
+static Line* line_at(Document* doc, int line_num, char** scope) {
+  Source* s;
+
+  for(s = first_source; s; s = s->next) {
+    Line* lp;
+
+    if(strcmp(source_path(s), doc->path) != 0)
+      continue;
+    *scope = s->label;
+    for(lp = s->prev ? s->prev->next : first_line;
+        lp && from_source(lp, s); lp = lp->next) {
+      if(lp->label && lp->label[0] != '.' &&
+         (!lp->instruction || strcasecmp(lp->instruction, "equ") != 0))
+        *scope = lp->label;
+      if(lp->source == s && lp->line_num == line_num)
+        return lp;
+    }
+  }
+  *scope = "";
+  return NULL;
+}
+
+/* the full name of the symbol under the cursor, which the caller frees.
+   also finds the document and the line, if there is one */
+static char* symbol_at(Json* params, Document** doc, Line** line) {
+  Json* position = json_get(params, "position");
+  int line_num = json_int(json_get(position, "line"), 0) + 1;
+  char* scope;
+  char* word;
+  char* name;
+
+  if(dirty)
+    rebuild();
+  *doc = find_document(json_str(json_get(json_get(params, "textDocument"),
+                                         "uri")));
+  *line = NULL;
+  if(!*doc || !(word = word_at(*doc, position)))
+    return NULL;
+  *line = line_at(*doc, line_num, &scope);
+  name = qualify(word, scope);
+  free(word);
+  return name;
+}
+
+/* the symbol (or instruction) under the cursor, or NULL */
+static char* word_at(Document* doc, Json* position) {
+  int at = offset_of(doc, position);
+  int start = at;
+  int end = at;
+
+  while(start > 0 && (isalnum(doc->text[start-1]) ||
+                      doc->text[start-1] == '_' || doc->text[start-1] == '.'))
+    start--;
+  while(end < doc->len && (isalnum(doc->text[end]) ||
+                           doc->text[end] == '_' || doc->text[end] == '.'))
+    end++;
+  if(start == end || isdigit(doc->text[start]))
+    return NULL;
+  return strndup(doc->text + start, end - start);
+}
+
+static void definition(Json* id, Json* params) {
+  Document* doc;
+  Line* line;
+  Line* def = NULL;
+  char* name = symbol_at(params, &doc, &line);
+  Json_buffer b;
+
+  if(name)
+    def = sym_line(name);
+  free(name);
+  if(!def) {
+    respond(id, "null");
+    return;
+  }
+
+  json_init(&b);
+  location(&b, def);
+  respond(id, b.text);
+  free(b.text);
+}
+
+static void hover(Json* id, Json* params) {
+  Document* doc;
+  Line* line;
+  Line* def;
+  char* name = symbol_at(params, &doc, &line);
+  int val;
+  Json_buffer text;
+  Json_buffer b;
+
+  if(!name) {
+    respond(id, "null");
+    return;
+  }
+
+  json_init(&text);
+  if(sym_val(name, NULL, &val) == OK) {
+    json_printf(&text, "**%s** = `$%X`", name, val);
+    def = sym_line(name);
+    if(def && def->instruction && strcasecmp(def->instruction, "equ") != 0) {
+      json_printf(&text, "\n\n");
+      describe_line(&text, def);
+    }
+  }
+  else if(line && line->instruction) {
+    /* the instruction itself */
+    char* word = word_at(doc, json_get(params, "position"));
+    if(strcasecmp(word, line->instruction) == 0)
+      describe_line(&text, line);
+    free(word);
+  }
+  free(name);
+
+  if(!text.len) {
+    free(text.text);
+    respond(id, "null");
+    return;
+  }
+  json_init(&b);
+  json_printf(&b, "{\"contents\":{\"kind\":\"markdown\",\"value\":");
+  json_string(&b, text.text);
+  json_printf(&b, "}}");
+  respond(id, b.text);
+  free(b.text);
+  free(text.text);
+}
+
+static void references(Json* id, Json* params) {
+  Json* declaration = json_get(json_get(params, "context"),
+                               "includeDeclaration");
+  Document* doc;
+  Line* line;
+  Line* def;
+  Line* lp;
+  char* name = symbol_at(params, &doc, &line);
+  char* sym;
+  Json_buffer b;
+  int first = 1;
+
+  if(!name) {
+    respond(id, "null");
+    return;
+  }
+
+  /* expressions refer to symbols by their interned names, so comparing
+     pointers is enough */
+  sym = intern_symbol(name);
+  def = sym_line(name);
+  free(name);
+
+  json_init(&b);
+  json_printf(&b, "[");
+  if(def && declaration && declaration->num) {
+    location(&b, def);
+    first = 0;
+  }
+  for(lp = first_line; lp; lp = lp->next) {
+    if(uses_symbol(lp->expr1, sym) || uses_symbol(lp->expr2, sym)) {
+      if(!first)
+        json_printf(&b, ",");
+      location(&b, lp);
+      first = 0;
+    }
+  }
+  json_printf(&b, "]");
+  respond(id, b.text);
+  free(b.text);
+}
+
+/* where a line was assembled to, what it assembled to and how big it is */
+static void describe_line(Json_buffer* b, Line* lp) {
+  unsigned char bytes[HOVER_BYTES];
+  int shown = lp->byte_size < HOVER_BYTES ? lp->byte_size : HOVER_BYTES;
+  int i;
+
+  json_printf(b, "`$%04X`", lp->addr);
+  if(lp->byte_size <= HOVER_BYTES || strcasecmp(lp->instruction, "pad")) {
+    /* lay the whole line out, then show the start of it */
+    unsigned char* all = malloc(lp->byte_size + 1);
+    if(line_bytes(lp, all) == OK) {
+      memcpy(bytes, all, shown);
+      json_printf(b, ": `");
+      for(i = 0; i < shown; i++)
+        json_printf(b, i ? " %02X" : "%02X", bytes[i]);
+      json_printf(b, lp->byte_size > shown ? " ...`" : "`");
+    }
+    free(all);
+  }
+  json_printf(b, " (%d byte%s)", lp->byte_size, lp->byte_size == 1 ? "" : "s");
+}
+
+static void location(Json_buffer* b, Line* lp) {
+  char* uri = path_to_uri(lp->source ? source_path(lp->source) : lp->filename);
+  json_printf(b, "{\"uri\":");
+  json_string(b, uri);
+  json_printf(b, ",\"range\":{\"start\":{\"line\":%d,\"character\":0},"
+                 "\"end\":{\"line\":%d,\"character\":0}}}",
+              lp->line_num - 1, lp->line_num - 1);
+  free(uri);
+}
+
+static void respond(Json* id, char* result) {
+  Json_buffer b;
+
+  json_init(&b);
+  json_printf(&b, "{\"jsonrpc\":\"2.0\",\"id\":");
+  if(id && id->type == JSON_STRING)
+    json_string(&b, id->str);
+  else
+    json_printf(&b, "%d", json_int(id, 0));
+  json_printf(&b, ",\"result\":%s}", result);
+  send(&b);
+}
+
+/* sends a message, then frees it */
+static void send(Json_buffer* b) {
+  printf("Content-Length: %d\r\n\r\n", b->len);
+  fwrite(b->text, 1, b->len, stdout);
+  fflush(stdout);
+  free(b->text);
+}
+
+/* reads the next message, returning its body, or NULL at end of input */
+static char* read_message() {
+  char header[256];
+  int length = -1;
+  char* body;
+  int i;
+
+  for(;;) {
+    int len = 0;
+    int c;
+    while((c = read_byte()) != EOF && c != '\n')
+      if(len < sizeof(header) - 1)
+        header[len++] = c;
+    if(c == EOF)
+      return NULL;
+    if(len && header[len-1] == '\r')
+      len--;
+    header[len] = '\0';
+    if(!len)
+      break;
+    if(strncasecmp(header, "Content-Length:", 15) == 0)
+      length = atoi(header + 15);
+  }
+  if(length < 0)
+    return read_message();
+
+  body = malloc(length + 1);
+  for(i = 0; i < length; i++) {
+    int c = read_byte();
+    if(c == EOF) {
+      free(body);
+      return NULL;
+    }
+    body[i] = c;
+  }
+  body[length] = '\0';
+  return body;
+}
+
+static int read_byte() {
+  if(in_start == in_end) {
+    int n = read(0, in_buffer, sizeof(in_buffer));
+    if(n <= 0)
+      return EOF;
+    in_start = 0;
+    in_end = n;
+  }
+  return (unsigned char)in_buffer[in_start++];
+}
+
+static int input_pending() {
+  struct pollfd pfd;
+
+  if(in_start < in_end)
+    return 1;
+  pfd.fd = 0;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) > 0;
+}
+
+static char* uri_to_path(char* uri) {
+  char* decoded = malloc(strlen(uri) + 1);
+  char* dest = decoded;
+  char* path;
+
+  if(strncmp(uri, "file://", 7) == 0)
+    uri += 7;
+  for(; *uri; uri++) {
+    unsigned int c;
+    if(*uri == '%' && sscanf(uri + 1, "%2x", &c) == 1) {
+      *dest++ = c;
+      uri += 2;
+    }
+    else
+      *dest++ = *uri;
+  }
+  *dest = '\0';
+
+  path = realpath(decoded, NULL);
+  if(!path)
+    return decoded;
+  free(decoded);
+  return path;
+}
+
+static char* path_to_uri(char* filename) {
+  char* path = realpath(filename, NULL);
+  char* uri;
+  char* dest;
+  char* p;
+
+  if(!path)
+    path = strdup(filename);
+  uri = dest = malloc(strlen(path) * 3 + 8);
+  dest += sprintf(dest, "file://");
+  for(p = path; *p; p++) {
+    if(isalnum(*p) || strchr("/-_.~", *p))
+      *dest++ = *p;
+    else
+      dest += sprintf(dest, "%%%02X", (unsigned char)*p);
+  }
+  *dest = '\0';
+  free(path);
+  return uri;
+}
@@ -0,0 +1,8 @@
+#ifndef LSP_H
+#define LSP_H
+
+#include "error.h"
+
+Status serve_lsp(char* in_file);
+
+#endif
@@ -0,0 +1,524 @@
+#include "object.h"
+
+#include "error.h"
+#include "eval.h"
+#include "expr.h"
+#include "handlers.h"
+#include "image.h"
+#include "instructions.h"
+#include "labels.h"
+#include "lines.h"
+#include "snap.h"
+#include "table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* a relocatable value has to be a sum of symbols and numbers where,
+   once the symbols in the same section cancel out, at most one is left
+   (added, not subtracted) for the linker to fill in */
+#define MAX_TERMS 8
+
+/* how many EQUs of EQUs are followed */
+#define MAX_DEPTH 16
+
+/* assembling an object file, rather than a binary */
+int relocating = 0;
+
+typedef struct {
+  int section;
+  char* import;
+  int count;
+} Term;
+
+typedef struct {
+  int offset;
+  int import; /* the import the string names, -1 if none */
+} String_entry;
+
+/* the object file being written */
+typedef struct {
+  Object_section* sections;
+  int section_count;
+  int section_capacity;
+  Object_symbol* symbols;
+  int symbol_count;
+  int symbol_capacity;
+  Object_reloc* relocs;
+  int reloc_count;
+  int reloc_capacity;
+  int* imports;
+  int import_count;
+  int import_capacity;
+  char* strings;
+  int strings_size;
+  int strings_capacity;
+  unsigned char* data;
+  int data_size;
+  int data_capacity;
+
+  /* for finding strings already added */
+  String_entry* string_table;
+  int string_buckets;
+  int string_count;
+
+  /* the object section each relocatable section became */
+  int* section_index;
+  int section_numbers;
+} Object;
+
+static Status find_target(Expr* e, int* section, char** import);
+static Status add_terms(Expr* e, int sign, Term* terms, int* count,
+                        int depth);
+static Status add_term(int section, char* import, int sign, Term* terms,
+                       int* count);
+static void begin_section(Object* obj, Line* lp, char* name);
+static Status add_constraint(Object* obj, Line* lp, Handler f);
+static Status line_relocs(Object* obj, Line* lp, Handler f, int offset);
+static Status add_reloc(Object* obj, Line* lp, Expr* e, int offset,
+                        int size, int shift, int flags);
+static void export_symbol(Object* obj, Line* lp);
+static int add_string(Object* obj, char* s);
+static int add_import(Object* obj, char* name);
+static void* grow(void* array, int* capacity, int count, int size);
+
+/* what e's value is relative to: 0 if it's fixed, the number of the
+   section it's in, or -1 if it's imported. a value that can't be
+   relocated at all counts as fixed here - write_object complains about it
+   once the program's assembled */
+int reloc_target(Expr* e) {
+  int section;
+  char* import;
+
+  if(!relocating || !e || find_target(e, &section, &import) != OK)
+    return 0;
+  return import ? -1 : section;
+}
+
+/* writes the assembled program out as an object file */
+Status write_object(FILE* fp) {
+  Object obj;
+  Object_header header;
+  Line* lp;
+  Line* prev = NULL;
+  char* name = NULL;
+  Status status = OK;
+  int i;
+
+  memset(&obj, 0, sizeof(obj));
+  obj.string_buckets = 256;
+  obj.string_table = malloc(obj.string_buckets * sizeof(String_entry));
+  for(i = 0; i < obj.string_buckets; i++)
+    obj.string_table[i].offset = -1;
+
+  current_label = "";
+  current_label_len = 0;
+  for(lp = first_line; lp && status == OK; lp = lp->next) {
+    Handler f = lp->instruction ? get_handler(lp->instruction) : NULL;
+    int offset;
+
+    line_num = lp->line_num;
+    current_filename = lp->filename;
+    if(lp->label && lp->label[0] != '.' &&
+       (!lp->instruction || strcasecmp(lp->instruction, "equ") != 0)) {
+      current_label = lp->label;
+      current_label_len = strlen(current_label);
+    }
+
+    /* a new section starts wherever code moves to one, or is ORG'd */
+    if(!prev || lp->section != prev->section ||
+       (prev->instruction && get_handler(prev->instruction) == org)) {
+      begin_section(&obj, lp, name);
+      name = NULL;
+    }
+    prev = lp;
+    if(f == section)
+      name = lp->expr1->e.str;
+
+    offset = obj.data_size - obj.sections[obj.section_count-1].data;
+    obj.data = grow(obj.data, &obj.data_capacity,
+                    obj.data_size + lp->byte_size, 1);
+    status = line_bytes(lp, obj.data + obj.data_size);
+    obj.data_size += lp->byte_size;
+    obj.sections[obj.section_count-1].size += lp->byte_size;
+
+    if(status == OK && (f == align || f == at || f == bank || f == samebank))
+      status = add_constraint(&obj, lp, f);
+    if(status == OK && f)
+      status = line_relocs(&obj, lp, f, offset);
+    if(status == OK && lp->label && lp->label[0] != '.')
+      export_symbol(&obj, lp);
+  }
+
+  /* relocatable sections were referred to by number until now */
+  for(i = 0; i < obj.reloc_count; i++)
+    if(obj.relocs[i].kind == TARGET_SECTION)
+      obj.relocs[i].target = obj.section_index[obj.relocs[i].target];
+  for(i = 0; i < obj.symbol_count; i++)
+    if(obj.symbols[i].kind == TARGET_SECTION)
+      obj.symbols[i].section = obj.section_index[obj.symbols[i].section];
+
+  if(status == OK) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OBJECT_MAGIC, sizeof(header.magic));
+    strncpy(header.version, SNAP_VERSION, sizeof(header.version) - 1);
+    header.format = OBJECT_FORMAT;
+    header.section_count = obj.section_count;
+    header.symbol_count = obj.symbol_count;
+    header.import_count = obj.import_count;
+    header.reloc_count = obj.reloc_count;
+    header.strings_size = obj.strings_size;
+    header.data_size = obj.data_size;
+    if(fwrite(&header, sizeof(header), 1, fp) != 1 ||
+       fwrite(obj.sections, sizeof(Object_section), obj.section_count, fp)
+         != obj.section_count ||
+       fwrite(obj.symbols, sizeof(Object_symbol), obj.symbol_count, fp)
+         != obj.symbol_count ||
+       fwrite(obj.imports, sizeof(int), obj.import_count, fp)
+         != obj.import_count ||
+       fwrite(obj.relocs, sizeof(Object_reloc), obj.reloc_count, fp)
+         != obj.reloc_count ||
+       fwrite(obj.strings, 1, obj.strings_size, fp) != obj.strings_size ||
+       fwrite(obj.data, 1, obj.data_size, fp) != obj.data_size) {
+      fprintf(stderr, "Error: writing output file\n");
+      status = ERROR;
+    }
+  }
+
+  free(obj.sections);
+  free(obj.symbols);
+  free(obj.relocs);
+  free(obj.imports);
+  free(obj.strings);
+  free(obj.data);
+  free(obj.string_table);
+  free(obj.section_index);
+  return status;
+}
+
+/* works out which section or import e's value depends on, if any */
+static Status find_target(Expr* e, int* section, char** import) {
+  Term terms[MAX_TERMS];
+  int count = 0;
+  int found = 0;
+  int i;
+
+  *section = 0;
+  *import = NULL;
+  if(add_terms(e, 1, terms, &count, 0) != OK)
+    return ERROR;
+  for(i = 0; i < count; i++) {
+    if(!terms[i].count)
+      continue;
+    if(terms[i].count != 1 || found++)
+      return ERROR;
+    *section = terms[i].section;
+    *import = terms[i].import;
+  }
+  return OK;
+}
+
+/* counts up how many times each section and import is added into e's
+   value, less the times it's subtracted */
+static Status add_terms(Expr* e, int sign, Term* terms, int* count,
+                        int depth) {
+  Line* line;
+  int val;
+
+  if(depth > MAX_DEPTH)
+    return ERROR;
+  switch(e->type) {
+  case ADD:
+  case SUB:
+    if(add_terms(e->e.subexpr[0], sign, terms, count, depth) != OK)
+      return ERROR;
+    return add_terms(e->e.subexpr[1], e->type == ADD ? sign : -sign,
+                     terms, count, depth);
+  case SYMBOL:
+    break;
+  default:
+    return OK;
+  }
+
+  if(sym_val(e->e.sym, &e->cache, &val) != OK)
+    return add_term(0, intern_symbol(e->e.sym), sign, terms, count);
+
+  /* symbols from the command line have no line */
+  line = sym_line(e->e.sym);
+  if(!line)
+    return OK;
+  if(line->instruction && strcasecmp(line->instruction, "equ") == 0)
+    return add_terms(line->expr1, sign, terms, count, depth + 1);
+  if(line->section)
+    return add_term(line->section, NULL, sign, terms, count);
+  return OK;
+}
+
+static Status add_term(int section, char* import, int sign, Term* terms,
+                       int* count) {
+  int i;
+
+  for(i = 0; i < *count; i++) {
+    if(terms[i].section == section && terms[i].import == import) {
+      terms[i].count += sign;
+      return OK;
+    }
+  }
+  if(*count == MAX_TERMS)
+    return ERROR;
+  terms[*count].section = section;
+  terms[*count].import = import;
+  terms[*count].count = sign;
+  (*count)++;
+  return OK;
+}
+
+/* starts a new section with lp. relocatable code is named by SECTION, or
+   after the program, and fixed code after where it's ORG'd to */
+static void begin_section(Object* obj, Line* lp, char* name) {
+  Object_section* s;
+  char address[16];
+
+  obj->sections = grow(obj->sections, &obj->section_capacity,
+                       obj->section_count + 1, sizeof(Object_section));
+  s = &obj->sections[obj->section_count];
+  s->fixed = !lp->section;
+  s->address = s->fixed ? lp->addr : 0;
+  s->size = 0;
+  s->data = obj->data_size;
+  s->align = 1;
+  s->bank_lo = 0;
+  s->bank_hi = 0xFF;
+  s->same_bank = -1;
+  s->at = -1;
+  if(s->fixed) {
+    sprintf(address, "$%06X", lp->addr);
+    s->name = add_string(obj, address);
+  }
+  else {
+    s->name = add_string(obj, name ? name : first_source->filename);
+    if(lp->section >= obj->section_numbers) {
+      obj->section_index = realloc(obj->section_index,
+                                   (lp->section + 1) * sizeof(int));
+      obj->section_numbers = lp->section + 1;
+    }
+    obj->section_index[lp->section] = obj->section_count;
+  }
+  obj->section_count++;
+}
+
+/* records one of the current section's placement constraints. the
+   handlers have already checked the operands */
+static Status add_constraint(Object* obj, Line* lp, Handler f) {
+  Object_section* s = &obj->sections[obj->section_count-1];
+  int val;
+
+  if(f == samebank) {
+    s->same_bank = add_string(obj, lp->expr1->e.str);
+    return OK;
+  }
+  if(eval(f == bank && lp->addr_mode == LIST ? lp->expr2 : lp->expr1, &val)
+     != OK)
+    return ERROR;
+  if(f == align)
+    s->align = val;
+  else if(f == at)
+    s->at = val;
+  else {
+    s->bank_lo = s->bank_hi = val;
+    if(lp->addr_mode == LIST && eval(lp->expr2->next, &s->bank_hi) != OK)
+      return ERROR;
+  }
+  return OK;
+}
+
+/* adds the relocations for each of a line's operands that depends on
+   where something's placed. offset is where the line starts in its
+   section. the fields are laid out as the handlers lay them out */
+static Status line_relocs(Object* obj, Line* lp, Handler f, int offset) {
+  int size = lp->byte_size - 1;
+  int shift = 0;
+  int flags = 0;
+  Expr* e;
+  int i;
+
+  if(f == db || f == dw) {
+    size = f == db ? 1 : 2;
+    if(lp->addr_mode != LIST)
+      return add_reloc(obj, lp, lp->expr1, offset, size, 0, 0);
+    for(e = lp->expr2, i = 0; e; e = e->next, i++)
+      if(add_reloc(obj, lp, e, offset + i*size, size, 0, 0) != OK)
+        return ERROR;
+    return OK;
+  }
+  if(f == mvn || f == mvp) {
+    if(add_reloc(obj, lp, lp->expr2, offset + 2, 1, 16, RELOC_TRUNCATE)
+       != OK)
+      return ERROR;
+    return add_reloc(obj, lp, lp->expr2->next, offset + 1, 1, 16,
+                     RELOC_TRUNCATE);
+  }
+  if(f == bcc || f == bcs || f == beq || f == bmi || f == bne || f == bpl ||
+     f == bra || f == bvc || f == bvs)
+    return add_reloc(obj, lp, lp->expr1, offset + 1, 1, 0, RELOC_RELATIVE);
+  if(f == brl || f == per)
+    return add_reloc(obj, lp, lp->expr1, offset + 1, 2, 0, RELOC_RELATIVE);
+
+  /* everything else has a single operand after the opcode, if any */
+  if(size < 1 || !lp->expr1 || lp->addr_mode == STRING ||
+     lp->addr_mode == LIST || f == pad)
+    return OK;
+
+  if(f == jmp || (f == jsr && lp->addr_mode == ABSOLUTE))
+    flags = RELOC_TRUNCATE | RELOC_SAME_BANK;
+  else if(f == pea)
+    flags = RELOC_TRUNCATE;
+  else if(lp->addr_mode == IMMEDIATE) {
+    switch(lp->modifier) {
+    case IMMEDIATE_HI: shift = size == 1 ? 16 : 8; break;
+    case IMMEDIATE_MID: shift = size == 1 ? 8 : 0; break;
+    default: break;
+    }
+    flags = RELOC_TRUNCATE;
+  }
+  else if(size == 2)
+    flags = RELOC_TRUNCATE | RELOC_DATA_BANK;
+  return add_reloc(obj, lp, lp->expr1, offset + 1, size, shift, flags);
+}
+
+/* adds a relocation for a field of size bytes at offset, if its value e
+   isn't one the assembler could work out itself */
+static Status add_reloc(Object* obj, Line* lp, Expr* e, int offset,
+                        int size, int shift, int flags) {
+  Object_reloc* r;
+  int section;
+  char* import;
+  int addend;
+
+  if(find_target(e, &section, &import) != OK)
+    return error("expression can't be relocated");
+
+  /* a distance within a section doesn't change when it moves */
+  if(!import && section == ((flags & RELOC_RELATIVE) ? lp->section : 0))
+    return OK;
+
+  /* local labels can't be imported, so it's just missing */
+  if(import && strchr(import, ':'))
+    return error("undefined symbol '%s'", import);
+
+  /* with the section at 0 and imports 0, what's left is the addend */
+  if(eval(e, &addend) != OK)
+    return ERROR;
+
+  obj->relocs = grow(obj->relocs, &obj->reloc_capacity,
+                     obj->reloc_count + 1, sizeof(Object_reloc));
+  r = &obj->relocs[obj->reloc_count++];
+  r->section = obj->section_count - 1;
+  r->offset = offset;
+  r->size = size;
+  r->shift = shift;
+  r->flags = flags;
+  r->bank = lp->dbr;
+  r->kind = import ? TARGET_IMPORT : section ? TARGET_SECTION
+                                             : TARGET_ABSOLUTE;
+  r->target = import ? add_import(obj, import) : section;
+  r->addend = addend;
+  r->filename = add_string(obj, lp->filename);
+  r->line_num = lp->line_num;
+  return OK;
+}
+
+/* exports a global label or constant, unless it's relative to an import,
+   which the linker can't do anything with */
+static void export_symbol(Object* obj, Line* lp) {
+  Object_symbol* s;
+  Expr sym;
+  int section;
+  char* import;
+  int val;
+
+  memset(&sym, 0, sizeof(sym));
+  sym.type = SYMBOL;
+  sym.e.sym = lp->label;
+  sym.cache = lp->label_cache;
+  if(sym_val(lp->label, &lp->label_cache, &val) != OK ||
+     find_target(&sym, &section, &import) != OK || import)
+    return;
+
+  obj->symbols = grow(obj->symbols, &obj->symbol_capacity,
+                      obj->symbol_count + 1, sizeof(Object_symbol));
+  s = &obj->symbols[obj->symbol_count++];
+  s->name = add_string(obj, lp->label);
+  s->kind = section ? TARGET_SECTION : TARGET_ABSOLUTE;
+  s->section = section;
+  s->val = val;
+}
+
+/* adds s to the strings, if it isn't there already, and returns its
+   offset */
+static int add_string(Object* obj, char* s) {
+  int i;
+  int j;
+
+  i = hash_str(s) % obj->string_buckets;
+  while(obj->string_table[i].offset >= 0) {
+    if(strcmp(obj->strings + obj->string_table[i].offset, s) == 0)
+      return obj->string_table[i].offset;
+    i = (i + 1) % obj->string_buckets;
+  }
+
+  obj->strings = grow(obj->strings, &obj->strings_capacity,
+                      obj->strings_size + strlen(s) + 1, 1);
+  strcpy(obj->strings + obj->strings_size, s);
+  obj->string_table[i].offset = obj->strings_size;
+  obj->string_table[i].import = -1;
+  obj->strings_size += strlen(s) + 1;
+
+  /* keep the table at most half full */
+  if(++obj->string_count * 2 > obj->string_buckets) {
+    String_entry* old = obj->string_table;
+    int old_buckets = obj->string_buckets;
+
+    obj->string_buckets *= 2;
+    obj->string_table = malloc(obj->string_buckets * sizeof(String_entry));
+    for(i = 0; i < obj->string_buckets; i++)
+      obj->string_table[i].offset = -1;
+    for(i = 0; i < old_buckets; i++) {
+      if(old[i].offset < 0)
+        continue;
+      j = hash_str(obj->strings + old[i].offset) % obj->string_buckets;
+      while(obj->string_table[j].offset >= 0)
+        j = (j + 1) % obj->string_buckets;
+      obj->string_table[j] = old[i];
+    }
+    free(old);
+  }
+  return obj->strings_size - strlen(s) - 1;
+}
+
+/* the index of the import of name, adding it if need be */
+static int add_import(Object* obj, char* name) {
+  int offset = add_string(obj, name);
+  int i = hash_str(name) % obj->string_buckets;
+
+  while(obj->string_table[i].offset != offset)
+    i = (i + 1) % obj->string_buckets;
+  if(obj->string_table[i].import < 0) {
+    obj->imports = grow(obj->imports, &obj->import_capacity,
+                        obj->import_count + 1, sizeof(int));
+    obj->imports[obj->import_count] = offset;
+    obj->string_table[i].import = obj->import_count++;
+  }
+  return obj->string_table[i].import;
+}
+
+/* makes sure array has room for count elements of size bytes */
+static void* grow(void* array, int* capacity, int count, int size) {
+  if(count <= *capacity)
+    return array;
+  while(*capacity < count)
+    *capacity = *capacity ? *capacity * 2 : 256;
+  return realloc(array, (long)*capacity * size);
+}
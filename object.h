@@ -0,0 +1,88 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include "error.h"
+#include "expr.h"
+
+#include <stdio.h>
+
+/* with -c, a program is assembled into an object file for snaplink to
+   put together with others, rather than into a finished binary. code
+   before the first ORG is relocatable: it's assembled as if it started
+   at 0 (section 1 - current_section is 0 for fixed code), and the linker
+   moves it to wherever it ends up. symbols the program uses but doesn't
+   define are imported from the other objects. every operand that depends
+   on either gets a relocation, telling the linker how to fill it in.
+   SECTION starts another relocatable section (numbered on from 1), and
+   ALIGN, AT, BANK and SAMEBANK tell the linker where it may go */
+#define OBJECT_MAGIC "SNAPOBJ"
+#define OBJECT_FORMAT 2
+
+/* the file is the header, then each of these tables in turn, then the
+   strings and the sections' bytes. names are offsets into the strings */
+typedef struct {
+  char magic[8];
+  char version[16];
+  int format;
+  int section_count;
+  int symbol_count;
+  int import_count;
+  int reloc_count;
+  int strings_size;
+  int data_size;
+} Object_header;
+
+typedef struct {
+  int name;
+  int fixed; /* placed by ORG at address, rather than by the linker */
+  int address;
+  int size;
+  int data; /* offset of its bytes in the data area */
+
+  /* where the linker may put a relocatable section */
+  int align;
+  int bank_lo;
+  int bank_hi;
+  int same_bank; /* the name of a section to share a bank with, or -1 */
+  int at; /* a fixed address, or -1 */
+} Object_section;
+
+/* what a value is relative to */
+typedef enum {TARGET_ABSOLUTE, TARGET_SECTION, TARGET_IMPORT} Target_kind;
+
+/* an exported symbol */
+typedef struct {
+  int name;
+  int kind; /* TARGET_ABSOLUTE or TARGET_SECTION */
+  int section;
+  int val;
+} Object_symbol;
+
+/* how a relocation's field is filled in */
+#define RELOC_RELATIVE 1  /* with the distance from the end of the field */
+#define RELOC_TRUNCATE 2  /* with as many low bytes as fit */
+#define RELOC_SAME_BANK 4 /* the value must be in the instruction's bank */
+#define RELOC_DATA_BANK 8 /* the value must be in bank */
+
+/* a field in a section whose value is the target's plus addend, shifted
+   right by shift bits */
+typedef struct {
+  int section;
+  int offset;
+  int size;
+  int shift;
+  int flags;
+  int bank;
+  int kind;
+  int target; /* a section or import index */
+  int addend;
+  int filename; /* where it came from, for errors */
+  int line_num;
+} Object_reloc;
+
+extern int relocating;
+
+int reloc_target(Expr* e);
+Status write_object(FILE* fp);
+
+#endif
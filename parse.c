@@ -1,9 +1,12 @@
 #include "parse.h"
 
 #include "error.h"
+#include "expr.h"
+#include "files.h"
 #include "instructions.h"
 #include "labels.h"
 #include "lines.h"
+#include "precomp.h"
 #include "snap.h"
 
 #include <ctype.h>
@@ -11,9 +14,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define LINE_LENGTH 256
-
-static Status incsrc(Line* line);
+static Status incsrc(Line* line, int once);
 static void strip_comment(char* line);
 static char* get_label(char* l, char** label);
 static char* get_instruction(char* l, char** instruction);
@@ -30,10 +31,10 @@ static Status read_str(char** lp, char** str);
 /* reads in and parses a file, loads it into the global line list */
 Status read_file(FILE* fp) {
   char l[LINE_LENGTH];
+  Status status = OK;
 
   line_num = 0;
   while(fgets(l, LINE_LENGTH, fp)) {
-    char* lp;
     Line* line = alloc_line();
 
     /* bookkeeping */
@@ -41,66 +42,109 @@ Status read_file(FILE* fp) {
     line->line_num = line_num;
     line->filename = current_filename;
 
-    strip_comment(l);
+    /* a line that's wrong is left out, and the rest still read, so that
+       every line that's wrong can be reported at once */
+    if(parse_line(l, line) != OK || add_parsed_line(line) != OK) {
+      status = ERROR;
+      if(too_many_errors())
+        return ERROR;
+    }
+  }
+  if(!feof(fp)) {
+    fprintf(stderr, "Error: reading from input file\n");
+    return ERROR;
+  }
 
-    lp = get_label(l, &line->label);
-    if(!lp)
-      return ERROR;
+  return status;
+}
 
-    lp = get_instruction(lp, &line->instruction);
-    if(!lp)
-      return ERROR;
+/* parses a single line of source into line. the text is modified */
+Status parse_line(char* l, Line* line) {
+  char* lp;
 
-    if(line->label && line->label[0] != '.' &&
-       (!line->instruction || strcasecmp(line->instruction, "equ") != 0)) {
-      current_label = line->label;
-      current_label_len = strlen(current_label);
-    }
+  strip_comment(l);
 
-    if(line->instruction) {
-      if(get_operand(lp, line) != OK)
-        return ERROR;
-    }
+  lp = get_label(l, &line->label);
+  if(!lp)
+    return ERROR;
 
-    /* special case for incsrc */
-    if(line->instruction && strcasecmp(line->instruction, "incsrc") == 0) {
-      line->instruction = NULL;
-      if(line->label)
-        add_line(line);
-      if(incsrc(line) != OK)
-        return ERROR;
-    }
-    else if(line->label || line->instruction)
-      add_line(line);
+  lp = get_instruction(lp, &line->instruction);
+  if(!lp)
+    return ERROR;
 
-    if(!line->instruction && !line->label)
-      free(line);
+  if(line->label && line->label[0] != '.' &&
+     (!line->instruction || strcasecmp(line->instruction, "equ") != 0)) {
+    current_label = line->label;
+    current_label_len = strlen(current_label);
   }
-  if(!feof(fp)) {
-    fprintf(stderr, "Error: reading from input file\n");
-    return ERROR;
+
+  if(line->instruction) {
+    if(get_operand(lp, line) != OK)
+      return ERROR;
   }
+  return OK;
+}
 
+/* adds a freshly parsed line to the global line list, reading in the file
+   it names if it's an INCSRC. lines with nothing on them are freed */
+Status add_parsed_line(Line* line) {
+  /* a file being read in is recorded, so it needn't be parsed again */
+  if(current_source && current_source->capturing &&
+     (line->label || line->instruction))
+    record_line(&current_source->file->records, line);
+
+  /* special case for incsrc */
+  if(line->instruction &&
+     (strcasecmp(line->instruction, "incsrc") == 0 ||
+      strcasecmp(line->instruction, "incsrc_once") == 0)) {
+    int once = line->instruction[6] != '\0';
+    line->instruction = NULL;
+    if(line->label)
+      add_line(line);
+    if(incsrc(line, once) != OK)
+      return ERROR;
+  }
+  /* and for a file asking to only be included once */
+  else if(line->instruction && strcasecmp(line->instruction, "once") == 0) {
+    line->instruction = NULL;
+    if(current_source && current_source->file)
+      current_source->file->once = 1;
+    if(line->label)
+      add_line(line);
+  }
+  else if(line->label || line->instruction)
+    add_line(line);
+
+  if(!line->instruction && !line->label)
+    free_line(line);
   return OK;
 }
 
-Status incsrc(Line* line) {
+Status incsrc(Line* line, int once) {
   char* backup_filename;
   int backup_linenum;
+  File* file;
+  Status status;
   if(line->addr_mode != STRING || line->expr1->type != STRING_EXPR)
     return invalid_operand(line);
 
+  /* a file that's only to be included once might already have been */
+  file = find_file(line->expr1->e.str);
+  if(file && (once || file->once) && already_included(file)) {
+    file->skips++;
+    return OK;
+  }
+
   backup_filename = current_filename;
   backup_linenum = line_num;
   current_filename = line->expr1->e.str;
 
-  if(load_file(current_filename) != OK)
-    return ERROR;
+  status = load_file(current_filename);
 
   current_filename = backup_filename;
   line_num = backup_linenum;
 
-  return OK;
+  return status;
 }
 
 /* "removes" comments by truncating a string when it detects one */
@@ -194,7 +238,7 @@ static Status get_operand(char* lp, Line* line) {
   }
   else if(*lp == '"') {
     line->addr_mode = STRING;
-    line->expr1 = malloc(sizeof(Expr));
+    line->expr1 = alloc_expr();
     line->expr1->type = STRING_EXPR;
     if(read_str(&lp, &line->expr1->e.str) != OK)
       return ERROR;
@@ -217,7 +261,7 @@ static Status get_operand(char* lp, Line* line) {
       lp++;
     }
 
-    line->expr1 = malloc(sizeof(Expr));
+    line->expr1 = alloc_expr();
     if(read_expr(&lp, line->expr1) != OK)
       return ERROR;
   }
@@ -228,7 +272,7 @@ static Status get_operand(char* lp, Line* line) {
     while(*lp && isspace(*lp)) lp++;
 
     /* read in the expression in the []s */
-    line->expr1 = malloc(sizeof(Expr));
+    line->expr1 = alloc_expr();
     if(read_expr(&lp, line->expr1) != OK)
       return ERROR;
 
@@ -269,7 +313,7 @@ static Status get_operand(char* lp, Line* line) {
     /* skip whitespace after the paren */
     while(*lp && isspace(*lp)) lp++;
     
-    line->expr1 = malloc(sizeof(Expr));
+    line->expr1 = alloc_expr();
     if(read_expr(&lp, line->expr1) != OK)
       return ERROR;
 
@@ -383,7 +427,7 @@ static Status get_operand(char* lp, Line* line) {
         return OK;
       }
     }
-    line->expr1 = malloc(sizeof(Expr));
+    line->expr1 = alloc_expr();
     if(read_expr(&lp, line->expr1) != OK)
       return ERROR;
     /* skip whitespace */
@@ -431,7 +475,7 @@ static Status read_list(char** lp, Line* line) {
   line->expr2 = end = line->expr1;
   while(**lp) {
     list_size++;
-    end->next = malloc(sizeof(Expr));
+    end->next = alloc_expr();
     end = end->next;
     if(read_expr(lp, end) != OK)
       return ERROR;
@@ -448,7 +492,7 @@ static Status read_list(char** lp, Line* line) {
   }
   end->next = NULL;
 
-  line->expr1 = malloc(sizeof(Expr));
+  line->expr1 = alloc_expr();
   line->expr1->type = NUMBER;
   line->expr1->e.num = list_size;
 
@@ -465,7 +509,7 @@ static Status read_expr(char** lp, Expr* expr) {
 
   while(**lp == '-' || **lp == '+') {
     /* copy the current expression into the left */
-    l = malloc(sizeof(Expr));
+    l = alloc_expr();
     *l = *expr;
 
     /* make new expression */
@@ -475,7 +519,7 @@ static Status read_expr(char** lp, Expr* expr) {
       expr->type = ADD;
 
     expr->e.subexpr[0] = l;
-    expr->e.subexpr[1] = malloc(sizeof(Expr));
+    expr->e.subexpr[1] = alloc_expr();
     (*lp)++;
     while(**lp && isspace(**lp)) (*lp)++;
     if(read_atom(lp, expr->e.subexpr[1]) != OK)
@@ -2,9 +2,15 @@
 #define PARSE_H
 
 #include "error.h"
+#include "lines.h"
 
 #include <stdio.h>
 
+/* the longest line of source that will be read */
+#define LINE_LENGTH 256
+
 Status read_file(FILE* fp);
+Status parse_line(char* l, Line* line);
+Status add_parsed_line(Line* line);
 
 #endif
@@ -0,0 +1,326 @@
+#include "patch.h"
+
+#include "error.h"
+#include "image.h"
+#include "precomp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* with --ips or --bps, the output is a patch that turns a reference ROM
+   into the one just built, rather than the ROM itself. the two are
+   compared 16 bytes at a time, and only the stretches that differ cost
+   any more than that */
+
+/* changes closer together than this go in one record, since starting
+   another costs more than the matching bytes between them */
+#define IPS_GAP 6
+#define BPS_GAP 4
+
+/* a run of one byte at least this long is cheaper repeated than spelled
+   out */
+#define IPS_RUN 9
+#define BPS_RUN 8
+
+/* IPS offsets are 24 bits, and a record can't start at "EOF" or it'd end
+   the patch. records are kept a byte short of the most they can hold, so
+   one starting there can start a byte earlier instead */
+#define IPS_LIMIT 0x1000000
+#define IPS_EOF 0x454F46
+#define IPS_MAX_RECORD 0xFFFE
+
+/* BPS actions */
+#define SOURCE_READ 0
+#define TARGET_READ 1
+#define TARGET_COPY 3
+
+static FILE* out;
+static unsigned long patch_crc;
+static unsigned long crc_table[256];
+
+static Status write_ips(Image* reference, Image* target);
+static void ips_range(unsigned char* bytes, long start, long end);
+static void ips_record(long offset, long size, unsigned char* data, int rle);
+static void write_bps(Image* reference, Image* target);
+static void bps_action(int action, long length);
+static void put_number(unsigned long long n);
+static long next_change(Image* reference, Image* target, long i, long gap,
+                        long* end);
+static long next_difference(unsigned char* a, unsigned char* b, long i,
+                            long n);
+static long run_length(unsigned char* bytes, long pos, long end, long max);
+static void put(void* data, long n);
+static void put_int(unsigned long n, int size, int big_endian);
+static unsigned long crc32(unsigned long crc, unsigned char* p, long n);
+
+/* maps in the ROM a patch is made against */
+Status map_reference(char* filename, Image* reference) {
+  long long size;
+
+  init_image(reference);
+  reference->bytes = map_file(filename, &size);
+  if(!reference->bytes) {
+    fprintf(stderr, "Error: could not read reference ROM %s\n", filename);
+    return ERROR;
+  }
+  reference->size = size;
+  return OK;
+}
+
+void unmap_reference(Image* reference) {
+  if(reference->size)
+    munmap(reference->bytes, reference->size);
+  init_image(reference);
+}
+
+Status write_patch(FILE* fp, Image* reference, Image* target,
+                   Patch_format format) {
+  out = fp;
+  patch_crc = 0;
+  if(format == IPS)
+    return write_ips(reference, target);
+  write_bps(reference, target);
+  return OK;
+}
+
+/* "PATCH", then records of a 24-bit offset, 16-bit size and that many
+   bytes - or, with a size of 0, a 16-bit count and a byte to repeat - then
+   "EOF" and, if the ROM's shrunk, its new size. all big endian */
+static Status write_ips(Image* reference, Image* target) {
+  long start;
+  long end;
+  long i = 0;
+
+  if(target->size > IPS_LIMIT) {
+    fprintf(stderr, "Error: the ROM is too big for an IPS patch\n");
+    return ERROR;
+  }
+  put("PATCH", 5);
+  while((start = next_change(reference, target, i, IPS_GAP, &end)) >= 0) {
+    ips_range(target->bytes, start, end);
+    i = end;
+  }
+  put("EOF", 3);
+  if(target->size < reference->size)
+    put_int(target->size, 3, 1);
+  return OK;
+}
+
+/* writes the records for a changed stretch, runs of one byte as RLE */
+static void ips_range(unsigned char* bytes, long start, long end) {
+  long pos = start;
+
+  while(pos < end) {
+    long run = run_length(bytes, pos, end, IPS_MAX_RECORD);
+    long next;
+
+    if(run >= IPS_RUN) {
+      ips_record(pos, run, bytes + pos, 1);
+      pos += run;
+      continue;
+    }
+    for(next = pos + run; next < end && next - pos < IPS_MAX_RECORD;
+        next += run)
+      if((run = run_length(bytes, next, end, IPS_MAX_RECORD)) >= IPS_RUN)
+        break;
+    if(next - pos > IPS_MAX_RECORD)
+      next = pos + IPS_MAX_RECORD;
+    ips_record(pos, next - pos, bytes + pos, 0);
+    pos = next;
+  }
+}
+
+static void ips_record(long offset, long size, unsigned char* data, int rle) {
+  if(offset == IPS_EOF) {
+    /* start a byte earlier, spelling that and the first byte out */
+    if(rle) {
+      ips_record(offset - 1, 2, data - 1, 0);
+      if(size > 1)
+        ips_record(offset + 1, size - 1, data + 1, 1);
+      return;
+    }
+    offset--;
+    size++;
+    data--;
+  }
+  put_int(offset, 3, 1);
+  if(rle) {
+    put_int(0, 2, 1);
+    put_int(size, 2, 1);
+    put(data, 1);
+  }
+  else {
+    put_int(size, 2, 1);
+    put(data, size);
+  }
+}
+
+/* "BPS1", the reference and target sizes and an empty metadata size, then
+   actions building the target from start to end: copying what's at the
+   same place in the reference, bytes given in the patch, or a repeat of
+   the last byte written. then the CRC32s of the reference, the target and
+   the patch so far */
+static void write_bps(Image* reference, Image* target) {
+  long written = 0;
+  long copied = 0; /* where the last TARGET_COPY ended */
+  long start;
+  long end;
+
+  put("BPS1", 4);
+  put_number(reference->size);
+  put_number(target->size);
+  put_number(0);
+
+  while((start = next_change(reference, target, written, BPS_GAP, &end))
+        >= 0) {
+    long literal = start;
+    long pos = start;
+
+    if(start > written)
+      bps_action(SOURCE_READ, start - written);
+    while(pos < end) {
+      long run = run_length(target->bytes, pos, end, end - pos);
+      long delta = pos - copied;
+
+      if(run < BPS_RUN) {
+        pos += run;
+        continue;
+      }
+      /* the run's first byte is given, and the rest copy it */
+      bps_action(TARGET_READ, pos + 1 - literal);
+      put(target->bytes + literal, pos + 1 - literal);
+      bps_action(TARGET_COPY, run - 1);
+      put_number((delta < 0 ? -delta : delta) << 1 | (delta < 0));
+      copied = pos + run - 1;
+      pos += run;
+      literal = pos;
+    }
+    if(literal < end) {
+      bps_action(TARGET_READ, end - literal);
+      put(target->bytes + literal, end - literal);
+    }
+    written = end;
+  }
+  if(written < target->size)
+    bps_action(SOURCE_READ, target->size - written);
+
+  put_int(crc32(0, reference->bytes, reference->size), 4, 0);
+  put_int(crc32(0, target->bytes, target->size), 4, 0);
+  put_int(patch_crc, 4, 0);
+}
+
+static void bps_action(int action, long length) {
+  put_number((unsigned long long)(length - 1) << 2 | action);
+}
+
+/* BPS numbers are 7 bits a byte, low first, the top bit marking the last.
+   each byte but the last counts one more than it says, so every number
+   has just one encoding */
+static void put_number(unsigned long long n) {
+  for(;;) {
+    unsigned char byte = n & 0x7F;
+    n >>= 7;
+    if(!n) {
+      byte |= 0x80;
+      put(&byte, 1);
+      return;
+    }
+    put(&byte, 1);
+    n--;
+  }
+}
+
+/* finds the next stretch, from i on, where the target differs from the
+   reference (or goes past its end), taking in any matches shorter than
+   gap. returns its start and sets end, or returns -1 if there's none */
+static long next_change(Image* reference, Image* target, long i, long gap,
+                        long* end) {
+  long common = reference->size < target->size ? reference->size
+                                               : target->size;
+  long start;
+
+  start = next_difference(reference->bytes, target->bytes, i, common);
+  if(start >= common) {
+    if(start >= target->size)
+      return -1;
+    *end = target->size;
+    return start;
+  }
+
+  *end = start + 1;
+  for(;;) {
+    long next = next_difference(reference->bytes, target->bytes, *end,
+                                common);
+    if(next == common && target->size > common && common - *end < gap) {
+      *end = target->size;
+      break;
+    }
+    if(next == common || next - *end >= gap)
+      break;
+    *end = next + 1;
+  }
+  return start;
+}
+
+/* the first place from i where a and b differ, or n */
+static long next_difference(unsigned char* a, unsigned char* b, long i,
+                            long n) {
+#ifdef __SSE2__
+  for(; i + 16 <= n; i += 16) {
+    int same = _mm_movemask_epi8(
+                 _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(a + i)),
+                                _mm_loadu_si128((__m128i*)(b + i))));
+    if(same != 0xFFFF)
+      return i + __builtin_ctz(~same);
+  }
+#endif
+  for(; i < n && a[i] == b[i]; i++);
+  return i;
+}
+
+/* how many times the byte at pos repeats, up to end or max */
+static long run_length(unsigned char* bytes, long pos, long end, long max) {
+  long i = pos + 1;
+
+  while(i < end && i - pos < max && bytes[i] == bytes[pos])
+    i++;
+  return i - pos;
+}
+
+static void put(void* data, long n) {
+  fwrite(data, 1, n, out);
+  patch_crc = crc32(patch_crc, data, n);
+}
+
+static void put_int(unsigned long n, int size, int big_endian) {
+  unsigned char bytes[4];
+  int i;
+
+  for(i = 0; i < size; i++)
+    bytes[big_endian ? size - 1 - i : i] = n >> (8 * i);
+  put(bytes, size);
+}
+
+/* carries on a CRC32 (as zip has) over n more bytes */
+static unsigned long crc32(unsigned long crc, unsigned char* p, long n) {
+  long i;
+
+  if(!crc_table[1]) {
+    for(i = 0; i < 256; i++) {
+      unsigned long c = i;
+      int k;
+      for(k = 0; k < 8; k++)
+        c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      crc_table[i] = c;
+    }
+  }
+  crc ^= 0xFFFFFFFF;
+  for(i = 0; i < n; i++)
+    crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFF;
+}
@@ -0,0 +1,16 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include "error.h"
+#include "image.h"
+
+#include <stdio.h>
+
+typedef enum {IPS, BPS} Patch_format;
+
+Status map_reference(char* filename, Image* reference);
+void unmap_reference(Image* reference);
+Status write_patch(FILE* fp, Image* reference, Image* target,
+                   Patch_format format);
+
+#endif
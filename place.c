@@ -0,0 +1,503 @@
+#include "place.h"
+
+#include "error.h"
+#include "object.h"
+#include "rom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* sections ORG'd or AT'd somewhere are put there first, then the rest are
+   packed into the space left around them, best fit decreasing: those
+   allowed in the fewest banks go first, the biggest first among those,
+   and each goes in the gap it leaves the least of. sections that must
+   share a bank are placed together, in whichever allowed bank they leave
+   the least room in */
+
+typedef struct {
+  int start;
+  int end;
+} Region;
+
+/* the free space left in a bank of ROM, in order */
+typedef struct {
+  Region* free;
+  int count;
+  int capacity;
+} Bank;
+
+/* some sections that have to be in the same bank */
+typedef struct {
+  int first; /* in order */
+  int count;
+  int lo;
+  int hi;
+  int size;
+  int choices;
+} Group;
+
+static Rom_map rom_map;
+static Bank* banks = NULL;
+static int bank_count = 0;
+static int bank_size = 0;
+static int limit = 0;
+static int used_banks = 0;
+
+static Placement* all;
+static int* order;
+
+static Status place_fixed(Placement* places, int i);
+static Status join_group(Placement* places, int count, int i);
+static int find_group(Placement* places, int i);
+static Status group_banks(Placement* places, Group* g);
+static Status place_group(Placement* places, Group* g);
+static int best_fit(Bank* b, int lo, int hi, int address, int size,
+                    int align, int* offset);
+static void carve(Bank* b, int start, int end);
+static void copy_bank(Bank* to, Bank* from);
+static int free_space(Bank* b);
+static int compare_members(const void* a, const void* b);
+static int compare_groups(const void* a, const void* b);
+static int compare_offsets(const void* a, const void* b);
+
+/* decides where every section goes. rom_size is the size of the ROM, or
+   0 to make it as big as it needs to be, which it's then set to */
+Status place_in_rom(Placement* places, int count, Rom_map map,
+                    int* rom_size) {
+  Group* groups;
+  int group_count = 0;
+  Status status = OK;
+  int end = 0;
+  int i;
+
+  rom_map = map;
+  bank_size = rom_bank_size(map);
+  limit = *rom_size ? *rom_size : rom_max_size(map);
+  bank_count = (limit + bank_size - 1) / bank_size;
+  banks = calloc(bank_count, sizeof(Bank));
+  for(i = 0; i < bank_count; i++) {
+    banks[i].free = malloc(sizeof(Region));
+    banks[i].capacity = banks[i].count = 1;
+    banks[i].free[0].start = i * bank_size;
+    banks[i].free[0].end = (i + 1) * bank_size < limit ? (i + 1) * bank_size
+                                                        : limit;
+  }
+
+  all = places;
+  for(i = 0; i < count; i++) {
+    places[i].group = i;
+    places[i].offset = -1;
+  }
+  for(i = 0; i < count; i++) {
+    Object_section* s = places[i].section;
+    if((s->fixed || s->at >= 0) && place_fixed(places, i) != OK)
+      status = ERROR;
+  }
+  for(i = 0; i < count; i++)
+    if(places[i].same_bank && join_group(places, count, i) != OK)
+      status = ERROR;
+  if(status != OK)
+    return ERROR;
+
+  /* sort the sections into their groups, biggest first */
+  order = malloc((count + 1) * sizeof(int));
+  for(i = 0; i < count; i++) {
+    order[i] = i;
+    places[i].group = find_group(places, i);
+  }
+  qsort(order, count, sizeof(int), compare_members);
+
+  groups = malloc((count + 1) * sizeof(Group));
+  for(i = 0; i < count; i++) {
+    Group* g = &groups[group_count];
+    if(i && places[order[i]].group == places[order[i-1]].group) {
+      groups[group_count-1].count++;
+      continue;
+    }
+    g->first = i;
+    g->count = 1;
+    group_count++;
+  }
+  for(i = 0; i < group_count; i++)
+    if(group_banks(places, &groups[i]) != OK)
+      status = ERROR;
+  if(status != OK)
+    return ERROR;
+
+  qsort(groups, group_count, sizeof(Group), compare_groups);
+  for(i = 0; i < group_count; i++)
+    if(place_group(places, &groups[i]) != OK)
+      status = ERROR;
+  free(groups);
+  if(status != OK)
+    return ERROR;
+
+  /* unless it was given, the ROM ends with the last bank used */
+  for(i = 0; i < count; i++) {
+    if(places[i].offset >= 0 && places[i].section->size &&
+       places[i].offset + places[i].section->size > end)
+      end = places[i].offset + places[i].section->size;
+  }
+  if(!*rom_size)
+    *rom_size = (end + bank_size - 1) / bank_size * bank_size;
+  used_banks = (*rom_size + bank_size - 1) / bank_size;
+  return OK;
+}
+
+/* lists where each section went, then how full each bank is */
+void report_placement(FILE* fp, Placement* places, int count) {
+  int total_used = 0;
+  int total_free = 0;
+  int i;
+  int j;
+
+  all = places;
+  order = realloc(order, (count + 1) * sizeof(int));
+  for(i = 0; i < count; i++)
+    order[i] = i;
+  qsort(order, count, sizeof(int), compare_offsets);
+
+  fprintf(fp, "address  size   section\n");
+  for(i = 0; i < count; i++) {
+    Placement* p = &places[order[i]];
+    if(!p->section->size)
+      continue;
+    fprintf(fp, "$%06X  $%04X  %s (%s)\n", p->address, p->section->size,
+            p->name, p->filename);
+  }
+
+  fprintf(fp, "\nbank  used    free    fragments  largest\n");
+  for(i = 0; i < used_banks; i++) {
+    Bank* b = &banks[i];
+    int free = free_space(b);
+    int largest = 0;
+    int size = (i + 1) * bank_size < limit ? bank_size : limit - i*bank_size;
+
+    for(j = 0; j < b->count; j++)
+      if(b->free[j].end - b->free[j].start > largest)
+        largest = b->free[j].end - b->free[j].start;
+    fprintf(fp, "$%02X   $%-5X  $%-5X  %9d  $%X\n",
+            rom_home_bank(rom_map, i), size - free, free, b->count, largest);
+    total_used += size - free;
+    total_free += free;
+  }
+  fprintf(fp, "total $%X bytes used, $%X free\n", total_used, total_free);
+}
+
+/* puts a section where it was ORG'd or AT'd to */
+static Status place_fixed(Placement* places, int i) {
+  Placement* p = &places[i];
+  int size = p->section->size;
+  int address = p->section->fixed ? p->section->address : p->section->at;
+  int offset = rom_offset(rom_map, address);
+  int j;
+
+  p->address = address;
+  p->offset = offset;
+  if(!size)
+    return OK;
+
+  if(offset < 0 || offset + size > limit ||
+     (address + size - 1) >> 16 != address >> 16 ||
+     rom_offset(rom_map, address + size - 1) != offset + size - 1) {
+    fprintf(stderr, "Error: section %s (%s) at $%06X isn't all in the ROM\n",
+            p->name, p->filename, address);
+    return ERROR;
+  }
+
+  for(j = 0; j < i; j++) {
+    Placement* q = &places[j];
+    if(q->offset >= 0 && q->section->size && q->offset < offset + size &&
+       offset < q->offset + q->section->size) {
+      fprintf(stderr, "Error: sections %s (%s) and %s (%s) overlap at "
+                      "$%06X\n", q->name, q->filename, p->name, p->filename,
+              address);
+      return ERROR;
+    }
+  }
+  carve(&banks[offset / bank_size], offset, offset + size);
+  return OK;
+}
+
+/* puts a section in the same group as the one it has to share a bank
+   with, looking in its own object first */
+static Status join_group(Placement* places, int count, int i) {
+  int found = -1;
+  int j;
+
+  for(j = 0; j < count; j++) {
+    if(j == i || strcmp(places[j].name, places[i].same_bank) != 0)
+      continue;
+    if(found < 0 || (places[j].module == places[i].module &&
+                     places[found].module != places[i].module))
+      found = j;
+  }
+  if(found < 0) {
+    fprintf(stderr, "Error: section %s (%s) is to share a bank with %s, "
+                    "which doesn't exist\n", places[i].name,
+            places[i].filename, places[i].same_bank);
+    return ERROR;
+  }
+  places[find_group(places, i)].group = find_group(places, found);
+  return OK;
+}
+
+static int find_group(Placement* places, int i) {
+  while(places[i].group != i) {
+    places[i].group = places[places[i].group].group;
+    i = places[i].group;
+  }
+  return i;
+}
+
+/* works out which banks a group may go in, from its members' BANKs and
+   any of them that's already been placed */
+static Status group_banks(Placement* places, Group* g) {
+  Placement* fixed = NULL;
+  int i;
+
+  g->lo = 0;
+  g->hi = 0xFF;
+  g->size = 0;
+  for(i = g->first; i < g->first + g->count; i++) {
+    Placement* p = &places[order[i]];
+    Object_section* s = p->section;
+
+    if(s->bank_lo > g->lo)
+      g->lo = s->bank_lo;
+    if(s->bank_hi < g->hi)
+      g->hi = s->bank_hi;
+    if(p->offset < 0)
+      g->size += s->size;
+    else if(s->size) {
+      if(fixed && fixed->address >> 16 != p->address >> 16) {
+        fprintf(stderr, "Error: sections %s (%s) and %s (%s) must share a "
+                        "bank, but are placed in different ones\n",
+                fixed->name, fixed->filename, p->name, p->filename);
+        return ERROR;
+      }
+      fixed = p;
+    }
+  }
+
+  if(fixed) {
+    int bank = fixed->address >> 16;
+    if(bank < g->lo || bank > g->hi) {
+      fprintf(stderr, "Error: section %s (%s) is in bank $%02X, which the "
+                      "sections sharing its bank can't go in\n",
+              fixed->name, fixed->filename, bank);
+      return ERROR;
+    }
+    g->lo = g->hi = bank;
+  }
+
+  /* sections that can go anywhere go wherever the ROM's normally seen */
+  if(g->lo == 0 && g->hi == 0xFF)
+    g->choices = bank_count;
+  else
+    g->choices = g->hi - g->lo + 1;
+  return OK;
+}
+
+/* tries the group in every bank it's allowed in, and keeps the one that
+   leaves the least space */
+static Status place_group(Placement* places, Group* g) {
+  Bank trial = {NULL, 0, 0};
+  Bank best = {NULL, 0, 0};
+  int* offsets = malloc((g->count + 1) * sizeof(int));
+  int* best_offsets = malloc((g->count + 1) * sizeof(int));
+  int best_free = -1;
+  int best_bank = 0;
+  int best_start = 0;
+  int best_address = 0;
+  int i;
+  int c;
+
+  if(!g->size) {
+    /* nothing to place but labels. they go at the start of a bank */
+    for(i = g->first; i < g->first + g->count; i++) {
+      Placement* p = &places[order[i]];
+      if(p->offset >= 0)
+        continue;
+      p->address = 0;
+      rom_window(rom_map, g->choices == bank_count ?
+                          rom_home_bank(rom_map, 0) : g->lo, &p->address);
+      p->offset = rom_offset(rom_map, p->address);
+    }
+    free(offsets);
+    free(best_offsets);
+    return OK;
+  }
+
+  for(c = 0; c < g->choices; c++) {
+    int bank = g->choices == bank_count ? rom_home_bank(rom_map, c)
+                                        : g->lo + c;
+    int address;
+    int size = rom_window(rom_map, bank, &address);
+    int start;
+    int end;
+    int fits = 1;
+
+    if(!size)
+      continue;
+    start = rom_offset(rom_map, address);
+    end = start + size < limit ? start + size : limit;
+    if(start >= limit)
+      continue;
+
+    copy_bank(&trial, &banks[start / bank_size]);
+    for(i = g->first; i < g->first + g->count && fits; i++) {
+      Placement* p = &places[order[i]];
+      if(p->offset >= 0)
+        offsets[i - g->first] = p->offset;
+      else if(!p->section->size)
+        offsets[i - g->first] = start;
+      else if(best_fit(&trial, start, end, address, p->section->size,
+                       p->section->align, &offsets[i - g->first]) < 0)
+        fits = 0;
+      else
+        carve(&trial, offsets[i - g->first],
+              offsets[i - g->first] + p->section->size);
+    }
+    if(fits && (best_free < 0 || free_space(&trial) < best_free)) {
+      best_free = free_space(&trial);
+      copy_bank(&best, &trial);
+      memcpy(best_offsets, offsets, g->count * sizeof(int));
+      best_bank = start / bank_size;
+      best_start = start;
+      best_address = address;
+    }
+  }
+
+  free(trial.free);
+  free(offsets);
+  if(best_free < 0) {
+    Placement* p = &places[order[g->first]];
+    fprintf(stderr, "Error: section %s (%s) of $%X bytes doesn't fit in "
+                    "the ROM", p->name, p->filename, p->section->size);
+    if(g->count > 1)
+      fprintf(stderr, " along with the sections sharing its bank");
+    fprintf(stderr, "\n");
+    free(best_offsets);
+    return ERROR;
+  }
+
+  free(banks[best_bank].free);
+  banks[best_bank] = best;
+  for(i = g->first; i < g->first + g->count; i++) {
+    Placement* p = &places[order[i]];
+    if(p->offset >= 0)
+      continue;
+    p->offset = best_offsets[i - g->first];
+    p->address = best_address + p->offset - best_start;
+  }
+  free(best_offsets);
+  return OK;
+}
+
+/* finds the free region between ROM offsets lo and hi that an aligned
+   block of size fits most snugly in. address is where lo is. returns the
+   region, or -1 if it fits in none */
+static int best_fit(Bank* b, int lo, int hi, int address, int size,
+                    int align, int* offset) {
+  int best = -1;
+  int best_left = 0;
+  int i;
+
+  for(i = 0; i < b->count; i++) {
+    int start = b->free[i].start > lo ? b->free[i].start : lo;
+    int end = b->free[i].end < hi ? b->free[i].end : hi;
+    int at = address + start - lo;
+    int o = start + (align - at % align) % align;
+
+    if(o + size > end)
+      continue;
+    if(best < 0 || end - start - size < best_left) {
+      best = i;
+      best_left = end - start - size;
+      *offset = o;
+    }
+  }
+  return best;
+}
+
+/* takes the bytes from start to end out of a bank's free space */
+static void carve(Bank* b, int start, int end) {
+  int i;
+
+  for(i = 0; i < b->count; i++)
+    if(b->free[i].start <= start && end <= b->free[i].end)
+      break;
+  if(i == b->count)
+    return;
+
+  if(b->free[i].start < start && end < b->free[i].end) {
+    /* splits it in two */
+    if(b->count == b->capacity) {
+      b->capacity *= 2;
+      b->free = realloc(b->free, b->capacity * sizeof(Region));
+    }
+    memmove(&b->free[i+1], &b->free[i], (b->count - i) * sizeof(Region));
+    b->count++;
+    b->free[i].end = start;
+    b->free[i+1].start = end;
+  }
+  else if(b->free[i].start < start)
+    b->free[i].end = start;
+  else if(end < b->free[i].end)
+    b->free[i].start = end;
+  else {
+    memmove(&b->free[i], &b->free[i+1], (b->count - i - 1) * sizeof(Region));
+    b->count--;
+  }
+}
+
+static void copy_bank(Bank* to, Bank* from) {
+  if(to->capacity < from->count + 1) {
+    to->capacity = from->count + 1;
+    to->free = realloc(to->free, to->capacity * sizeof(Region));
+  }
+  memcpy(to->free, from->free, from->count * sizeof(Region));
+  to->count = from->count;
+}
+
+static int free_space(Bank* b) {
+  int total = 0;
+  int i;
+
+  for(i = 0; i < b->count; i++)
+    total += b->free[i].end - b->free[i].start;
+  return total;
+}
+
+/* by group, then biggest first */
+static int compare_members(const void* a, const void* b) {
+  Placement* pa = &all[*(int*)a];
+  Placement* pb = &all[*(int*)b];
+
+  if(pa->group != pb->group)
+    return pa->group - pb->group;
+  return pb->section->size - pa->section->size;
+}
+
+/* the most constrained first, then the biggest */
+static int compare_groups(const void* a, const void* b) {
+  Group* ga = (Group*)a;
+  Group* gb = (Group*)b;
+
+  if(ga->choices != gb->choices)
+    return ga->choices - gb->choices;
+  if(ga->size != gb->size)
+    return gb->size - ga->size;
+  return ga->first - gb->first;
+}
+
+static int compare_offsets(const void* a, const void* b) {
+  Placement* pa = &all[*(int*)a];
+  Placement* pb = &all[*(int*)b];
+
+  if(pa->offset != pb->offset)
+    return pa->offset - pb->offset;
+  return *(int*)a - *(int*)b;
+}
@@ -0,0 +1,28 @@
+#ifndef PLACE_H
+#define PLACE_H
+
+#include "error.h"
+#include "object.h"
+#include "rom.h"
+
+#include <stdio.h>
+
+/* a section to be placed in the ROM, and where it went */
+typedef struct {
+  Object_section* section;
+  char* name;
+  char* same_bank; /* NULL if it can go in any bank */
+  char* filename; /* the object it came from */
+  int module;
+  int address;
+  int offset; /* in the ROM */
+
+  /* the first section of the ones that must share its bank */
+  int group;
+} Placement;
+
+Status place_in_rom(Placement* places, int count, Rom_map map,
+                    int* rom_size);
+void report_placement(FILE* fp, Placement* places, int count);
+
+#endif
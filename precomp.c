@@ -0,0 +1,507 @@
+#include "precomp.h"
+
+#include "error.h"
+#include "expr.h"
+#include "hash.h"
+#include "instructions.h"
+#include "labels.h"
+#include "lines.h"
+#include "parse.h"
+#include "snap.h"
+#include "table.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* a precompiled file is a header, followed by the file's records: its
+   lines, the expressions they use and the strings they refer to, all as
+   plain arrays that are used straight out of the mapping. it's only meant
+   to be read by the same build of snap that wrote it, and the header
+   keeps a hash of the records to tell if they've been damaged since */
+#define PRECOMP_MAGIC "SNAPPCH"
+#define PRECOMP_FORMAT 2
+
+#define STRING_BUCKETS 1024
+
+typedef struct {
+  char magic[8];
+  char version[16];
+  int format;
+  int line_count;
+  int expr_count;
+  int strings_size;
+  long long text_size;
+  unsigned long long text_hash;
+  unsigned long long records_hash;
+} Precomp_header;
+
+static int save_expr(Records* r, Expr* e);
+static int constant(Expr* e, int* val);
+static int save_string(Records* r, char* str);
+static Expr* load_expr(Records* r, int i);
+static int valid_records(Records* r);
+static int valid_string(Records* r, int offset);
+static Status write_precompiled(char* filename, Precomp_header* header,
+                                Records* r);
+
+void init_records(Records* r) {
+  memset(r, 0, sizeof(Records));
+}
+
+void free_records(Records* r) {
+  free(r->lines);
+  free(r->exprs);
+  free(r->strings);
+  free(r->string_table);
+  init_records(r);
+}
+
+/* adds a freshly parsed line to the records */
+void record_line(Records* r, Line* line) {
+  Precomp_line* pl;
+
+  if(r->line_count == r->line_capacity) {
+    r->line_capacity = r->line_capacity ? r->line_capacity * 2 : 64;
+    r->lines = realloc(r->lines, r->line_capacity * sizeof(Precomp_line));
+  }
+  pl = &r->lines[r->line_count++];
+  pl->line_num = line->line_num;
+  pl->label = line->label ? save_string(r, line->label) : -1;
+  pl->instruction = line->instruction ? save_string(r, line->instruction)
+                                      : -1;
+  pl->addr_mode = line->addr_mode;
+  pl->modifier = line->modifier;
+  pl->expr1 = save_expr(r, line->expr1);
+  pl->expr2 = save_expr(r, line->expr2);
+}
+
+/* adds the recorded lines to the program as though the file they came
+   from had just been parsed */
+Status replay_records(Records* r) {
+  Status status = OK;
+  int i;
+
+  line_num = 0;
+  for(i = 0; i < r->line_count && status == OK; i++) {
+    Line* line = alloc_line();
+    Precomp_line* pl = &r->lines[i];
+
+    line_num = pl->line_num;
+    line->line_num = pl->line_num;
+    line->filename = current_filename;
+    if(pl->label >= 0)
+      line->label = strdup(r->strings + pl->label);
+    if(pl->instruction >= 0)
+      line->instruction = intern_instruction(r->strings + pl->instruction);
+    line->addr_mode = pl->addr_mode;
+    line->modifier = pl->modifier;
+
+    if(line->label && line->label[0] != '.' &&
+       (!line->instruction || strcasecmp(line->instruction, "equ") != 0)) {
+      current_label = line->label;
+      current_label_len = strlen(current_label);
+    }
+
+    line->expr1 = load_expr(r, pl->expr1);
+    line->expr2 = load_expr(r, pl->expr2);
+    status = add_parsed_line(line);
+  }
+  return status;
+}
+
+/* parses filename and writes it out precompiled, next to it. the files it
+   INCSRCs are left alone, to be read (or loaded precompiled) when it's
+   included */
+Status precompile(char* filename) {
+  Precomp_header header;
+  Records r;
+  long long size;
+  void* text = map_file(filename, &size);
+  char l[LINE_LENGTH];
+  FILE* fp;
+  Status status = OK;
+
+  if(!text) {
+    fprintf(stderr, "Error: could not open file %s for reading\n", filename);
+    return ERROR;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PRECOMP_MAGIC, sizeof(header.magic));
+  strncpy(header.version, SNAP_VERSION, sizeof(header.version) - 1);
+  header.format = PRECOMP_FORMAT;
+  header.text_size = size;
+  header.text_hash = hash_bytes(text, size);
+  if(size)
+    munmap(text, size);
+
+  fp = fopen(filename, "r");
+  if(!fp) {
+    fprintf(stderr, "Error: could not open file %s for reading\n", filename);
+    return ERROR;
+  }
+
+  init_records(&r);
+  current_filename = filename;
+  current_label = "";
+  current_label_len = 0;
+  line_num = 0;
+  while(status == OK && fgets(l, LINE_LENGTH, fp)) {
+    Line* line = alloc_line();
+
+    line_num++;
+    line->line_num = line_num;
+    line->filename = current_filename;
+    if(parse_line(l, line) != OK)
+      status = ERROR;
+    else if(line->label || line->instruction)
+      record_line(&r, line);
+    free_line(line);
+  }
+  fclose(fp);
+
+  if(status == OK) {
+    Hash_state h;
+
+    header.line_count = r.line_count;
+    header.expr_count = r.expr_count;
+    header.strings_size = r.strings_size;
+    hash_init(&h);
+    hash_update(&h, r.lines, r.line_count * sizeof(Precomp_line));
+    hash_update(&h, r.exprs, r.expr_count * sizeof(Precomp_expr));
+    hash_update(&h, r.strings, r.strings_size);
+    header.records_hash = hash_final(&h);
+    status = write_precompiled(filename, &header, &r);
+  }
+
+  free_records(&r);
+  return status;
+}
+
+/* loads source from its precompiled image instead of parsing it, if
+   there's one that matches the file as it is now. returns whether it did,
+   setting status to how that went */
+int read_precompiled(Source* source, Status* status) {
+  char* path = malloc(strlen(source->filename) + strlen(PRECOMP_SUFFIX) + 1);
+  Precomp_header* header;
+  Records r;
+  long long image_size;
+  long long text_size;
+  void* image;
+  void* text;
+  int valid;
+
+  sprintf(path, "%s%s", source->filename, PRECOMP_SUFFIX);
+  image = map_file(path, &image_size);
+  free(path);
+  if(!image)
+    return 0;
+
+  /* it has to have been written by this build, for this text, and be
+     just as it was written */
+  header = image;
+  valid = image_size >= sizeof(Precomp_header) &&
+          memcmp(header->magic, PRECOMP_MAGIC, sizeof(header->magic)) == 0 &&
+          strncmp(header->version, SNAP_VERSION, sizeof(header->version)) == 0
+          && header->format == PRECOMP_FORMAT && header->line_count >= 0 &&
+          header->expr_count >= 0 && header->strings_size >= 0 &&
+          image_size == sizeof(Precomp_header) +
+                        (long long)header->line_count * sizeof(Precomp_line) +
+                        (long long)header->expr_count * sizeof(Precomp_expr) +
+                        header->strings_size &&
+          hash_bytes(header + 1, image_size - sizeof(Precomp_header)) ==
+          header->records_hash;
+  if(valid) {
+    text = map_file(source->filename, &text_size);
+    valid = text && text_size == header->text_size &&
+            hash_bytes(text, text_size) == header->text_hash;
+    if(text && text_size)
+      munmap(text, text_size);
+  }
+  if(!valid) {
+    if(image_size)
+      munmap(image, image_size);
+    return 0;
+  }
+
+  /* the records are used where they lie */
+  init_records(&r);
+  r.lines = (Precomp_line*)(header + 1);
+  r.line_count = header->line_count;
+  r.exprs = (Precomp_expr*)(r.lines + header->line_count);
+  r.expr_count = header->expr_count;
+  r.strings = (char*)(r.exprs + header->expr_count);
+  r.strings_size = header->strings_size;
+
+  /* a damaged image is no reason to fail; the text's still there */
+  if(!valid_records(&r)) {
+    munmap(image, image_size);
+    return 0;
+  }
+  *status = replay_records(&r);
+
+  munmap(image, image_size);
+  return 1;
+}
+
+/* whether every string offset and expression index in the records points
+   inside them, checked before any is used. an expression's parts and the
+   rest of its list are always saved before it, so pointing only backwards
+   also rules out loops */
+static int valid_records(Records* r) {
+  int i;
+
+  if(r->strings_size && r->strings[r->strings_size - 1])
+    return 0;
+  for(i = 0; i < r->line_count; i++) {
+    Precomp_line* pl = &r->lines[i];
+
+    if((pl->label >= 0 && !valid_string(r, pl->label)) ||
+       (pl->instruction >= 0 && !valid_string(r, pl->instruction)) ||
+       pl->addr_mode < ACCUMULATOR || pl->addr_mode > LIST ||
+       pl->modifier < NONE || pl->modifier > IMMEDIATE_LO ||
+       pl->expr1 < -1 || pl->expr1 >= r->expr_count ||
+       pl->expr2 < -1 || pl->expr2 >= r->expr_count)
+      return 0;
+  }
+  for(i = 0; i < r->expr_count; i++) {
+    Precomp_expr* pe = &r->exprs[i];
+
+    if(pe->next < -1 || pe->next >= i)
+      return 0;
+    switch(pe->type) {
+    case NUMBER:
+      break;
+    case STRING_EXPR:
+    case SYMBOL:
+      if(!valid_string(r, pe->val))
+        return 0;
+      break;
+    case ADD:
+    case SUB:
+      if(pe->sub[0] < 0 || pe->sub[0] >= i ||
+         pe->sub[1] < 0 || pe->sub[1] >= i)
+        return 0;
+      break;
+    default:
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int valid_string(Records* r, int offset) {
+  return offset >= 0 && offset < r->strings_size;
+}
+
+/* maps a whole file in for reading. an empty file gives a pointer that
+   mustn't be unmapped. returns NULL on failure */
+void* map_file(char* filename, long long* size) {
+  static char empty;
+  struct stat st;
+  void* p;
+  int fd = open(filename, O_RDONLY);
+
+  if(fd < 0)
+    return NULL;
+  if(fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  *size = st.st_size;
+  if(!*size) {
+    close(fd);
+    return &empty;
+  }
+  p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+/* adds an expression (and the rest of its list) to the records, folding
+   constant arithmetic. returns its index */
+static int save_expr(Records* r, Expr* e) {
+  Precomp_expr pe;
+  int i;
+
+  if(!e)
+    return -1;
+
+  pe.type = e->type;
+  pe.val = 0;
+  pe.sub[0] = pe.sub[1] = -1;
+  switch(e->type) {
+  case NUMBER:
+    pe.val = e->e.num;
+    break;
+  case STRING_EXPR:
+    pe.val = save_string(r, e->e.str);
+    break;
+  case SYMBOL: {
+    /* local labels were named after the global label before them. store
+       them as written, so they can be renamed wherever they're included */
+    char* colon = strchr(e->e.sym, ':');
+    if(colon) {
+      char* local = strdup(colon);
+      local[0] = '.';
+      pe.val = save_string(r, local);
+      free(local);
+    }
+    else
+      pe.val = save_string(r, e->e.sym);
+    break;
+  }
+  case ADD:
+  case SUB:
+    if(constant(e, &pe.val))
+      pe.type = NUMBER;
+    else {
+      pe.sub[0] = save_expr(r, e->e.subexpr[0]);
+      pe.sub[1] = save_expr(r, e->e.subexpr[1]);
+    }
+    break;
+  }
+  pe.next = save_expr(r, e->next);
+
+  if(r->expr_count == r->expr_capacity) {
+    r->expr_capacity = r->expr_capacity ? r->expr_capacity * 2 : 64;
+    r->exprs = realloc(r->exprs, r->expr_capacity * sizeof(Precomp_expr));
+  }
+  i = r->expr_count++;
+  r->exprs[i] = pe;
+  return i;
+}
+
+/* is the expression just arithmetic on numbers? if so, works it out */
+static int constant(Expr* e, int* val) {
+  int l;
+  int r;
+
+  switch(e->type) {
+  case NUMBER:
+    *val = e->e.num;
+    return 1;
+  case ADD:
+  case SUB:
+    if(!constant(e->e.subexpr[0], &l) || !constant(e->e.subexpr[1], &r))
+      return 0;
+    *val = e->type == ADD ? l + r : l - r;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* adds a string to the records, once. returns its offset */
+static int save_string(Records* r, char* str) {
+  unsigned int hash = hash_str(str);
+  int len = strlen(str) + 1;
+  int i;
+
+  if((r->string_count + 1) * 2 > r->string_buckets) {
+    int* old = r->string_table;
+    int old_buckets = r->string_buckets;
+    int j;
+
+    r->string_buckets = old_buckets ? old_buckets * 2 : STRING_BUCKETS;
+    r->string_table = malloc(r->string_buckets * sizeof(int));
+    memset(r->string_table, -1, r->string_buckets * sizeof(int));
+    for(j = 0; j < old_buckets; j++) {
+      if(old[j] >= 0) {
+        int k = hash_str(r->strings + old[j]) % r->string_buckets;
+        while(r->string_table[k] >= 0)
+          k = (k + 1) % r->string_buckets;
+        r->string_table[k] = old[j];
+      }
+    }
+    free(old);
+  }
+
+  for(i = hash % r->string_buckets; r->string_table[i] >= 0;
+      i = (i + 1) % r->string_buckets)
+    if(strcmp(r->strings + r->string_table[i], str) == 0)
+      return r->string_table[i];
+
+  if(r->strings_size + len > r->strings_capacity) {
+    r->strings_capacity = r->strings_capacity ? r->strings_capacity * 2
+                                              : 1024;
+    while(r->strings_size + len > r->strings_capacity)
+      r->strings_capacity *= 2;
+    r->strings = realloc(r->strings, r->strings_capacity);
+  }
+  memcpy(r->strings + r->strings_size, str, len);
+  r->string_table[i] = r->strings_size;
+  r->string_count++;
+  r->strings_size += len;
+  return r->string_table[i];
+}
+
+static Expr* load_expr(Records* r, int i) {
+  Precomp_expr* pe;
+  Expr* e;
+
+  if(i < 0)
+    return NULL;
+  pe = &r->exprs[i];
+  e = alloc_expr();
+  e->type = pe->type;
+  switch(pe->type) {
+  case NUMBER:
+    e->e.num = pe->val;
+    break;
+  case STRING_EXPR:
+    e->e.str = strdup(r->strings + pe->val);
+    break;
+  case SYMBOL:
+    e->e.sym = intern_symbol(r->strings + pe->val);
+    break;
+  case ADD:
+  case SUB:
+    e->e.subexpr[0] = load_expr(r, pe->sub[0]);
+    e->e.subexpr[1] = load_expr(r, pe->sub[1]);
+    break;
+  }
+  e->next = load_expr(r, pe->next);
+  return e;
+}
+
+/* writes the image to a temporary file and renames it into place, so
+   nobody ever sees half of one */
+static Status write_precompiled(char* filename, Precomp_header* header,
+                                Records* r) {
+  char* path = malloc(strlen(filename) + strlen(PRECOMP_SUFFIX) + 1);
+  char* temp = malloc(strlen(filename) + strlen(PRECOMP_SUFFIX) + 32);
+  FILE* fp;
+  int ok;
+
+  sprintf(path, "%s%s", filename, PRECOMP_SUFFIX);
+  sprintf(temp, "%s.%d", path, (int)getpid());
+  fp = fopen(temp, "wb");
+  if(!fp) {
+    fprintf(stderr, "Error: could not open file %s for writing\n", temp);
+    free(path);
+    free(temp);
+    return ERROR;
+  }
+  ok = fwrite(header, sizeof(Precomp_header), 1, fp) == 1 &&
+       fwrite(r->lines, sizeof(Precomp_line), r->line_count, fp) ==
+       r->line_count &&
+       fwrite(r->exprs, sizeof(Precomp_expr), r->expr_count, fp) ==
+       r->expr_count &&
+       fwrite(r->strings, 1, r->strings_size, fp) == r->strings_size;
+  ok = fclose(fp) == 0 && ok;
+  if(ok)
+    ok = rename(temp, path) == 0;
+  if(!ok) {
+    fprintf(stderr, "Error: writing %s\n", path);
+    unlink(temp);
+  }
+  free(path);
+  free(temp);
+  return ok ? OK : ERROR;
+}
@@ -0,0 +1,57 @@
+#ifndef PRECOMP_H
+#define PRECOMP_H
+
+#include "error.h"
+#include "lines.h"
+
+/* added to a file's name to give its precompiled image's */
+#define PRECOMP_SUFFIX ".snapc"
+
+/* a parsed line, flattened. strings are offsets into the string area and
+   expressions are indices, -1 for none */
+typedef struct {
+  int line_num;
+  int label;
+  int instruction;
+  int addr_mode;
+  int modifier;
+  int expr1;
+  int expr2;
+} Precomp_line;
+
+typedef struct {
+  int type;
+  int val; /* a number, or a string */
+  int sub[2];
+  int next;
+} Precomp_expr;
+
+/* the lines parsed from a file, in a form that can be replayed wherever
+   the file is included */
+typedef struct {
+  Precomp_line* lines;
+  int line_count;
+  int line_capacity;
+  Precomp_expr* exprs;
+  int expr_count;
+  int expr_capacity;
+  char* strings;
+  int strings_size;
+  int strings_capacity;
+
+  /* for finding strings already added */
+  int* string_table;
+  int string_buckets;
+  int string_count;
+} Records;
+
+void init_records(Records* r);
+void free_records(Records* r);
+void record_line(Records* r, Line* line);
+Status replay_records(Records* r);
+
+Status precompile(char* filename);
+int read_precompiled(Source* source, Status* status);
+void* map_file(char* filename, long long* size);
+
+#endif
@@ -0,0 +1,236 @@
+#include "push.h"
+
+#include "error.h"
+#include "image.h"
+#include "labels.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* in watch mode with --push, each rebuild is sent to whatever's listening
+   on a Unix socket - an emulator, say - as the stretches of the ROM that
+   changed and the symbols that did, so it can patch them into the running
+   game. if nothing's listening, it's tried again next build, and whatever
+   connects is sent the whole ROM first. a listener that stops reading is
+   dropped rather than allowed to hold up the rebuilds */
+
+/* matching bytes fewer than this between changes are sent along with them,
+   rather than starting another message */
+#define PUSH_GAP 16
+
+/* how long sending can wait for the listener to read any more */
+#define PUSH_TIMEOUT_MS 250
+
+static char* socket_path = NULL;
+static int sock = -1;
+
+/* a problem with the listener's been reported, and needn't be again until
+   a build's got through */
+static int reported = 0;
+
+/* the symbols as last sent, sorted by name */
+static Symbol_value* pushed = NULL;
+static int pushed_count = 0;
+
+/* the messages for a build, sent all at once */
+static unsigned char* out = NULL;
+static int out_size = 0;
+static int out_capacity = 0;
+
+static int connect_socket();
+static void push_symbols();
+static void begin_message(int type, int size);
+static void put(void* data, int n);
+static void put_u32(unsigned int n);
+static Status send_messages();
+static Status drop_listener(char* message);
+static int compare_names(const void* a, const void* b);
+
+/* sends every build from now on to the socket at path */
+void push_to(char* path) {
+  socket_path = path;
+}
+
+/* sends what's changed between the last build's image and this one's,
+   and the symbols that have changed since last time. does nothing unless
+   pushing */
+Status push_changes(Image* old, Image* new) {
+  Image empty;
+  int common;
+  int i = 0;
+
+  if(!socket_path)
+    return OK;
+  if(sock < 0) {
+    sock = connect_socket();
+    if(sock < 0)
+      return ERROR;
+    init_image(&empty);
+    old = &empty;
+    pushed_count = 0;
+    begin_message(PUSH_HELLO, 4);
+    put_u32(PUSH_VERSION);
+  }
+
+  common = old->size < new->size ? old->size : new->size;
+  while(i < new->size) {
+    int start;
+    int end;
+
+    while(i < common && old->bytes[i] == new->bytes[i]) i++;
+    if(i == new->size)
+      break;
+
+    /* anything past the end of the old image is new */
+    start = end = i;
+    while(i < new->size && i - end < PUSH_GAP) {
+      if(i >= common || old->bytes[i] != new->bytes[i])
+        end = i + 1;
+      i++;
+    }
+    begin_message(PUSH_WRITE, 4 + end - start);
+    put_u32(start);
+    put(new->bytes + start, end - start);
+  }
+
+  push_symbols();
+  begin_message(PUSH_END, 4);
+  put_u32(new->size);
+  return send_messages();
+}
+
+static int connect_socket() {
+  struct sockaddr_un addr;
+  int fd;
+
+  if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+    if(!reported)
+      fprintf(stderr, "Error: socket path %s is too long\n", socket_path);
+    reported = 1;
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+
+  /* it never blocks, so a listener that's stopped accepting (or reading)
+     can't hold up a rebuild. a Unix socket connects at once, or not at
+     all */
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    if(!reported)
+      fprintf(stderr, "Error: could not connect to %s\n", socket_path);
+    reported = 1;
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* compares the symbols now with those sent last time, both sorted by
+   name, sending the new and changed ones and those that have gone */
+static void push_symbols() {
+  Symbol_value* now;
+  int count = list_symbols(&now);
+  int i = 0;
+  int j = 0;
+
+  qsort(now, count, sizeof(Symbol_value), compare_names);
+  while(i < count || j < pushed_count) {
+    int cmp = i == count ? 1 :
+              j == pushed_count ? -1 : strcmp(now[i].name, pushed[j].name);
+
+    if(cmp > 0) {
+      begin_message(PUSH_UNDEFINE, strlen(pushed[j].name));
+      put(pushed[j].name, strlen(pushed[j].name));
+      j++;
+      continue;
+    }
+    if(cmp < 0 || now[i].val != pushed[j].val) {
+      begin_message(PUSH_SYMBOL, 4 + strlen(now[i].name));
+      put_u32(now[i].val);
+      put(now[i].name, strlen(now[i].name));
+    }
+    if(cmp == 0)
+      j++;
+    i++;
+  }
+
+  free(pushed);
+  pushed = now;
+  pushed_count = count;
+}
+
+static void begin_message(int type, int size) {
+  unsigned char t = type;
+  put(&t, 1);
+  put_u32(size);
+}
+
+static void put(void* data, int n) {
+  if(out_size + n > out_capacity) {
+    if(!out_capacity)
+      out_capacity = 0x1000;
+    while(out_size + n > out_capacity)
+      out_capacity *= 2;
+    out = realloc(out, out_capacity);
+  }
+  memcpy(out + out_size, data, n);
+  out_size += n;
+}
+
+static void put_u32(unsigned int n) {
+  unsigned char bytes[4];
+  bytes[0] = n;
+  bytes[1] = n >> 8;
+  bytes[2] = n >> 16;
+  bytes[3] = n >> 24;
+  put(bytes, 4);
+}
+
+/* if the other end's gone away, or has stopped reading, it'll be
+   connected to again next time */
+static Status send_messages() {
+  int sent = 0;
+
+  while(sent < out_size) {
+    struct pollfd p = {sock, POLLOUT, 0};
+    ssize_t n = send(sock, out + sent, out_size - sent, MSG_NOSIGNAL);
+
+    /* wait for the listener to make room, but not for long */
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if(poll(&p, 1, PUSH_TIMEOUT_MS) > 0)
+        continue;
+      return drop_listener("Error: %s stopped reading, dropped it\n");
+    }
+    if(n <= 0)
+      return drop_listener("Error: lost the connection to %s\n");
+    sent += n;
+  }
+  out_size = 0;
+  reported = 0;
+  return OK;
+}
+
+/* closes the connection, reporting why with message unless a problem's
+   already been reported. returns ERROR */
+static Status drop_listener(char* message) {
+  if(!reported)
+    fprintf(stderr, message, socket_path);
+  reported = 1;
+  close(sock);
+  sock = -1;
+  out_size = 0;
+  return ERROR;
+}
+
+static int compare_names(const void* a, const void* b) {
+  return strcmp(((Symbol_value*)a)->name, ((Symbol_value*)b)->name);
+}
@@ -0,0 +1,20 @@
+#ifndef PUSH_H
+#define PUSH_H
+
+#include "error.h"
+#include "image.h"
+
+/* message types. every message is a type byte and a 32-bit payload
+   length, then the payload. numbers are little endian */
+#define PUSH_HELLO 'H' /* protocol version */
+#define PUSH_WRITE 'W' /* offset, then the bytes to write there */
+#define PUSH_SYMBOL 'S' /* value, then the name */
+#define PUSH_UNDEFINE 'U' /* the name of a symbol no longer defined */
+#define PUSH_END 'E' /* the ROM's size. the build's done, apply it */
+
+#define PUSH_VERSION 1
+
+void push_to(char* path);
+Status push_changes(Image* old, Image* new);
+
+#endif
@@ -0,0 +1,103 @@
+#include "rom.h"
+
+#include "error.h"
+
+#include <stdio.h>
+#include <strings.h>
+
+/* LoROM shows each 32K of ROM in the top half of a bank, from $00 (banks
+   $7E and $7F are RAM, so the last 64K only shows up at $FE and $FF).
+   HiROM shows each 64K of ROM whole in banks $C0-$FF, and again in $40-$7D,
+   and the top halves in $00-$3F. either is mirrored from $80 up, where
+   a FastROM cartridge is read faster. ExHiROM is HiROM with 8M: the first
+   4M in banks $C0-$FF (and the top halves in $80-$BF), the rest in
+   $40-$7D (and the top halves in $00-$3F) */
+
+int fast_rom = 0;
+
+Status parse_rom_map(char* name, Rom_map* map) {
+  if(strcasecmp(name, "lorom") == 0)
+    *map = LOROM;
+  else if(strcasecmp(name, "hirom") == 0)
+    *map = HIROM;
+  else if(strcasecmp(name, "exhirom") == 0)
+    *map = EXHIROM;
+  else {
+    fprintf(stderr, "Error: unknown memory map %s (lorom, hirom or "
+                    "exhirom)\n", name);
+    return ERROR;
+  }
+  return OK;
+}
+
+int rom_bank_size(Rom_map map) {
+  return map == LOROM ? 0x8000 : 0x10000;
+}
+
+int rom_max_size(Rom_map map) {
+  return map == EXHIROM ? 0x800000 : 0x400000;
+}
+
+/* the bank the index'th bank of ROM is normally addressed through */
+int rom_home_bank(Rom_map map, int index) {
+  switch(map) {
+  case LOROM:
+    if(fast_rom)
+      return 0x80 + index;
+    return index < 0x7E ? index : 0x80 + index;
+  case HIROM:
+    return 0xC0 + index;
+  case EXHIROM:
+    return index < 0x40 ? 0xC0 + index : index;
+  }
+  return 0;
+}
+
+/* how much ROM shows up in bank, starting at address. 0 if none does */
+int rom_window(Rom_map map, int bank, int* address) {
+  if(map == LOROM) {
+    if(bank == 0x7E || bank == 0x7F)
+      return 0;
+    *address = bank << 16 | 0x8000;
+    return 0x8000;
+  }
+  if((bank & 0x7F) < 0x40) {
+    *address = bank << 16 | 0x8000;
+    return 0x8000;
+  }
+  if(bank == 0x7E || bank == 0x7F)
+    return 0;
+  *address = bank << 16;
+  return 0x10000;
+}
+
+/* where in the ROM an address is, or -1 if it isn't in ROM */
+int rom_offset(Rom_map map, int address) {
+  int bank = address >> 16;
+  int start = 0;
+  int size = rom_window(map, bank, &start);
+
+  if(!size || address < start || address >= start + size)
+    return -1;
+  switch(map) {
+  case LOROM:
+    return (bank & 0x7F) << 15 | (address & 0x7FFF);
+  case HIROM:
+    return (bank & 0x3F) << 16 | (address & 0xFFFF);
+  case EXHIROM:
+    return (bank & 0x80 ? 0 : 0x400000) | (bank & 0x3F) << 16 |
+           (address & 0xFFFF);
+  }
+  return -1;
+}
+
+/* where in the ROM the cartridge header is, at $FFC0 in the first bank
+   the reset vector's read from */
+int rom_header_offset(Rom_map map) {
+  switch(map) {
+  case LOROM: return 0x7FC0;
+  case HIROM: return 0xFFC0;
+  case EXHIROM: return 0x40FFC0;
+  }
+  return 0;
+}
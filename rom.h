@@ -0,0 +1,20 @@
+#ifndef ROM_H
+#define ROM_H
+
+#include "error.h"
+
+/* how a cartridge's ROM shows up in the 65816's address space */
+typedef enum {LOROM, HIROM, EXHIROM} Rom_map;
+
+/* prefer the FastROM mirrors, from bank $80 up, when choosing banks */
+extern int fast_rom;
+
+Status parse_rom_map(char* name, Rom_map* map);
+int rom_bank_size(Rom_map map);
+int rom_max_size(Rom_map map);
+int rom_home_bank(Rom_map map, int index);
+int rom_window(Rom_map map, int bank, int* address);
+int rom_offset(Rom_map map, int address);
+int rom_header_offset(Rom_map map);
+
+#endif
@@ -0,0 +1,69 @@
+#include "sizes.h"
+
+#include "handlers.h"
+#include "instructions.h"
+#include "lines.h"
+#include "rom.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+/* with --sizes, once the program's sizes have settled, how many bytes
+   each global label's code or data takes - up to the next global label
+   or ORG - and how many each bank takes, and has left if map's given */
+
+static void print_run(FILE* fp, char* label, int addr, int size);
+
+void print_sizes(FILE* fp, Rom_map* map) {
+  static int banks[256];
+  char* label = NULL;
+  int start = 0;
+  int size = 0;
+  int run = 0; /* there's a run of lines to print */
+  Line* lp;
+  int i;
+
+  memset(banks, 0, sizeof(banks));
+  for(lp = first_line; lp; lp = lp->next) {
+    int labelled;
+    int origin;
+
+    if(lp->dead)
+      continue;
+    labelled = lp->label && lp->label[0] != '.' &&
+               (!lp->instruction || strcasecmp(lp->instruction, "equ") != 0);
+    origin = lp->instruction && get_handler(lp->instruction) == org;
+    if(labelled || origin) {
+      if(run)
+        print_run(fp, label, start, size);
+      label = labelled ? lp->label : NULL;
+      start = lp->addr;
+      size = 0;
+      run = labelled && !origin;
+    }
+    if(lp->byte_size) {
+      if(!run) {
+        start = lp->addr;
+        run = 1;
+      }
+      size += lp->byte_size;
+      banks[(lp->addr >> 16) & 0xFF] += lp->byte_size;
+    }
+  }
+  if(run)
+    print_run(fp, label, start, size);
+
+  for(i = 0; i < 256; i++) {
+    if(!banks[i])
+      continue;
+    fprintf(fp, "bank $%02X  %8d bytes", i, banks[i]);
+    if(map && rom_offset(*map, i << 16 | 0xFFFF) >= 0)
+      fprintf(fp, ", %d free", rom_bank_size(*map) - banks[i]);
+    fprintf(fp, "\n");
+  }
+}
+
+static void print_run(FILE* fp, char* label, int addr, int size) {
+  fprintf(fp, "$%06X  %8d  %s\n", addr, size, label ? label : "-");
+}
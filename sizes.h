@@ -0,0 +1,10 @@
+#ifndef SIZES_H
+#define SIZES_H
+
+#include "rom.h"
+
+#include <stdio.h>
+
+void print_sizes(FILE* fp, Rom_map* map);
+
+#endif
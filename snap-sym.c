@@ -0,0 +1,379 @@
+#include "linetable.h"
+#include "symindex.h"
+#include "table.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* snap-sym answers questions about a program from the symbol index
+   written by snap --sym-index - what a name's value is, or which symbol an
+   address is in - or from the line table written by --line-table - which
+   line an address came from, or which addresses a line went to. either is
+   mapped in and searched where it lies */
+
+typedef struct {
+  Symindex_header* header;
+  Symindex_symbol* symbols;
+  int* buckets;
+  int* files;
+  char* strings;
+} Index;
+
+typedef struct {
+  Linetable_header* header;
+  int* files;
+  Linetable_block* blocks;
+  Linetable_range* ranges;
+  unsigned char* program;
+  char* strings;
+} Line_table;
+
+/* a decoded row of a line table */
+typedef struct {
+  int addr;
+  int file;
+  int line;
+} Row;
+
+static void* map_whole(char* filename, long long* size);
+static int open_index(void* image, long long size, Index* index);
+static int open_line_table(void* image, long long size, Line_table* t);
+static int query_symbols(Index* index, char* arg);
+static int query_lines(Line_table* t, char* arg);
+static Symindex_symbol* find_name(Index* index, char* name);
+static Symindex_symbol* find_address(Index* index, int addr);
+static int find_file(Line_table* t, char* name);
+static int decode_block(Line_table* t, int block, Row* rows);
+static unsigned int get_unsigned(unsigned char** p);
+static int get_signed(unsigned char** p);
+static int parse_address(char* arg, int* addr);
+static void print_symbol(Index* index, Symindex_symbol* s, int offset);
+static int compare_addrs(const void* a, const void* b);
+
+int usage() {
+  fprintf(stderr, "Usage: snap-sym <index> <name>|<address> ...\n"
+                  "       snap-sym <line-table> <file>:<line>|<address> "
+                  "...\n");
+  return -1;
+}
+
+int main(int argc, char** argv) {
+  Index index;
+  Line_table lines;
+  long long size;
+  void* image;
+  int symbols;
+  int status = 0;
+  int i;
+
+  if(argc < 3)
+    return usage();
+  image = map_whole(argv[1], &size);
+  if(!image)
+    return -1;
+  symbols = size >= 8 && memcmp(image, SYMINDEX_MAGIC, 8) == 0;
+  if(symbols ? !open_index(image, size, &index)
+             : !open_line_table(image, size, &lines)) {
+    fprintf(stderr, "Error: %s isn't a symbol index or line table\n",
+            argv[1]);
+    return -1;
+  }
+
+  for(i = 2; i < argc; i++) {
+    int found = symbols ? query_symbols(&index, argv[i])
+                        : query_lines(&lines, argv[i]);
+    if(!found) {
+      fprintf(stderr, "Error: nothing found for %s\n", argv[i]);
+      status = -1;
+    }
+  }
+  return status;
+}
+
+static void* map_whole(char* filename, long long* size) {
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+  void* image;
+
+  if(fd < 0 || fstat(fd, &st) != 0 || !st.st_size) {
+    fprintf(stderr, "Error: could not read %s\n", filename);
+    if(fd >= 0)
+      close(fd);
+    return NULL;
+  }
+  image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(image == MAP_FAILED) {
+    fprintf(stderr, "Error: could not read %s\n", filename);
+    return NULL;
+  }
+  *size = st.st_size;
+  return image;
+}
+
+static int open_index(void* image, long long size, Index* index) {
+  Symindex_header* h = image;
+
+  if(size < sizeof(Symindex_header) ||
+     memcmp(h->magic, SYMINDEX_MAGIC, sizeof(h->magic)) != 0 ||
+     h->format != SYMINDEX_FORMAT || h->bucket_count <= 0 ||
+     size != sizeof(Symindex_header) +
+             (long long)h->symbol_count * sizeof(Symindex_symbol) +
+             (long long)h->bucket_count * sizeof(int) +
+             (long long)h->file_count * sizeof(int) + h->strings_size)
+    return 0;
+
+  index->header = h;
+  index->symbols = (Symindex_symbol*)(h + 1);
+  index->buckets = (int*)(index->symbols + h->symbol_count);
+  index->files = index->buckets + h->bucket_count;
+  index->strings = (char*)(index->files + h->file_count);
+  return 1;
+}
+
+static int open_line_table(void* image, long long size, Line_table* t) {
+  Linetable_header* h = image;
+
+  if(size < sizeof(Linetable_header) ||
+     memcmp(h->magic, LINETABLE_MAGIC, sizeof(h->magic)) != 0 ||
+     h->format != LINETABLE_FORMAT ||
+     size != sizeof(Linetable_header) +
+             (long long)h->file_count * sizeof(int) +
+             (long long)h->block_count * sizeof(Linetable_block) +
+             (long long)h->range_count * sizeof(Linetable_range) +
+             h->program_size + h->strings_size)
+    return 0;
+
+  t->header = h;
+  t->files = (int*)(h + 1);
+  t->blocks = (Linetable_block*)(t->files + h->file_count);
+  t->ranges = (Linetable_range*)(t->blocks + h->block_count);
+  t->program = (unsigned char*)(t->ranges + h->range_count);
+  t->strings = (char*)(t->program + h->program_size);
+  return 1;
+}
+
+/* prints the value of a name, or the symbol an address is in */
+static int query_symbols(Index* index, char* arg) {
+  Symindex_symbol* s = NULL;
+  int addr;
+
+  if(parse_address(arg, &addr)) {
+    s = find_address(index, addr);
+    if(s) {
+      printf("$%06X: ", addr);
+      print_symbol(index, s, addr - s->val);
+    }
+  }
+  else if((s = find_name(index, arg)))
+    print_symbol(index, s, 0);
+  return s != NULL;
+}
+
+/* prints the line an address came from, or the addresses a file:line
+   went to */
+static int query_lines(Line_table* t, char* arg) {
+  Row rows[LINETABLE_BLOCK];
+  int* addrs = NULL;
+  int addr_count = 0;
+  char* colon;
+  int file;
+  int line;
+  int lo;
+  int hi;
+  int addr;
+  int i;
+
+  if(parse_address(arg, &addr)) {
+    /* the last block starting at or before addr, then its last row that
+       does */
+    lo = 0;
+    hi = t->header->block_count;
+    while(lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if(t->blocks[mid].addr <= addr)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if(!lo)
+      return 0;
+    hi = decode_block(t, lo - 1, rows);
+    for(i = 0; i + 1 < hi && rows[i + 1].addr <= addr; i++);
+    printf("$%06X: %s:%d\n", addr, t->strings + t->files[rows[i].file],
+           rows[i].line);
+    return 1;
+  }
+
+  colon = strrchr(arg, ':');
+  if(!colon || colon == arg)
+    return 0;
+  *colon = '\0';
+  file = find_file(t, arg);
+  *colon = ':';
+  line = strtol(colon + 1, &colon, 10);
+  if(file < 0 || *colon)
+    return 0;
+
+  /* the last range starting at or before the line, then back from there
+     for as long as one might still take it in */
+  lo = 0;
+  hi = t->header->range_count;
+  while(lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    Linetable_range* r = &t->ranges[mid];
+    if(r->file < file || (r->file == file && r->first_line <= line))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for(lo--; lo >= 0; lo--) {
+    Linetable_range* r = &t->ranges[lo];
+    if(r->file != file || r->reach < line)
+      break;
+    if(r->last_line < line)
+      continue;
+    hi = decode_block(t, r->block, rows);
+    for(i = 0; i < hi; i++)
+      if(rows[i].file == file && rows[i].line == line) {
+        addrs = realloc(addrs, (addr_count + 1) * sizeof(int));
+        addrs[addr_count++] = rows[i].addr;
+      }
+  }
+
+  qsort(addrs, addr_count, sizeof(int), compare_addrs);
+  for(i = 0; i < addr_count; i++)
+    if(!i || addrs[i] != addrs[i - 1])
+      printf("%s: $%06X\n", arg, addrs[i]);
+  free(addrs);
+  return addr_count > 0;
+}
+
+static Symindex_symbol* find_name(Index* index, char* name) {
+  unsigned int hash = hash_str(name);
+  int mask = index->header->bucket_count - 1;
+  int b;
+
+  for(b = hash & mask; index->buckets[b] >= 0; b = (b + 1) & mask) {
+    Symindex_symbol* s = &index->symbols[index->buckets[b]];
+    if(s->hash == hash && strcmp(index->strings + s->name, name) == 0)
+      return s;
+  }
+  return NULL;
+}
+
+/* the first of the symbols with the greatest value at or below addr */
+static Symindex_symbol* find_address(Index* index, int addr) {
+  int lo = 0;
+  int hi = index->header->symbol_count;
+
+  while(lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if(index->symbols[mid].val <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if(!lo)
+    return NULL;
+  for(lo--; lo > 0 && index->symbols[lo - 1].val == index->symbols[lo].val;
+      lo--);
+  return &index->symbols[lo];
+}
+
+/* the number of the file with the given name, or that ends with it as a
+   path, or -1 */
+static int find_file(Line_table* t, char* name) {
+  int len = strlen(name);
+  int i;
+
+  for(i = 0; i < t->header->file_count; i++)
+    if(strcmp(t->strings + t->files[i], name) == 0)
+      return i;
+  for(i = 0; i < t->header->file_count; i++) {
+    char* f = t->strings + t->files[i];
+    int flen = strlen(f);
+    if(flen > len && f[flen - len - 1] == '/' &&
+       strcmp(f + flen - len, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/* decodes a block's rows into rows, returning how many there are */
+static int decode_block(Line_table* t, int block, Row* rows) {
+  Linetable_block* b = &t->blocks[block];
+  unsigned char* p = t->program + b->program;
+  int count = t->header->row_count - block * LINETABLE_BLOCK;
+  int i;
+
+  if(count > LINETABLE_BLOCK)
+    count = LINETABLE_BLOCK;
+  rows[0].addr = b->addr;
+  rows[0].file = b->file;
+  rows[0].line = b->line;
+  for(i = 1; i < count; i++) {
+    unsigned int step = get_unsigned(&p);
+    rows[i].addr = rows[i - 1].addr + (step >> 1);
+    rows[i].file = step & 1 ? (int)get_unsigned(&p) : rows[i - 1].file;
+    rows[i].line = rows[i - 1].line + get_signed(&p);
+  }
+  return count;
+}
+
+static unsigned int get_unsigned(unsigned char** p) {
+  unsigned int n = 0;
+  int shift = 0;
+
+  while(**p & 0x80) {
+    n |= (unsigned int)(*(*p)++ & 0x7F) << shift;
+    shift += 7;
+  }
+  return n | (unsigned int)*(*p)++ << shift;
+}
+
+static int get_signed(unsigned char** p) {
+  int n = 0;
+  int shift = 0;
+  int byte;
+
+  do {
+    byte = *(*p)++;
+    n |= (byte & 0x7F) << shift;
+    shift += 7;
+  } while(byte & 0x80);
+  if(shift < 32 && (byte & 0x40))
+    n |= (int)(~0U << shift);
+  return n;
+}
+
+/* $hex, 0xhex or decimal */
+static int parse_address(char* arg, int* addr) {
+  char* digits = arg[0] == '$' ? arg + 1 : arg;
+  char* end;
+
+  if(digits == arg && (arg[0] < '0' || arg[0] > '9'))
+    return 0;
+  *addr = strtol(digits, &end, digits == arg ? 0 : 16);
+  return end != digits && !*end;
+}
+
+static void print_symbol(Index* index, Symindex_symbol* s, int offset) {
+  printf("%s", index->strings + s->name);
+  if(offset)
+    printf("+$%X", offset);
+  else
+    printf(" = $%X", s->val);
+  if(s->file >= 0)
+    printf(" (%s:%d)", index->strings + index->files[s->file], s->line_num);
+  printf("\n");
+}
+
+static int compare_addrs(const void* a, const void* b) {
+  return *(int*)a - *(int*)b;
+}
@@ -1,19 +1,74 @@
 #include "snap.h"
 
+#include "batch.h"
+#include "cache.h"
+#include "checksum.h"
+#include "dedup.h"
 #include "error.h"
+#include "files.h"
+#include "gc.h"
+#include "hash.h"
+#include "hints.h"
+#include "image.h"
 #include "instructions.h"
 #include "labels.h"
 #include "lines.h"
+#include "linetable.h"
+#include "listing.h"
+#include "lsp.h"
+#include "object.h"
 #include "parse.h"
+#include "patch.h"
+#include "push.h"
+#include "precomp.h"
+#include "rom.h"
+#include "sizes.h"
+#include "symexport.h"
+#include "symindex.h"
+#include "timing.h"
+#include "watch.h"
 
+#include <ctype.h>
+#include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 int usage() {
-  fprintf(stderr, "Usage: snap [-s <sym-file>] <in-file> <out-file>\n");
+  fprintf(stderr, "Usage: snap [-D <name>=<value>] [-s <sym-file>] [-w] [-c] "
+                  "[--include-stats]\n"
+                  "            [--cache-dir <dir>] [--hints] "
+                  "[-MD] [-MP] [-MF <dep-file>]\n"
+                  "            [--gc [--keep <label> ...]] [--dedup] "
+                  "[-ferror-limit=<n>]\n"
+                  "            [--time-report] [--trace=<trace-file>]\n"
+                  "            [--map lorom|hirom|exhirom [--fill <byte>] "
+                  "[--checksum]]\n"
+                  "            [--ips <reference> | --bps <reference>] "
+                  "[--push <socket>]\n"
+                  "            [--sym-fd <fd>] [--sym-index <index-file>] "
+                  "[--sym-bsnes <file>]\n"
+                  "            [--sym-mesen <file>] [--sym-nocash <file>] "
+                  "[--line-table <file>]\n"
+                  "            [-l <listing> [--list-range <start>-<end>] "
+                  "[--list-file <file>]]\n"
+                  "            <in-file> <out-file>\n"
+                  "       snap [-j <jobs>] -m <manifest>\n"
+                  "       snap [-j <jobs>] <in-file> <out-file> "
+                  "[<in-file> <out-file> ...]\n"
+                  "       snap [-j <jobs>] -V <out-file>:<name>=<value>,... "
+                  "[-V ...] <in-file>\n"
+                  "       snap --check|--sizes [-D <name>=<value>] [-c] "
+                  "[--gc ...] [--map ...]\n"
+                  "            <in-file>\n"
+                  "       snap --lsp <in-file>\n"
+                  "       snap --precompile <in-file> [<in-file> ...]\n");
   return -1;
 }
 
@@ -25,184 +80,1492 @@ char* current_filename = NULL;
 int index16 = 0;
 int line_num = 0;
 int missing_labels = 0;
+Line* current_line = NULL;
 int pass = 0;
+int pass_serial = 0;
+int line_serial = 0; /* counts the lines assembled */
 int pc = 0;
+int current_section = 0;
+int section_count = 0;
 int d = 0;
 int dbr = 0;
 
+/* if set, gets the first chance to open each file read in, so that it can
+   come from somewhere other than the disk */
+Source_opener source_opener = NULL;
+
+/* lines whose operands weren't known in the first pass, which are the
+   ones hints are kept for. if any had no hint, the sizes are found out
+   the long way instead. if they all held, the hints needn't be saved
+   again */
+static Line** guessed = NULL;
+static int guessed_count = 0;
+static int guessed_capacity = 0;
+static int unhinted = 0;
+static int hints_held = 0;
+
+/* while reassembling in place, the lines whose operands weren't all known,
+   to look at again once every symbol's been seen. the program can be
+   reassembled in place as long as the last assembly went without errors.
+   lines only note what that needs once reassemble()'s been used */
+static int reassembling = 0;
+static Line** unresolved = NULL;
+static int unresolved_count = 0;
+static int unresolved_capacity = 0;
+static int relaxable = 0;
+static int tracking = 0;
+
+/* current_label as interned, which outlives the line it's from, see
+   Line.scope. no_label is the one in effect before the first */
+static char no_label[] = "";
+static char* current_scope = no_label;
+
+/* batch mode */
+static Job* jobs = NULL;
+static int job_count = 0;
+
+/* record every file read, not just those read a second time */
+static int recording = 0;
+
+/* a batch's shared files are only preloaded if every worker has at least
+   this many jobs, as replaying them saves just part of a parse a job */
+#define PRELOAD_JOBS 6
+
+/* command line overrides, and the variants built from a single parse */
+static Define* defines = NULL;
+static int define_count = 0;
+static Variant* variants = NULL;
+static int variant_count = 0;
+
+/* report how each file was included after building */
+static int include_stats = 0;
+
+/* where finished builds are kept, to be reused if nothing's changed */
+static char* cache_dir = NULL;
+
+/* start from the sizes lines settled on last build */
+static int use_hints = 0;
+
+/* where to stream the symbol dump to, if not to a named file */
+static int sym_fd = -1;
+
+/* where to write the symbols in binary, for tools to map in */
+static char* sym_index = NULL;
+
+/* where to write the symbols for each debugger, NULL if not wanted */
+static char* sym_exports[SYMBOL_FORMATS];
+static int exporting = 0;
+
+/* where to write which line each address came from, for debuggers */
+static char* line_table = NULL;
+
+/* where to write a listing, and which lines to put in it */
+static char* listing = NULL;
+static Listing_filter listing_filter = {0, 0xFFFFFF, NULL};
+
+/* a main file of "-" is read from stdin, into memory */
+static char* stdin_text = NULL;
+static size_t stdin_len = 0;
+static int stdin_read = 0;
+
+/* leave out whatever can't be reached from the roots */
+static int gc = 0;
+static char** keeps = NULL;
+static int keep_count = 0;
+
+/* lay the output out as a ROM of this memory map, rather than in order */
+static int rom_mapped = 0;
+static Rom_map rom_map;
+static int fill = -1;
+
+/* fill in the cartridge header's checksum */
+static int checksum = 0;
+
+/* write a patch against this ROM, rather than the ROM itself */
+static char* patch_reference = NULL;
+static Patch_format patch_format;
+
+/* point copies of a block of data at the first, rather than keep them */
+static int dedup = 0;
+
+/* with --sizes, print how big everything is rather than writing it */
+static int sizing = 0;
+
+/* write a makefile rule listing the files each output was built from */
+static int write_deps = 0;
+static int phony_deps = 0;
+static char* dep_file = NULL;
+
 /* prototypes */
-Status assemble();
-void write_assembled(FILE* fp);
+static Status assemble_pass();
+static Status assemble_line(Line* lp);
+static void unresolved_line(Line* lp);
+static Status relax_changes(Line** starts, int start_count);
+static void drop_error(char* filename, int line, char* message);
+static void preload(char* in_file);
+static Status relax_from(Line* lp);
+static Status relax_readers(Line** lines, int count);
+static Status reassemble_stale_lines(int* settled);
+static void hint_size(Line* lp);
+static Status check_hinted_lines(int* settled);
+Status build(char* in_file, char* out_file, char* sym_file);
+static Status emit(char* out_file, char* sym_file);
+static Status check(char* in_file);
+static Status assemble_until_settled();
+static Status output_program(char* out_file);
+static Status output_listing();
+static Status output_symbols(char* sym_file);
+static Status output_line_table();
+static unsigned long long build_options(char* sym_file);
+static void apply_defines(Define* list, int count);
+static Status run_job(int job);
+static Status run_variant(int variant);
+static Status emit_deps(char* in_file, char* out_file, char** names,
+                        int count);
+static FILE* open_output(char* filename, char* mode);
+static Status close_output(FILE* fp);
+static FILE* open_stdin();
+static void keep_text(Source* source, FILE** fp);
+static char* read_stream(FILE* fp, size_t* len);
+static FILE* open_text(char* text, size_t len);
+static Status parse_fill(char* arg, int* byte);
+static Status parse_range(char* arg, Listing_filter* filter);
+static Status parse_error_limit(char* arg);
+
+static struct option long_options[] = {
+  {"bps", required_argument, NULL, 'B'},
+  {"cache-dir", required_argument, NULL, 'C'},
+  {"dedup", no_argument, NULL, 'U'},
+  {"check", no_argument, NULL, 'Q'},
+  {"checksum", no_argument, NULL, 'k'},
+  {"define", required_argument, NULL, 'D'},
+  {"fill", required_argument, NULL, 'F'},
+  {"gc", no_argument, NULL, 'G'},
+  {"hints", no_argument, NULL, 'H'},
+  {"include-stats", no_argument, NULL, 'I'},
+  {"ips", required_argument, NULL, 'i'},
+  {"jobs", required_argument, NULL, 'j'},
+  {"keep", required_argument, NULL, 'K'},
+  {"lsp", no_argument, NULL, 'L'},
+  {"line-table", required_argument, NULL, 'T'},
+  {"list-file", required_argument, NULL, 'y'},
+  {"list-range", required_argument, NULL, 'a'},
+  {"manifest", required_argument, NULL, 'm'},
+  {"map", required_argument, NULL, 'R'},
+  {"precompile", no_argument, NULL, 'P'},
+  {"push", required_argument, NULL, 'p'},
+  {"sizes", no_argument, NULL, 'Z'},
+  {"sym-bsnes", required_argument, NULL, 'b'},
+  {"sym-fd", required_argument, NULL, 'S'},
+  {"sym-mesen", required_argument, NULL, 'e'},
+  {"sym-nocash", required_argument, NULL, 'n'},
+  {"sym-index", required_argument, NULL, 'X'},
+  {"time-report", no_argument, NULL, 'O'},
+  {"trace", required_argument, NULL, 'W'},
+  {"variant", required_argument, NULL, 'V'},
+  {"watch", no_argument, NULL, 'w'},
+  {NULL, 0, NULL, 0}
+};
 
 int main(int argc, char** argv) {
-  FILE* fp;
-  char* in_file;
-  char* out_file;
-  char* sym_file;
+  char* sym_file = NULL;
+  char* manifest = NULL;
+  int workers = 1;
+  int watching = 0;
+  int serving = 0;
+  int precompiling = 0;
+  int checking = 0;
+  int time_report = 0;
+  char* trace_file = NULL;
+  char* push_path = NULL;
+  Status status;
+  char** names;
   int ch;
+  int i;
 
-  while((ch = getopt(argc, argv, "s:")) != -1) {
+  while((ch = getopt_long(argc, argv, "cD:f:j:l:M:m:s:V:w", long_options,
+                          NULL)) != -1) {
     switch(ch) {
+    case 'D':
+      defines = realloc(defines, (define_count + 1) * sizeof(Define));
+      if(parse_define(optarg, &defines[define_count++]) != OK)
+        return -1;
+      break;
+    case 'V':
+      variants = realloc(variants, (variant_count + 1) * sizeof(Variant));
+      if(parse_variant(optarg, &variants[variant_count++]) != OK)
+        return -1;
+      break;
+    case 'M':
+      /* -MD, -MP and -MF <dep-file>, as a C compiler takes them */
+      if(strcmp(optarg, "D") == 0)
+        write_deps = 1;
+      else if(strcmp(optarg, "P") == 0)
+        phony_deps = 1;
+      else if(optarg[0] == 'F' && (optarg[1] || optind < argc)) {
+        dep_file = optarg[1] ? optarg + 1 : argv[optind++];
+        write_deps = 1;
+      }
+      else
+        return usage();
+      break;
+    case 'B':
+    case 'i':
+      if(patch_reference)
+        return usage();
+      patch_reference = optarg;
+      patch_format = ch == 'i' ? IPS : BPS;
+      break;
+    case 'c': relocating = 1; break;
+    case 'f':
+      if(parse_error_limit(optarg) != OK)
+        return usage();
+      break;
+    case 'j': workers = atoi(optarg); break;
+    case 'k': checksum = 1; break;
+    case 'Q': checking = 1; break;
+    case 'O': time_report = 1; break;
+    case 'W': trace_file = optarg; break;
+    case 'Z': checking = sizing = 1; break;
+    case 'm': manifest = optarg; break;
     case 's': sym_file = optarg; break;
+    case 'S': sym_fd = atoi(optarg); break;
+    case 'X': sym_index = optarg; break;
+    case 'T': line_table = optarg; break;
+    case 'l': listing = optarg; break;
+    case 'y': listing_filter.file = optarg; break;
+    case 'a':
+      if(parse_range(optarg, &listing_filter) != OK)
+        return -1;
+      break;
+    case 'b': sym_exports[BSNES_SYMBOLS] = optarg; exporting = 1; break;
+    case 'e': sym_exports[MESEN_SYMBOLS] = optarg; exporting = 1; break;
+    case 'n': sym_exports[NOCASH_SYMBOLS] = optarg; exporting = 1; break;
+    case 'w': watching = 1; break;
+    case 'C': cache_dir = optarg; break;
+    case 'F':
+      if(parse_fill(optarg, &fill) != OK)
+        return -1;
+      break;
+    case 'G': gc = 1; break;
+    case 'K':
+      keeps = realloc(keeps, (keep_count + 1) * sizeof(char*));
+      keeps[keep_count++] = optarg;
+      break;
+    case 'H': use_hints = 1; break;
+    case 'I': include_stats = 1; break;
+    case 'L': serving = 1; break;
+    case 'P': precompiling = 1; break;
+    case 'p': push_path = optarg; break;
+    case 'R':
+      if(parse_rom_map(optarg, &rom_map) != OK)
+        return -1;
+      rom_mapped = 1;
+      break;
+    case 'U': dedup = 1; break;
     default: return usage();
     }
   }
 
-  if(argc - optind != 2)
+  if((keep_count && !gc) || ((fill >= 0 || checksum) && !rom_mapped) ||
+     (push_path && !watching) ||
+     ((listing_filter.file || listing_filter.end != 0xFFFFFF ||
+       listing_filter.start) && !listing))
     return usage();
+  if(rom_mapped && relocating) {
+    fprintf(stderr, "Error: object files are laid out by snaplink -m, "
+                    "not --map\n");
+    return -1;
+  }
+  if((gc || dedup) && relocating) {
+    fprintf(stderr, "Error: --gc and --dedup can't be used with -c, since "
+                    "the whole program isn't known until link time\n");
+    return -1;
+  }
+  if(sym_exports[MESEN_SYMBOLS] && !rom_mapped) {
+    fprintf(stderr, "Error: --sym-mesen needs --map, to know where in the "
+                    "ROM labels are\n");
+    return -1;
+  }
+  if(patch_reference && relocating) {
+    fprintf(stderr, "Error: --ips and --bps patch a ROM, so can't be used "
+                    "with -c\n");
+    return -1;
+  }
+  if(line_table && relocating) {
+    fprintf(stderr, "Error: --line-table needs final addresses, so can't be "
+                    "used with -c\n");
+    return -1;
+  }
 
-  in_file = argv[optind];
-  out_file = argv[optind+1];
-
-  /* initialization */
+  /* initialization shared by every job */
   init_instructions();
-  init_symtable();
 
-  if(load_file(in_file) != OK)
+  /* precompile mode: parse include files ahead of time */
+  if(precompiling) {
+    Status status = OK;
+    if(manifest || variant_count || watching || serving || time_report ||
+       trace_file || argc == optind)
+      return usage();
+    init_symtable();
+    for(i = optind; i < argc; i++)
+      if(precompile(argv[i]) != OK)
+        status = ERROR;
+    return status == OK ? 0 : -1;
+  }
+
+  /* language server mode: keep the project loaded for an editor */
+  if(serving) {
+    if(manifest || variant_count || watching || relocating || time_report ||
+       trace_file || argc - optind != 1)
+      return usage();
+    init_symtable();
+    apply_defines(defines, define_count);
+    return serve_lsp(argv[optind]) == OK ? 0 : -1;
+  }
+
+  /* check mode: assemble, but write nothing, not even reading what's
+     INCBIN'd */
+  if(checking) {
+    if(manifest || variant_count || watching || sym_file || sym_fd >= 0 ||
+       dedup || patch_reference || sym_index || exporting || line_table ||
+       listing || write_deps || cache_dir || use_hints ||
+       (sizing && relocating) || argc - optind != 1)
+      return usage();
+    if(time_report || trace_file)
+      start_timing();
+    status = check(argv[optind]);
+    if(timing && finish_timing(time_report ? stderr : NULL, trace_file) != OK)
+      status = ERROR;
+    return status == OK ? 0 : -1;
+  }
+
+  /* watch mode: build, then rebuild whenever the sources change */
+  if(watching) {
+    if(manifest || variant_count || sym_fd >= 0 || relocating || gc ||
+       dedup || patch_reference || sym_index || exporting || line_table ||
+       listing || time_report || trace_file || argc - optind != 2 ||
+       strcmp(argv[optind], "-") == 0 || strcmp(argv[optind+1], "-") == 0)
+      return usage();
+    init_symtable();
+    apply_defines(defines, define_count);
+    load_file(argv[optind]);
+    if(push_path)
+      push_to(push_path);
+    return watch(argv[optind+1], sym_file) == OK ? 0 : -1;
+  }
+
+  /* variant mode: parse once, then assemble each variant in its own worker
+     against its own copy of the symbol table */
+  if(variant_count) {
+    if(manifest || sym_file || sym_fd >= 0 || sym_index || exporting ||
+       line_table || listing || time_report || trace_file || dep_file ||
+       argc - optind != 1)
+      return usage();
+    init_symtable();
+    apply_defines(defines, define_count);
+    if(load_file(argv[optind]) != OK)
+      return -1;
+
+    names = malloc(variant_count * sizeof(char*));
+    for(i = 0; i < variant_count; i++)
+      names[i] = variants[i].out_file;
+    return run_jobs(variant_count, workers, run_variant, names) == OK ? 0 : -1;
+  }
+
+  /* the usual case: one input, one output */
+  if(!manifest && argc - optind == 2) {
+    if(sym_file && strcmp(sym_file, "-") == 0 &&
+       strcmp(argv[optind+1], "-") == 0) {
+      fprintf(stderr, "Error: the output and symbol file can't both go to "
+                      "stdout\n");
+      return -1;
+    }
+    if(listing && strcmp(listing, "-") == 0 &&
+       ((sym_file && strcmp(sym_file, "-") == 0) ||
+        strcmp(argv[optind+1], "-") == 0)) {
+      fprintf(stderr, "Error: the listing can't go to stdout along with the "
+                      "output or symbol file\n");
+      return -1;
+    }
+    if(time_report || trace_file)
+      start_timing();
+    status = build(argv[optind], argv[optind+1], sym_file);
+    if(timing && finish_timing(time_report ? stderr : NULL, trace_file) != OK)
+      status = ERROR;
+    return status == OK ? 0 : -1;
+  }
+
+  /* batch mode: either a manifest or a list of in/out pairs */
+  if(manifest) {
+    if(argc != optind)
+      return usage();
+    if(read_manifest(manifest, &jobs, &job_count) != OK)
+      return -1;
+  }
+  else {
+    if(argc - optind < 2 || (argc - optind) % 2)
+      return usage();
+    job_count = (argc - optind) / 2;
+    jobs = malloc(job_count * sizeof(Job));
+    for(i = 0; i < job_count; i++) {
+      jobs[i].in_file = argv[optind + 2*i];
+      jobs[i].out_file = argv[optind + 2*i + 1];
+      jobs[i].sym_file = NULL;
+    }
+  }
+  if(sym_file) {
+    fprintf(stderr, "Error: use a manifest to give symbol files in batch "
+                    "mode\n");
+    return -1;
+  }
+  if(dep_file) {
+    fprintf(stderr, "Error: use -MD to give each output its own dependency "
+                    "file in batch mode\n");
     return -1;
+  }
+  if(sym_fd >= 0) {
+    fprintf(stderr, "Error: symbols can't be streamed in batch mode\n");
+    return -1;
+  }
+  if(time_report || trace_file) {
+    fprintf(stderr, "Error: --time-report and --trace time a single build, "
+                    "not batch mode\n");
+    return -1;
+  }
+  if(sym_index || exporting || line_table || listing) {
+    fprintf(stderr, "Error: --sym-index, --line-table, -l and the debugger "
+                    "symbol files are for a single build, not batch mode\n");
+    return -1;
+  }
+
+  /* stdin has to be read before the workers are forked, so they all see
+     it */
+  names = malloc(job_count * sizeof(char*));
+  for(i = 0; i < job_count; i++) {
+    names[i] = jobs[i].in_file;
+    if(strcmp(jobs[i].in_file, "-") == 0 && !stdin_read) {
+      FILE* fp = open_stdin();
+      if(!fp) {
+        fprintf(stderr, "Error: reading from stdin\n");
+        return -1;
+      }
+      fclose(fp);
+    }
+  }
+
+  if(job_count > 1 && job_count >= PRELOAD_JOBS * workers)
+    preload(jobs[0].in_file);
+  return run_jobs(job_count, workers, run_job, names) == OK ? 0 : -1;
+}
+
+/* parses in_file and whatever it includes, recording each file, then
+   throws the program away. the workers are forked afterwards, so every
+   job inherits the records and replays any of those files it includes
+   rather than parsing it again. the jobs of a batch are usually parts of
+   one project, so what the first includes is what they have in common.
+   errors are left for the job itself to report */
+static void preload(char* in_file) {
+  Error_handler backup_handler = error_handler;
+  Source* s;
+
+  init_symtable();
+  error_handler = drop_error;
+  recording = 1;
+  load_file(in_file);
+  recording = 0;
+  error_handler = backup_handler;
+  reset_errors();
+
+  while(first_line) {
+    Line* next = first_line->next;
+    free_line(first_line);
+    first_line = next;
+  }
+  last_line = NULL;
+  while((s = first_source))
+    remove_source(s);
+  current_label = "";
+  current_label_len = 0;
+  reset_include_stats();
+
+  /* hand back what the program took, or the workers would be copying the
+     pages it was in as they reuse them */
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+}
+
+/* assembles in_file into out_file, optionally dumping the symbol table to
+   sym_file */
+Status build(char* in_file, char* out_file, char* sym_file) {
+  char* cache = cache_dir;
+  unsigned long long options = 0;
+  char* hints_file = NULL;
+  Status status;
+
+  /* streams can't be hashed or copied, so aren't cached */
+  if(strcmp(in_file, "-") == 0 || strcmp(out_file, "-") == 0 ||
+     (sym_file && strcmp(sym_file, "-") == 0) || sym_fd >= 0)
+    cache = NULL;
+
+  /* nor are patches, which depend on the reference ROM too, or symbol
+     indexes, line tables, listings and debugger symbol files, which the
+     cache doesn't keep */
+  if(patch_reference || sym_index || exporting || line_table || listing)
+    cache = NULL;
+
+  if(cache) {
+    char** names;
+    int count;
+
+    options = build_options(sym_file);
+    if(cache_fetch(cache, in_file, options, out_file, sym_file,
+                   write_deps ? &names : NULL, &count)) {
+      status = OK;
+      if(write_deps) {
+        status = emit_deps(in_file, out_file, names, count);
+        while(count--)
+          free(names[count]);
+        free(names);
+      }
+      return status;
+    }
+  }
+
+  reset_errors();
+  init_symtable();
+  apply_defines(defines, define_count);
+
+  status = load_file(in_file);
+  if(include_stats)
+    print_include_stats(stderr);
+  if(status != OK)
+    return ERROR;
+
+  if(use_hints) {
+    hints_file = malloc(strlen(out_file) + strlen(HINTS_SUFFIX) + 1);
+    sprintf(hints_file, "%s%s", out_file, HINTS_SUFFIX);
+    load_hints(hints_file);
+  }
+
+  status = emit(out_file, sym_file);
+  if(status == OK && use_hints && !hints_held)
+    status = save_hints(hints_file, guessed, guessed_count);
+  if(use_hints) {
+    free_hints();
+    free(hints_file);
+  }
+  if(status == OK && write_deps) {
+    int count;
+    char** names = list_dependencies(&count);
+    status = emit_deps(in_file, out_file, names, count);
+    free(names);
+  }
+  if(status == OK && cache)
+    cache_store(cache, in_file, options, out_file, sym_file);
+  return status;
+}
+
+/* assembles in_file until its sizes settle, and stops there, before any
+   of it's encoded for output. with --map, it's also checked that it fits
+   in ROM, and with --sizes, how big each part of it is printed */
+static Status check(char* in_file) {
+  Status status;
+
+  reset_errors();
+  init_symtable();
+  apply_defines(defines, define_count);
+  status = load_file(in_file);
+  if(include_stats)
+    print_include_stats(stderr);
+  if(status != OK || assemble() != OK)
+    return ERROR;
+  if(gc && (collect_garbage(keeps, keep_count, stderr) != OK ||
+            assemble() != OK))
+    return ERROR;
+  if(rom_mapped && place_rom_lines(rom_map) != OK)
+    return ERROR;
+  if(sizing)
+    print_sizes(stdout, rom_mapped ? &rom_map : NULL);
+  return OK;
+}
+
+/* hashes the options that affect what a build produces */
+static unsigned long long build_options(char* sym_file) {
+  Hash_state h;
+  int want_sym = sym_file != NULL;
+  int i;
+
+  hash_init(&h);
+  hash_update(&h, &want_sym, sizeof(want_sym));
+  hash_update(&h, &relocating, sizeof(relocating));
+  hash_update(&h, &gc, sizeof(gc));
+  hash_update(&h, &dedup, sizeof(dedup));
+  hash_update(&h, &rom_mapped, sizeof(rom_mapped));
+  hash_update(&h, &rom_map, sizeof(rom_map));
+  hash_update(&h, &fill, sizeof(fill));
+  hash_update(&h, &checksum, sizeof(checksum));
+  for(i = 0; i < keep_count; i++)
+    hash_update(&h, keeps[i], strlen(keeps[i]) + 1);
+  for(i = 0; i < define_count; i++) {
+    hash_update(&h, defines[i].name, strlen(defines[i].name) + 1);
+    hash_update(&h, &defines[i].val, sizeof(defines[i].val));
+  }
+  return hash_final(&h);
+}
+
+/* assembles the loaded lines and writes them to out_file, optionally
+   dumping the symbol table to sym_file */
+static Status emit(char* out_file, char* sym_file) {
+  Status status;
 
   /* assemble it. each line stores its own assembly code */
   if(assemble() != OK)
-    return -1;
+    return ERROR;
+
+  /* then, with --gc or --dedup, again without the blocks nothing reaches
+     or that are copies of others */
+  if(gc) {
+    if(timing)
+      begin_span("gc", NULL, 0);
+    status = collect_garbage(keeps, keep_count, stderr);
+    if(timing)
+      end_span();
+    if(status != OK)
+      return ERROR;
+  }
+  if(dedup) {
+    if(timing)
+      begin_span("dedup", NULL, 0);
+    status = merge_duplicates(stderr);
+    if(timing)
+      end_span();
+    if(status != OK)
+      return ERROR;
+  }
+  if((gc || dedup) && assemble() != OK)
+    return ERROR;
+
+  /* write the assembled code out, and whatever else was asked for */
+  if(timing)
+    begin_span("output", NULL, 0);
+  status = output_program(out_file);
+  if(timing)
+    end_span();
+  if(status != OK)
+    return ERROR;
+
+  if(listing) {
+    if(timing)
+      begin_span("listing", NULL, 0);
+    status = output_listing();
+    if(timing)
+      end_span();
+    if(status != OK)
+      return ERROR;
+  }
+
+  if(timing)
+    begin_span("symbols", NULL, 0);
+  status = output_symbols(sym_file);
+  if(timing)
+    end_span();
+  if(status != OK)
+    return ERROR;
+
+  if(line_table) {
+    if(timing)
+      begin_span("line table", NULL, 0);
+    status = output_line_table();
+    if(timing)
+      end_span();
+    if(status != OK)
+      return ERROR;
+  }
+
+  return OK;
+}
+
+static Status output_program(char* out_file) {
+  FILE* fp = open_output(out_file, "wb");
+  Status status;
 
-  /* write the assembled code out */
-  fp = fopen(out_file, "wb");
   if(!fp) {
-    fprintf(stderr, "Error: could not open file %s for writing\n", argv[2]);
-    return -1;
+    fprintf(stderr, "Error: could not open file %s for writing\n", out_file);
+    return ERROR;
   }
-  write_assembled(fp);
-  fclose(fp);
+  status = relocating ? write_object(fp) : write_assembled(fp);
+  if(close_output(fp) != OK)
+    status = ERROR;
+  return status;
+}
 
-  if(sym_file) {
-    fp = fopen(sym_file, "w");
+static Status output_listing() {
+  FILE* fp = open_output(listing, "w");
+  Status status;
+
+  if(!fp) {
+    fprintf(stderr, "Error: could not open file %s for writing\n", listing);
+    return ERROR;
+  }
+  status = write_listing(fp, &listing_filter);
+  if(close_output(fp) != OK)
+    status = ERROR;
+  return status;
+}
+
+/* the symbol file, the symbol index and the debuggers' symbol files,
+   whichever were asked for */
+static Status output_symbols(char* sym_file) {
+  FILE* fp;
+  Status status;
+
+  if(sym_file || sym_fd >= 0) {
+    fp = sym_file ? open_output(sym_file, "w") : fdopen(sym_fd, "w");
     if(!fp) {
       fprintf(stderr,
               "Error: could not open file %s for writing symbol info to\n",
-              sym_file);
-      return -1;
+              sym_file ? sym_file : "descriptor");
+      return ERROR;
     }
     dump_symbols(fp);
-    fclose(fp);
+    if(close_output(fp) != OK)
+      return ERROR;
   }
 
-  return 0;
+  if(sym_index) {
+    fp = open_output(sym_index, "wb");
+    if(!fp) {
+      fprintf(stderr, "Error: could not open file %s for writing\n",
+              sym_index);
+      return ERROR;
+    }
+    status = write_symbol_index(fp);
+    if(close_output(fp) != OK || status != OK)
+      return ERROR;
+  }
+
+  if(exporting)
+    return export_symbols(sym_exports, rom_mapped ? &rom_map : NULL);
+  return OK;
 }
 
-Status load_file(char* filename) {
-  FILE* fp;
+static Status output_line_table() {
+  FILE* fp = open_output(line_table, "wb");
   Status status;
 
-   /* open up the infile and load it into a global list of lines */
-  fp = fopen(filename, "r");
   if(!fp) {
-    fprintf(stderr, "Error: could not open file %s for reading\n", filename);
+    fprintf(stderr, "Error: could not open file %s for writing\n",
+            line_table);
     return ERROR;
   }
-  current_filename = filename;
-  status = read_file(fp);
-  fclose(fp);
+  status = write_line_table(fp);
+  if(close_output(fp) != OK)
+    status = ERROR;
   return status;
 }
 
+/* opens a file to write an output to, "-" being stdout */
+static FILE* open_output(char* filename, char* mode) {
+  if(strcmp(filename, "-") == 0)
+    return stdout;
+  return fopen(filename, mode);
+}
+
+static Status close_output(FILE* fp) {
+  int ok = fflush(fp) == 0 && !ferror(fp);
+
+  if(fp != stdout)
+    ok = fclose(fp) == 0 && ok;
+  if(!ok)
+    fprintf(stderr, "Error: writing output\n");
+  return ok ? OK : ERROR;
+}
+
+/* reads all of stdin in, the first time it's asked for, and gives a
+   stream over what was read. it's kept, so it can be read again (and
+   before forking, so every worker can read it) */
+static FILE* open_stdin() {
+  if(!stdin_read) {
+    stdin_text = read_stream(stdin, &stdin_len);
+    if(!stdin_text)
+      return NULL;
+    stdin_read = 1;
+  }
+  return open_text(stdin_text, stdin_len);
+}
+
+/* reads source's text into memory, where the listing can find it, and
+   sets fp to read it from there. if the file can't be read, fp is left
+   NULL for that to be reported as usual */
+static void keep_text(Source* source, FILE** fp) {
+  FILE* in = *fp ? *fp : fopen(source->filename, "r");
+  size_t len;
+
+  *fp = NULL;
+  if(!in)
+    return;
+  free(source->text);
+  source->text = read_stream(in, &len);
+  source->text_size = len;
+  fclose(in);
+  if(source->text)
+    *fp = open_text(source->text, len);
+}
+
+/* reads all of fp into a new buffer, setting len to its length. returns
+   NULL if it can't be read */
+static char* read_stream(FILE* fp, size_t* len) {
+  size_t capacity = 65536;
+  char* text = malloc(capacity);
+  size_t n;
+
+  *len = 0;
+  while((n = fread(text + *len, 1, capacity - *len, fp)) > 0) {
+    *len += n;
+    if(*len == capacity) {
+      capacity *= 2;
+      text = realloc(text, capacity);
+    }
+  }
+  if(ferror(fp)) {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
+/* opens text of length len to be read as a file */
+static FILE* open_text(char* text, size_t len) {
+  /* an empty buffer can't be opened */
+  if(!len)
+    return fopen("/dev/null", "r");
+  return fmemopen(text, len, "r");
+}
+
+/* the byte a ROM's gaps are filled with, in decimal or $hex */
+static Status parse_fill(char* arg, int* byte) {
+  char* end;
+  long val = *arg == '$' ? strtol(arg + 1, &end, 16)
+                         : strtol(arg, &end, 10);
+
+  if(end == arg || (end == arg + 1 && *arg == '$') || *end ||
+     val < 0 || val > 0xFF) {
+    fprintf(stderr, "Error: bad fill byte %s\n", arg);
+    return ERROR;
+  }
+  *byte = val;
+  return OK;
+}
+
+/* the addresses a listing's limited to, as <start>-<end>, each in decimal
+   or $hex */
+static Status parse_range(char* arg, Listing_filter* filter) {
+  char* p = arg;
+  long val[2];
+  int i;
+
+  for(i = 0; i < 2; i++) {
+    char* start = *p == '$' ? p + 1 : p;
+    char* end;
+    val[i] = strtol(start, &end, start == p ? 10 : 16);
+    if(end == start || *start == '-' || val[i] > 0xFFFFFF ||
+       *end != (i ? '\0' : '-'))
+      break;
+    p = end + 1;
+  }
+  if(i < 2 || val[0] > val[1]) {
+    fprintf(stderr, "Error: bad address range %s\n", arg);
+    return ERROR;
+  }
+  filter->start = val[0];
+  filter->end = val[1];
+  return OK;
+}
+
+/* -ferror-limit=<n>, as a C compiler takes it */
+static Status parse_error_limit(char* arg) {
+  char* end;
+
+  if(strncmp(arg, "error-limit=", 12) != 0 || !isdigit(arg[12]))
+    return ERROR;
+  error_limit = strtol(arg + 12, &end, 10);
+  return *end ? ERROR : OK;
+}
+
+static void apply_defines(Define* list, int count) {
+  int i;
+  for(i = 0; i < count; i++)
+    override_symbol(list[i].name, list[i].val);
+}
+
+static Status run_job(int job) {
+  return build(jobs[job].in_file, jobs[job].out_file, jobs[job].sym_file);
+}
+
+static Status run_variant(int variant) {
+  char* out_file = variants[variant].out_file;
+  Status status;
+
+  apply_defines(variants[variant].defines, variants[variant].define_count);
+  status = emit(out_file, NULL);
+  if(status == OK && write_deps) {
+    int count;
+    char** names = list_dependencies(&count);
+    status = emit_deps(first_source->filename, out_file, names, count);
+    free(names);
+  }
+  return status;
+}
+
+/* writes out_file's dependency file, named by -MF or after out_file */
+static Status emit_deps(char* in_file, char* out_file, char** names,
+                        int count) {
+  char* filename = dep_file;
+  Status status;
+
+  if(!filename) {
+    filename = malloc(strlen(out_file) + 3);
+    sprintf(filename, "%s.d", out_file);
+  }
+  status = write_depfile(filename, out_file, in_file, names, count,
+                         phony_deps);
+  if(filename != dep_file)
+    free(filename);
+  return status;
+}
+
+Status load_file(char* filename) {
+  Source* source;
+  Status status;
+
+  /* when reloading, files that haven't changed needn't be read again */
+  if(reuse_source(filename))
+    return OK;
+  source = add_source(filename, current_label);
+  if(!timing)
+    return load_source(source);
+  begin_span("parse", source->filename, 0);
+  status = load_source(source);
+  end_span();
+  return status;
+}
+
+/* opens up a file and loads it into the global list of lines */
+Status load_source(Source* source) {
+  FILE* fp = NULL;
+  File* file;
+  Source* backup_source;
+  Status status;
+
+  backup_source = current_source;
+  current_source = source;
+  current_filename = source->filename;
+
+  if(source_opener)
+    fp = source_opener(source);
+  if(!fp && strcmp(source->filename, "-") == 0)
+    fp = open_stdin();
+  file = source->file = find_file(source->filename);
+
+  /* a listing shows each line as it was read, so the text's kept and
+     parsed from there */
+  if(listing)
+    keep_text(source, &fp);
+
+  /* a file that's been read before and hasn't changed since is replayed
+     from what was recorded then */
+  if(!fp && file && file->cached) {
+    file->hits++;
+    status = replay_records(&file->records);
+  }
+  else {
+    /* it's recorded the second time it's read, so files that are only
+       included once don't pay for it (unless it's being preloaded) */
+    if(!fp && file && (file->reads || recording))
+      source->capturing = 1;
+    if(file)
+      file->reads++;
+
+    /* an up to date precompiled image saves parsing the text */
+    if(fp || !read_precompiled(source, &status)) {
+      if(!fp)
+        fp = fopen(source->filename, "r");
+      if(!fp) {
+        fprintf(stderr, "Error: could not open file %s for reading\n",
+                source->filename);
+        current_source = backup_source;
+        source->capturing = 0;
+        source->stale = 1;
+        return ERROR;
+      }
+      status = read_file(fp);
+      fclose(fp);
+    }
+
+    if(source->capturing) {
+      source->capturing = 0;
+      if(status == OK)
+        file->cached = 1;
+      else
+        free_records(&file->records);
+    }
+  }
+  current_source = backup_source;
+
+  /* it was only partly read, so must be read again */
+  if(status != OK)
+    source->stale = 1;
+  return status;
+}
+
+/* assembles the program, doing passes until every line's size and value
+   has settled */
 Status assemble() {
-  Handler f;
-  Line* lp;
-  int old_byte_size;
-  int another_pass;
+  Status status;
+
+  if(!timing)
+    return assemble_until_settled();
+  begin_span("assemble", NULL, 0);
+  status = assemble_until_settled();
+  end_span();
+  return status;
+}
+
+static Status assemble_until_settled() {
+  Status status;
+  int first_serial = pass_serial + 1;
+  int first_errors = error_count;
+  int errors;
+  int settled;
+
+  pass = 0;
+  for(;;) {
+    if(pass == MAX_PASSES)
+      return error_count > first_errors ? ERROR :
+             error("assembly did not settle after %d passes", MAX_PASSES);
+    errors = error_count;
+    if(timing)
+      begin_span("pass", NULL, pass + 1);
+    status = assemble_pass();
+    if(timing)
+      end_span();
+    if(status != OK)
+      return ERROR;
+    pass++;
+
+    /* a pass that went wrong is only followed by another while they're
+       still turning up errors not seen before */
+    if(error_count > first_errors && error_count == errors)
+      return ERROR;
+
+    /* if the first pass guessed the size of every line with a forward
+       reference from the hints, only those lines need checking */
+    if(missing_labels && pass == 1 && !unhinted) {
+      if(check_hinted_lines(&settled) != OK)
+        return ERROR;
+      if(settled)
+        missing_labels = 0;
+    }
 
-  /* continue doing passes until we can't make any more optimizations */
-  do {
-    another_pass = 0;
     /* continue doing passes as long as we're missing labels */
-    do {
-      lp = first_line;
-      acc16 = index16 = d = dbr = 0;
-      missing_labels = 0;
-      current_label = "";
-      current_label_len = 0;
-      while(lp) {
-        line_num = lp->line_num;
-        current_filename = lp->filename;
-        old_byte_size = lp->byte_size;
-        /* add the label */
-        if(lp->label) {
-          /* special case for constants */
-          if(!lp->instruction || strcasecmp(lp->instruction, "equ") != 0) {
-            if(set_val(lp->label, pc) != OK)
-              return ERROR;
-            if(lp->label[0] != '.') {
-              current_label = lp->label;
-              current_label_len = strlen(current_label);
-            }
-          }
-        }
-        /* assemble the instruction */
-        if(lp->instruction) {
-          /* lookup the handler for the instruction */
-          if(!(f = get_handler(lp->instruction)))
-            return error("unknown instruction '%s'", lp->instruction);
-          if(f(lp) != OK)
-            return ERROR; 
-          pc += lp->byte_size;
-          if(old_byte_size > lp->byte_size) {
-            printf("debug: line %d was %db, now %db.\n", line_num, old_byte_size, lp->byte_size);
-            another_pass = 1;
-          }
-        }
-        lp = lp->next;
-      }
-      pass++;
-    } while(missing_labels);
-  } while(another_pass);
+    if(missing_labels)
+      continue;
+
+    /* labels that moved only matter to lines that used them before they
+       were reached. reassemble just those if possible */
+    if(reassemble_stale_lines(&settled) != OK)
+      return ERROR;
+    if(!settled)
+      continue;
+
+    /* when reassembling, symbols left over from a previous build that are
+       gone from the source must be undefined, and one more pass will then
+       catch any references to them */
+    if(forget_stale_symbols(first_serial))
+      continue;
+
+    return error_count > first_errors ? ERROR : OK;
+  }
+}
+
+/* assembles every line once, recording where each ended up */
+static Status assemble_pass() {
+  Line* lp;
+
+  pc = 0;
+  current_section = section_count = relocating ? 1 : 0;
+  acc16 = index16 = d = dbr = 0;
+  missing_labels = 0;
+  if(!pass) {
+    guessed_count = 0;
+    unhinted = !hint_count();
+    hints_held = 0;
+  }
+  current_label = "";
+  current_label_len = 0;
+  current_scope = no_label;
+  pass_serial++;
+  clear_early_reads();
+
+  for(lp = first_line; lp; lp = lp->next)
+    if(!lp->dead && assemble_line(lp) != OK)
+      return ERROR;
+  current_line = NULL;
   return OK;
 }
 
-/* iterates through the assembled lines, writing each to disk */
-void write_assembled(FILE* fp) {
-  Line* lp = first_line;
-  while(lp) {
-    if(lp->instruction) {
-      if(strcasecmp(lp->instruction, "pad") == 0)
-        while(lp->byte_size) {
-          fputc(0, fp);
-          lp->byte_size--;
-        }
-      else if(strcasecmp(lp->instruction, "ascii") == 0)
-        fwrite(lp->expr1->e.str, 1, lp->byte_size, fp);
-      else if(strcasecmp(lp->instruction, "incbin") == 0) {
-        FILE* fp2;
-        int c;
-        fp2 = fopen(lp->expr1->e.str, "rb");
-        if(!fp2) {
-          error("cannot open included file %s", lp->expr1->e.str);
-          return;
-        }
-        while((c = fgetc(fp2)) != EOF)
-          fputc(c, fp);
-        fclose(fp2);
-      }
-      else if(lp->addr_mode == LIST && strcasecmp(lp->instruction, "db") == 0) 
-      {
-        Expr* e = lp->expr2;
-        while(e) {
-          fwrite(&e->e.num, 1, 1, fp);
-          e = e->next;
-        }
-      }
-      else if(lp->addr_mode == LIST && strcasecmp(lp->instruction, "dw") == 0) 
-      {
-        Expr* e = lp->expr2;
-        while(e) {
-          fwrite(&e->e.num, 1, 2, fp);
-          e = e->next;
+/* assembles a line at pc, recording where it went and the assumptions in
+   effect. returns ERROR if the lines after it can't be assembled */
+static Status assemble_line(Line* lp) {
+  Handler f;
+  int old_byte_size = lp->byte_size;
+  int backup_missing;
+
+  line_num = lp->line_num;
+  current_filename = lp->filename;
+  current_line = lp;
+  /* add the label */
+  if(lp->label) {
+    /* special case for constants */
+    if(!lp->instruction || strcasecmp(lp->instruction, "equ") != 0) {
+      if(set_val(lp->label, &lp->label_cache, pc) != OK && too_many_errors())
+        return ERROR;
+      if(lp->label[0] != '.') {
+        current_label = lp->label;
+        current_label_len = strlen(current_label);
+        /* its name's only interned the first time it's assembled */
+        if(tracking) {
+          if(!lp->assembled || !lp->scope)
+            lp->scope = intern_cached(lp->label, &lp->label_cache);
+          current_scope = lp->scope;
         }
       }
-      else
-        fwrite(lp->bytes, 1, lp->byte_size, fp);
     }
-    else
-      fwrite(lp->bytes, 1, lp->byte_size, fp);
+  }
+  lp->addr = pc;
+  lp->section = current_section;
+  lp->d = d;
+  lp->dbr = dbr;
+  lp->acc16 = acc16;
+  lp->index16 = index16;
+  if(tracking) {
+    lp->scope = current_scope;
+    lp->assembled = ++line_serial;
+  }
+  /* assemble the instruction */
+  if(lp->instruction) {
+    /* lookup the handler for the instruction */
+    if(!(f = get_handler(lp->instruction)))
+      return error("unknown instruction '%s'", lp->instruction);
+    backup_missing = missing_labels;
+    missing_labels = 0;
+    /* the rest of the pass is still worth checking for errors if the
+       line's size is known */
+    if(f(lp) != OK && (!lp->byte_size || too_many_errors()))
+      return ERROR;
+    if(missing_labels)
+      unresolved_line(lp);
+    missing_labels |= backup_missing;
+    pc += lp->byte_size;
+    if(old_byte_size > lp->byte_size)
+      fprintf(stderr, "debug: line %d was %db, now %db.\n", line_num,
+              old_byte_size, lp->byte_size);
+  }
+  return OK;
+}
+
+static void unresolved_line(Line* lp) {
+  if(reassembling) {
+    if(unresolved_count == unresolved_capacity) {
+      unresolved_capacity = unresolved_capacity ? unresolved_capacity * 2
+                                                : 256;
+      unresolved = realloc(unresolved, unresolved_capacity * sizeof(Line*));
+    }
+    unresolved[unresolved_count++] = lp;
+  }
+  else if(!pass)
+    hint_size(lp);
+}
+
+/* brings the assembly up to date after lines have been added to or taken
+   out of the program, without assembling all of it again. starts are the
+   lines just before each place that changed (NULL for the top of the
+   program), see relax_changes(). with no starts, or if anything's gone
+   wrong, the whole program is assembled instead */
+Status reassemble(Line** starts, int start_count) {
+  Status status;
+  Line* lp;
+
+  tracking = 1;
+
+  /* line serials only matter next to each other, so they can start over
+     before they run out */
+  if(line_serial > INT_MAX / 2) {
+    for(lp = first_line; lp; lp = lp->next)
+      if(lp->assembled)
+        lp->assembled = 1;
+    line_serial = 1;
+  }
+
+  if(starts && relaxable && !error_count) {
+    if(relax_changes(starts, start_count) == OK)
+      return OK;
+    /* whatever went wrong is left to a full assembly to report, as it
+       would be in a fresh build */
+    reset_errors();
+  }
+
+  status = assemble();
+  if(status == OK)
+    index_readers();
+  relaxable = status == OK;
+  return status;
+}
+
+/* from each start, lines are reassembled for as long as they don't come
+   out where they were before. then so are the lines that used a symbol
+   before its value changed, and any after them that move, until nothing
+   does. errors aren't reported, just returned */
+static Status relax_changes(Line** starts, int start_count) {
+  Error_handler backup_handler = error_handler;
+  int rounds = 0;
+  Status status = OK;
+  int i;
+
+  /* until every symbol's been seen, lines missing one are sized for the
+     worst, as in a first pass */
+  pass = 0;
+  pass_serial++;
+  reassembling = 1;
+  unresolved_count = 0;
+  error_handler = drop_error;
+  relax(1);
+
+  /* a start that's new itself comes after another place that changed,
+     which is reassembled through it */
+  for(i = 0; i < start_count && status == OK; i++)
+    if(!starts[i] || starts[i]->assembled)
+      status = relax_from(starts[i]);
+
+  while(status == OK && !error_count) {
+    Line** lines;
+    int count = moved_readers(&lines);
+
+    if(count)
+      status = ++rounds > MAX_PASSES ? ERROR : relax_readers(lines, count);
+    free(lines);
+    if(count)
+      continue;
+
+    /* with every symbol seen, the lines that were missing one can be
+       finished. then symbols whose lines went and that weren't defined
+       again are undefined, for the lines using them to be caught */
+    if(!pass) {
+      pass = 1;
+      status = relax_readers(unresolved, unresolved_count);
+    }
+    else if(!forget_orphans())
+      break;
+  }
+
+  relax(0);
+  error_handler = backup_handler;
+  reassembling = 0;
+  clear_early_reads();
+  current_line = NULL;
+  return error_count ? ERROR : status;
+}
+
+static void drop_error(char* filename, int line, char* message) {
+  /* a full assembly reports it, see reassemble() and preload() */
+}
+
+/* reassembles lp where it was last assembled, then the lines after it for
+   as long as they don't come out where they were, or with the assumptions
+   they were made under. lp NULL starts at the top of the program */
+static Status relax_from(Line* lp) {
+  if(lp) {
+    pc = lp->addr;
+    current_section = lp->section;
+    d = lp->d;
+    dbr = lp->dbr;
+    acc16 = lp->acc16;
+    index16 = lp->index16;
+    current_label = current_scope = lp->scope;
+    current_label_len = strlen(current_label);
+    if(assemble_line(lp) != OK)
+      return ERROR;
     lp = lp->next;
   }
+  else {
+    pc = 0;
+    current_section = 0;
+    acc16 = index16 = d = dbr = 0;
+    current_label = "";
+    current_label_len = 0;
+    current_scope = no_label;
+    lp = first_line;
+  }
+
+  for(; lp; lp = lp->next) {
+    if(lp->dead)
+      continue;
+    if(lp->assembled && lp->addr == pc && lp->section == current_section &&
+       lp->d == d && lp->dbr == dbr && lp->acc16 == acc16 &&
+       lp->index16 == index16 && lp->scope == current_scope)
+      break;
+    if(assemble_line(lp) != OK)
+      return ERROR;
+  }
+  return OK;
+}
+
+/* reassembles each of lines, once however many times it's listed */
+static Status relax_readers(Line** lines, int count) {
+  int serial = line_serial;
+  Status status = OK;
+  int i;
+
+  for(i = 0; i < count && status == OK; i++)
+    if(lines[i]->assembled <= serial && !lines[i]->dead)
+      status = relax_from(lines[i]);
+  return status;
+}
+
+/* reassembles, in place, the lines that used a symbol's old value. If any
+   of them changes size, or changes something later lines depend on, settled
+   is cleared and a full pass is needed */
+static Status reassemble_stale_lines(int* settled) {
+  Line** stale;
+  int count = find_stale_lines(&stale);
+  Status status = OK;
+  int i;
+
+  *settled = 1;
+  for(i = 0; i < count && *settled; i++) {
+    Line* lp = stale[i];
+    Handler f = get_handler(lp->instruction);
+    int old_byte_size = lp->byte_size;
+
+    /* these set things that later lines depend on */
+    if(strcasecmp(lp->instruction, "equ") == 0 ||
+       strcasecmp(lp->instruction, "setd") == 0 ||
+       strcasecmp(lp->instruction, "setdbr") == 0) {
+      *settled = 0;
+      break;
+    }
+
+    line_num = lp->line_num;
+    current_filename = lp->filename;
+    pc = lp->addr;
+    current_section = lp->section;
+    d = lp->d;
+    dbr = lp->dbr;
+    acc16 = lp->acc16;
+    index16 = lp->index16;
+    if(f(lp) != OK) {
+      status = ERROR;
+      break;
+    }
+    if(lp->byte_size != old_byte_size)
+      *settled = 0;
+  }
+  free(stale);
+  return status;
+}
+
+/* in the first pass, a line whose operand isn't known yet is sized as it
+   was last build, if there's a hint for it, rather than for the worst */
+static void hint_size(Line* lp) {
+  int size;
+
+  /* these set things that later lines depend on */
+  if(strcasecmp(lp->instruction, "equ") == 0 ||
+     strcasecmp(lp->instruction, "org") == 0 ||
+     strcasecmp(lp->instruction, "pad") == 0 ||
+     strcasecmp(lp->instruction, "setd") == 0 ||
+     strcasecmp(lp->instruction, "setdbr") == 0) {
+    unhinted = 1;
+    return;
+  }
+
+  if(guessed_count == guessed_capacity) {
+    guessed_capacity = guessed_capacity ? guessed_capacity * 2 : 1024;
+    guessed = realloc(guessed, guessed_capacity * sizeof(Line*));
+  }
+  guessed[guessed_count++] = lp;
+
+  if(unhinted || (size = find_hint(lp)) < 0)
+    unhinted = 1;
+  else
+    lp->byte_size = size;
+}
+
+/* assembles the lines sized from hints in the first pass, now that every
+   label's been seen. if they all come out the size they were guessed to
+   be, everything after them is where it should be */
+static Status check_hinted_lines(int* settled) {
+  int i;
+
+  *settled = 1;
+  for(i = 0; i < guessed_count && *settled; i++) {
+    Line* lp = guessed[i];
+    int size = lp->byte_size;
+
+    line_num = lp->line_num;
+    current_filename = lp->filename;
+    pc = lp->addr;
+    current_section = lp->section;
+    d = lp->d;
+    dbr = lp->dbr;
+    acc16 = lp->acc16;
+    index16 = lp->index16;
+    if(get_handler(lp->instruction)(lp) != OK)
+      return ERROR;
+    if(lp->byte_size != size)
+      *settled = 0;
+  }
+  hints_held = *settled && guessed_count == hint_count();
+  return OK;
+}
+
+/* lays the assembled lines out in memory as they're to be written, with
+   --checksum filling in the header's checksum. when rebuilding, previous
+   is the last build's image, and the checksum's worked out from its */
+Status build_output(Image* image, Image* previous) {
+  if(!rom_mapped)
+    return build_image(image);
+  if(build_rom_image(image, rom_map, fill) != OK)
+    return ERROR;
+  if(!checksum)
+    return OK;
+  add_rom_span(rom_header_offset(rom_map) + CHECKSUM_FIELDS, 4, NULL);
+  if(previous && previous->size == image->size)
+    return update_checksum(previous, image, rom_map);
+  return set_checksum(image, rom_map);
+}
+
+/* lays the assembled lines out in memory, then writes them to disk, or
+   with --ips or --bps writes what's changed since the reference ROM */
+Status write_assembled(FILE* fp) {
+  Image image;
+  Image reference;
+  Status status;
+
+  init_image(&image);
+  status = build_output(&image, NULL);
+  if(status == OK && patch_reference) {
+    status = map_reference(patch_reference, &reference);
+    if(status == OK) {
+      status = write_patch(fp, &reference, &image, patch_format);
+      unmap_reference(&reference);
+    }
+  }
+  else if(status == OK)
+    status = rom_mapped ? write_rom_image(&image, fp, fill)
+                        : write_image(&image, fp);
+  free_image(&image);
+  return status;
 }
@@ -2,19 +2,41 @@
 #define SNAP_H
 
 #include "error.h"
+#include "image.h"
+#include "lines.h"
+
+#include <stdio.h>
+
+#define SNAP_VERSION "0.3"
+
+/* give up on a program whose sizes keep changing */
+#define MAX_PASSES 64
+
+typedef FILE* (*Source_opener)(Source* source);
 
 extern int acc16;
 extern char* current_filename;
+extern Line* current_line;
 extern char* current_label;
 extern int current_label_len;
 extern int index16;
 extern int line_num;
 extern int missing_labels;
 extern int pass;
+extern int pass_serial;
+extern int line_serial;
 extern int pc;
+extern int current_section;
+extern int section_count;
 extern int d;
 extern int dbr;
+extern Source_opener source_opener;
 
+Status assemble();
+Status reassemble(Line** starts, int start_count);
 Status load_file(char* filename);
+Status load_source(Source* source);
+Status build_output(Image* image, Image* previous);
+Status write_assembled(FILE* fp);
 
 #endif
@@ -0,0 +1,482 @@
+#include "object.h"
+#include "place.h"
+#include "rom.h"
+#include "snap.h"
+#include "table.h"
+
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* snaplink puts object files written by snap -c together into a binary.
+   their sections are laid out one after another in the order they're
+   given, just as if the sources had been INCSRC'd in that order: a
+   relocatable section goes wherever the last one ended, and a fixed one
+   starts at the address it was ORG'd to. then each symbol an object
+   imports is looked up among those the others export, and every
+   relocation is filled in.
+
+   with -m, the output is a ROM of that memory map instead: fixed
+   sections go where they were ORG'd or AT'd to, and the rest are packed
+   into the space left wherever their constraints allow */
+
+typedef struct {
+  char* filename;
+  char* image;
+  Object_header* header;
+  Object_section* sections;
+  Object_symbol* symbols;
+  int* imports;
+  Object_reloc* relocs;
+  char* strings;
+  unsigned char* data;
+
+  /* where each section ended up, in memory and in the output */
+  int* addresses;
+  int* offsets;
+
+  /* the value of each import */
+  int* import_vals;
+} Module;
+
+typedef struct {
+  char* name;
+  int val;
+  int fixed;
+  Module* module;
+} Symbol;
+
+static Module* modules;
+static int module_count;
+static unsigned char* output;
+static int output_size;
+static int rom_mapped = 0;
+static Rom_map rom_map;
+static int rom_size = 0;
+static int report = 0;
+static Symbol* symbols;
+static int symbol_buckets;
+
+static int usage();
+static Status load_module(Module* m, char* filename);
+static Status place_sections();
+static Status map_sections();
+static Status parse_size(char* arg, int* size);
+static Status export_symbols();
+static Status resolve_imports(Module* m);
+static Status apply_reloc(Module* m, Object_reloc* r);
+static Status reloc_error(Module* m, Object_reloc* r, char* format, ...);
+static int find_symbol(char* name);
+static Status write_output(char* out_file);
+static Status write_symbols(char* sym_file);
+
+static struct option long_options[] = {
+  {"fastrom", no_argument, NULL, 'f'},
+  {"report", no_argument, NULL, 'r'},
+  {"rom-size", required_argument, NULL, 'R'},
+  {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char** argv) {
+  char* out_file = NULL;
+  char* sym_file = NULL;
+  Status status = OK;
+  int ch;
+  int i;
+  int j;
+
+  while((ch = getopt_long(argc, argv, "m:o:s:", long_options, NULL)) != -1) {
+    switch(ch) {
+    case 'm':
+      if(parse_rom_map(optarg, &rom_map) != OK)
+        return -1;
+      rom_mapped = 1;
+      break;
+    case 'f': fast_rom = 1; break;
+    case 'o': out_file = optarg; break;
+    case 'r': report = 1; break;
+    case 'R':
+      if(parse_size(optarg, &rom_size) != OK)
+        return -1;
+      break;
+    case 's': sym_file = optarg; break;
+    default: return usage();
+    }
+  }
+  if(!out_file || optind == argc)
+    return usage();
+  if(!rom_mapped && (rom_size || report || fast_rom)) {
+    fprintf(stderr, "Error: --rom-size, --report and --fastrom need a "
+                    "memory map (-m)\n");
+    return -1;
+  }
+  if(rom_mapped && rom_size > rom_max_size(rom_map)) {
+    fprintf(stderr, "Error: the ROM can be at most $%X bytes\n",
+            rom_max_size(rom_map));
+    return -1;
+  }
+
+  module_count = argc - optind;
+  modules = calloc(module_count, sizeof(Module));
+  for(i = 0; i < module_count; i++)
+    if(load_module(&modules[i], argv[optind + i]) != OK)
+      return -1;
+
+  if((rom_mapped ? map_sections() : place_sections()) != OK)
+    return -1;
+  if(export_symbols() != OK)
+    return -1;
+
+  /* report everything that's wrong, not just the first */
+  for(i = 0; i < module_count; i++) {
+    Module* m = &modules[i];
+    if(resolve_imports(m) != OK) {
+      status = ERROR;
+      continue;
+    }
+    for(j = 0; j < m->header->reloc_count; j++)
+      if(apply_reloc(m, &m->relocs[j]) != OK)
+        status = ERROR;
+  }
+  if(status != OK)
+    return -1;
+
+  if(write_output(out_file) != OK)
+    return -1;
+  if(sym_file && write_symbols(sym_file) != OK)
+    return -1;
+  return 0;
+}
+
+static int usage() {
+  fprintf(stderr, "Usage: snaplink [-m lorom|hirom|exhirom [--fastrom] "
+                  "[--rom-size <size>] [--report]]\n"
+                  "                [-s <sym-file>] -o <out-file> "
+                  "<object> [<object> ...]\n");
+  return -1;
+}
+
+/* reads an object file in whole, and finds its tables */
+static Status load_module(Module* m, char* filename) {
+  Object_header* h;
+  FILE* fp;
+  long size;
+  char* p;
+
+  m->filename = filename;
+  fp = fopen(filename, "rb");
+  if(!fp) {
+    fprintf(stderr, "Error: could not open file %s for reading\n", filename);
+    return ERROR;
+  }
+  fseek(fp, 0L, SEEK_END);
+  size = ftell(fp);
+  rewind(fp);
+  m->image = malloc(size + 1);
+  if(fread(m->image, 1, size, fp) != size) {
+    fclose(fp);
+    fprintf(stderr, "Error: reading %s\n", filename);
+    return ERROR;
+  }
+  fclose(fp);
+
+  h = m->header = (Object_header*)m->image;
+  if(size < sizeof(Object_header) ||
+     memcmp(h->magic, OBJECT_MAGIC, sizeof(h->magic)) != 0 ||
+     strncmp(h->version, SNAP_VERSION, sizeof(h->version)) != 0 ||
+     h->format != OBJECT_FORMAT ||
+     size != sizeof(Object_header) +
+             (long)h->section_count * sizeof(Object_section) +
+             (long)h->symbol_count * sizeof(Object_symbol) +
+             (long)h->import_count * sizeof(int) +
+             (long)h->reloc_count * sizeof(Object_reloc) +
+             h->strings_size + h->data_size) {
+    fprintf(stderr, "Error: %s isn't an object file from this version of "
+                    "snap\n", filename);
+    return ERROR;
+  }
+
+  p = (char*)(h + 1);
+  m->sections = (Object_section*)p;
+  p += h->section_count * sizeof(Object_section);
+  m->symbols = (Object_symbol*)p;
+  p += h->symbol_count * sizeof(Object_symbol);
+  m->imports = (int*)p;
+  p += h->import_count * sizeof(int);
+  m->relocs = (Object_reloc*)p;
+  p += h->reloc_count * sizeof(Object_reloc);
+  m->strings = p;
+  m->data = (unsigned char*)p + h->strings_size;
+
+  m->addresses = malloc((h->section_count + 1) * sizeof(int));
+  m->offsets = malloc((h->section_count + 1) * sizeof(int));
+  m->import_vals = malloc((h->import_count + 1) * sizeof(int));
+  return OK;
+}
+
+/* lays every section out, in order, and copies its bytes into place */
+static Status place_sections() {
+  int pc = 0;
+  int i;
+  int j;
+
+  output_size = 0;
+  for(i = 0; i < module_count; i++) {
+    Module* m = &modules[i];
+    for(j = 0; j < m->header->section_count; j++) {
+      Object_section* s = &m->sections[j];
+      if(s->align != 1 || s->bank_lo != 0 || s->bank_hi != 0xFF ||
+         s->same_bank >= 0 || s->at >= 0) {
+        fprintf(stderr, "Error: section %s in %s says where it goes, so "
+                        "needs a memory map (-m)\n", m->strings + s->name,
+                m->filename);
+        return ERROR;
+      }
+      if(s->fixed)
+        pc = s->address;
+      m->addresses[j] = pc;
+      m->offsets[j] = output_size;
+      pc += s->size;
+      output_size += s->size;
+    }
+  }
+
+  output = malloc(output_size + 1);
+  for(i = 0; i < module_count; i++) {
+    Module* m = &modules[i];
+    for(j = 0; j < m->header->section_count; j++)
+      memcpy(output + m->offsets[j], m->data + m->sections[j].data,
+             m->sections[j].size);
+  }
+  return OK;
+}
+
+/* packs every section into a ROM, and copies its bytes into place */
+static Status map_sections() {
+  Placement* places;
+  int count = 0;
+  int i;
+  int j;
+
+  for(i = 0; i < module_count; i++)
+    count += modules[i].header->section_count;
+  places = calloc(count + 1, sizeof(Placement));
+  count = 0;
+  for(i = 0; i < module_count; i++) {
+    Module* m = &modules[i];
+    for(j = 0; j < m->header->section_count; j++) {
+      Placement* p = &places[count++];
+      p->section = &m->sections[j];
+      p->name = m->strings + m->sections[j].name;
+      if(m->sections[j].same_bank >= 0)
+        p->same_bank = m->strings + m->sections[j].same_bank;
+      p->filename = m->filename;
+      p->module = i;
+    }
+  }
+
+  output_size = rom_size;
+  if(place_in_rom(places, count, rom_map, &output_size) != OK)
+    return ERROR;
+  if(report)
+    report_placement(stdout, places, count);
+
+  /* the ROM's gaps are left zero */
+  output = calloc(output_size + 1, 1);
+  count = 0;
+  for(i = 0; i < module_count; i++) {
+    Module* m = &modules[i];
+    for(j = 0; j < m->header->section_count; j++) {
+      Placement* p = &places[count++];
+      m->addresses[j] = p->address;
+      m->offsets[j] = p->offset;
+      if(m->sections[j].size)
+        memcpy(output + p->offset, m->data + m->sections[j].data,
+               m->sections[j].size);
+    }
+  }
+  free(places);
+  return OK;
+}
+
+/* a size in bytes, in decimal or $hex, optionally in K or M */
+static Status parse_size(char* arg, int* size) {
+  char* end;
+  long val = *arg == '$' ? strtol(arg + 1, &end, 16)
+                         : strtol(arg, &end, 10);
+
+  if(*end == 'K' || *end == 'k') {
+    val *= 1024;
+    end++;
+  }
+  else if(*end == 'M' || *end == 'm') {
+    val *= 1024 * 1024;
+    end++;
+  }
+  if(end == arg || *end || val <= 0 || val > 0x800000) {
+    fprintf(stderr, "Error: bad ROM size %s\n", arg);
+    return ERROR;
+  }
+  *size = val;
+  return OK;
+}
+
+/* puts every object's symbols in one table. the same constant can come
+   from more than one (from a shared header), but anything else defined
+   twice is an error */
+static Status export_symbols() {
+  Status status = OK;
+  int count = 0;
+  int i;
+  int j;
+
+  for(i = 0; i < module_count; i++)
+    count += modules[i].header->symbol_count;
+  for(symbol_buckets = 256; symbol_buckets < count * 2; symbol_buckets *= 2);
+  symbols = calloc(symbol_buckets, sizeof(Symbol));
+
+  for(i = 0; i < module_count; i++) {
+    Module* m = &modules[i];
+    for(j = 0; j < m->header->symbol_count; j++) {
+      Object_symbol* s = &m->symbols[j];
+      char* name = m->strings + s->name;
+      int fixed = s->kind == TARGET_ABSOLUTE;
+      int val = s->val + (fixed ? 0 : m->addresses[s->section]);
+      Symbol* entry = &symbols[find_symbol(name)];
+
+      if(entry->name) {
+        if(!fixed || !entry->fixed || val != entry->val) {
+          fprintf(stderr, "Error: symbol %s is defined in both %s and %s\n",
+                  name, entry->module->filename, m->filename);
+          status = ERROR;
+        }
+        continue;
+      }
+      entry->name = name;
+      entry->val = val;
+      entry->fixed = fixed;
+      entry->module = m;
+    }
+  }
+  return status;
+}
+
+static Status resolve_imports(Module* m) {
+  Status status = OK;
+  int i;
+
+  for(i = 0; i < m->header->import_count; i++) {
+    char* name = m->strings + m->imports[i];
+    Symbol* entry = &symbols[find_symbol(name)];
+
+    if(!entry->name) {
+      fprintf(stderr, "Error: undefined symbol '%s' imported by %s\n",
+              name, m->filename);
+      status = ERROR;
+    }
+    else
+      m->import_vals[i] = entry->val;
+  }
+  return status;
+}
+
+/* fills in a relocation's field, checking its value fits */
+static Status apply_reloc(Module* m, Object_reloc* r) {
+  int where = m->addresses[r->section] + r->offset;
+  unsigned char* dest = output + m->offsets[r->section] + r->offset;
+  int val = r->addend;
+  int limit;
+  int i;
+
+  switch(r->kind) {
+  case TARGET_SECTION: val += m->addresses[r->target]; break;
+  case TARGET_IMPORT: val += m->import_vals[r->target]; break;
+  }
+
+  /* the operand follows the opcode */
+  if((r->flags & RELOC_SAME_BANK) && val >> 16 != (where - 1) >> 16)
+    return reloc_error(m, r, "destination $%06X must be within same bank "
+                             "as jump", val);
+  if((r->flags & RELOC_DATA_BANK) && val >> 16 != r->bank)
+    return reloc_error(m, r, "address $%06X isn't in data bank $%02X", val,
+                       r->bank);
+
+  if(r->flags & RELOC_RELATIVE) {
+    val -= where + r->size;
+    limit = 1 << (8 * r->size - 1);
+    if(val < -limit || val >= limit)
+      return reloc_error(m, r, "destination must be within %d bytes of "
+                               "branch", limit);
+  }
+  else {
+    val >>= r->shift;
+    if(!(r->flags & RELOC_TRUNCATE) &&
+       (val < 0 || val >= 1 << (8 * r->size)))
+      return reloc_error(m, r, "operand %d out of range", val);
+  }
+
+  for(i = 0; i < r->size; i++)
+    dest[i] = val >> (8 * i);
+  return OK;
+}
+
+/* reports an error where the relocation came from, the way snap would */
+static Status reloc_error(Module* m, Object_reloc* r, char* format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  fprintf(stderr, "%s: ", m->strings + r->filename);
+  vfprintf(stderr, format, args);
+  fprintf(stderr, " on line %d\n", r->line_num);
+  va_end(args);
+  return ERROR;
+}
+
+/* the bucket name is in, or should go in */
+static int find_symbol(char* name) {
+  int i = hash_str(name) & (symbol_buckets - 1);
+
+  while(symbols[i].name && strcmp(symbols[i].name, name) != 0)
+    i = (i + 1) & (symbol_buckets - 1);
+  return i;
+}
+
+static Status write_output(char* out_file) {
+  FILE* fp = fopen(out_file, "wb");
+  int ok;
+
+  if(!fp) {
+    fprintf(stderr, "Error: could not open file %s for writing\n", out_file);
+    return ERROR;
+  }
+  ok = fwrite(output, 1, output_size, fp) == output_size;
+  ok = fclose(fp) == 0 && ok;
+  if(!ok) {
+    fprintf(stderr, "Error: writing output file\n");
+    return ERROR;
+  }
+  return OK;
+}
+
+/* dumps every exported symbol, in the same form snap -s does */
+static Status write_symbols(char* sym_file) {
+  FILE* fp = fopen(sym_file, "w");
+  int i;
+
+  if(!fp) {
+    fprintf(stderr,
+            "Error: could not open file %s for writing symbol info to\n",
+            sym_file);
+    return ERROR;
+  }
+  for(i = 0; i < symbol_buckets; i++)
+    if(symbols[i].name)
+      fprintf(fp, "%s: $%X\n", symbols[i].name, symbols[i].val);
+  if(fclose(fp) != 0) {
+    fprintf(stderr, "Error: writing %s\n", sym_file);
+    return ERROR;
+  }
+  return OK;
+}
@@ -0,0 +1,232 @@
+#include "symexport.h"
+
+#include "error.h"
+#include "labels.h"
+#include "rom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* writes the symbols out for debuggers and emulators, sorted by address.
+   however many formats are wanted, the table's walked once, the symbols
+   sorted with a two pass radix sort on their 24-bit addresses, and they
+   and their names gathered in that order, so that each format is just a
+   straight run through them into one buffer, written in one go */
+
+/* the most a line can take besides the name: a memory type, an address
+   and separators */
+#define LINE_OVERHEAD 24
+
+#define RADIX_BITS 12
+#define RADIX (1 << RADIX_BITS)
+
+static unsigned long long* sort_by_address(Symbol_value* list, int count);
+static char* format_symbols(char* p, Symbol_format format,
+                            Symbol_value* sorted, int* lengths, int count,
+                            Rom_map* map);
+static char* mesen_line(char* p, Symbol_value* s, int len, Rom_map map);
+static char* put_hex(char* p, int n, int digits);
+static Status write_file(char* filename, char* text, int size);
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+/* writes a symbol file in each format files has a name for. map is the
+   ROM's memory map, which Mesen's format needs, or NULL */
+Status export_symbols(char** files, Rom_map* map) {
+  Symbol_value* list;
+  Symbol_value* sorted;
+  unsigned long long* order;
+  int* lengths;
+  char* names = NULL;
+  char* text;
+  int count = list_symbols(&list);
+  int names_size = 0;
+  int names_capacity = 0;
+  Status status = OK;
+  int i;
+
+  order = sort_by_address(list, count);
+  sorted = malloc((count + 1) * sizeof(Symbol_value));
+  lengths = malloc((count + 1) * sizeof(int));
+  for(i = 0; i < count; i++) {
+    Symbol_value* s = &list[order[i] & 0xFFFFFFFF];
+    int len = strlen(s->name);
+
+    if(names_size + len > names_capacity) {
+      names_capacity = names_capacity ? names_capacity * 2 : 0x10000;
+      while(names_size + len > names_capacity)
+        names_capacity *= 2;
+      names = realloc(names, names_capacity);
+    }
+    memcpy(names + names_size, s->name, len);
+    names_size += len;
+    sorted[i] = *s;
+    lengths[i] = len;
+  }
+  names_size = 0;
+  for(i = 0; i < count; i++) {
+    sorted[i].name = names + names_size;
+    names_size += lengths[i];
+  }
+  free(order);
+  free(list);
+
+  /* the one buffer does for every format, bsnes's [labels] and all */
+  text = malloc(9 + names_size + (long)count * LINE_OVERHEAD);
+  for(i = 0; i < SYMBOL_FORMATS; i++) {
+    char* end;
+
+    if(!files[i])
+      continue;
+    end = format_symbols(text, i, sorted, lengths, count, map);
+    if(write_file(files[i], text, end - text) != OK)
+      status = ERROR;
+  }
+
+  free(text);
+  free(names);
+  free(lengths);
+  free(sorted);
+  return status;
+}
+
+/* LSD radix sort on the low 24 bits of each value, RADIX_BITS at a time.
+   what's sorted is each symbol's address and index packed into one word,
+   rather than the symbols themselves, and both digits are counted in the
+   one pass. stable, so symbols at the same address stay in table order.
+   returns the sorted words */
+static unsigned long long* sort_by_address(Symbol_value* list, int count) {
+  unsigned long long* keys = malloc((count + 1) * sizeof(long long));
+  unsigned long long* tmp = malloc((count + 1) * sizeof(long long));
+  static int counts[24 / RADIX_BITS][RADIX];
+  int digit;
+  int i;
+
+  memset(counts, 0, sizeof(counts));
+  for(i = 0; i < count; i++) {
+    int addr = list[i].val & 0xFFFFFF;
+    keys[i] = (unsigned long long)addr << 32 | i;
+    for(digit = 0; digit < 24 / RADIX_BITS; digit++)
+      counts[digit][addr >> (digit * RADIX_BITS) & (RADIX - 1)]++;
+  }
+
+  for(digit = 0; digit < 24 / RADIX_BITS; digit++) {
+    int shift = 32 + digit * RADIX_BITS;
+    int sum = 0;
+    unsigned long long* swap;
+
+    for(i = 0; i < RADIX; i++) {
+      int c = counts[digit][i];
+      counts[digit][i] = sum;
+      sum += c;
+    }
+    for(i = 0; i < count; i++)
+      tmp[counts[digit][keys[i] >> shift & (RADIX - 1)]++] = keys[i];
+    swap = keys;
+    keys = tmp;
+    tmp = swap;
+  }
+  free(tmp);
+  return keys;
+}
+
+/* formats the symbols into p, returning the end of the text */
+static char* format_symbols(char* p, Symbol_format format,
+                            Symbol_value* sorted, int* lengths, int count,
+                            Rom_map* map) {
+  int i;
+
+  if(format == BSNES_SYMBOLS) {
+    memcpy(p, "[labels]\n", 9);
+    p += 9;
+  }
+  for(i = 0; i < count; i++) {
+    Symbol_value* s = &sorted[i];
+
+    switch(format) {
+    case BSNES_SYMBOLS:
+      p = put_hex(p, s->val >> 16, 2);
+      *p++ = ':';
+      p = put_hex(p, s->val, 4);
+      break;
+    case MESEN_SYMBOLS:
+      p = mesen_line(p, s, lengths[i], *map);
+      continue;
+    default:
+      p = put_hex(p, s->val & 0xFFFFFF, 8);
+      break;
+    }
+    *p++ = ' ';
+    memcpy(p, s->name, lengths[i]);
+    p += lengths[i];
+    *p++ = '\n';
+  }
+  return p;
+}
+
+/* Mesen labels memory rather than addresses: work RAM, the registers, or
+   an offset in the ROM. symbols anywhere else are left out, and the colon
+   in a local label's name, which Mesen would take for a separator, is
+   written as an underscore */
+static char* mesen_line(char* p, Symbol_value* s, int len, Rom_map map) {
+  int addr = s->val & 0xFFFFFF;
+  int bank = addr >> 16;
+  int low = addr & 0xFFFF;
+  char* type;
+  int offset;
+  int i;
+
+  if(bank == 0x7E || bank == 0x7F) {
+    type = "SnesWorkRam";
+    offset = addr - 0x7E0000;
+  }
+  else if(!(bank & 0x40) && low < 0x2000) {
+    type = "SnesWorkRam";
+    offset = low;
+  }
+  else if(!(bank & 0x40) && low < 0x6000) {
+    type = "SnesRegister";
+    offset = low;
+  }
+  else if((offset = rom_offset(map, addr)) >= 0)
+    type = "SnesPrgRom";
+  else
+    return p;
+
+  for(; *type; type++)
+    *p++ = *type;
+  *p++ = ':';
+  p = put_hex(p, offset, offset > 0xFFFF ? 6 : 4);
+  *p++ = ':';
+  for(i = 0; i < len; i++)
+    *p++ = s->name[i] == ':' ? '_' : s->name[i];
+  *p++ = '\n';
+  return p;
+}
+
+/* writes the last digits hex digits of n */
+static char* put_hex(char* p, int n, int digits) {
+  int i;
+
+  for(i = digits - 1; i >= 0; i--) {
+    p[i] = hex_digits[n & 0xF];
+    n >>= 4;
+  }
+  return p + digits;
+}
+
+static Status write_file(char* filename, char* text, int size) {
+  FILE* fp = fopen(filename, "w");
+  int ok;
+
+  if(!fp) {
+    fprintf(stderr, "Error: could not open file %s for writing\n", filename);
+    return ERROR;
+  }
+  ok = fwrite(text, 1, size, fp) == size;
+  ok = fclose(fp) == 0 && ok;
+  if(!ok)
+    fprintf(stderr, "Error: writing %s\n", filename);
+  return ok ? OK : ERROR;
+}
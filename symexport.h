@@ -0,0 +1,17 @@
+#ifndef SYMEXPORT_H
+#define SYMEXPORT_H
+
+#include "error.h"
+#include "rom.h"
+
+/* the debuggers' symbol file formats snap can write */
+typedef enum {
+  BSNES_SYMBOLS,  /* [labels], then bb:aaaa name */
+  MESEN_SYMBOLS,  /* memory type:offset:name, as in a .mlb */
+  NOCASH_SYMBOLS, /* 00bbaaaa name */
+  SYMBOL_FORMATS
+} Symbol_format;
+
+Status export_symbols(char** files, Rom_map* map);
+
+#endif
@@ -0,0 +1,158 @@
+#include "symindex.h"
+
+#include "error.h"
+#include "labels.h"
+#include "lines.h"
+#include "table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILE_BUCKETS 64
+
+typedef struct {
+  char* bytes;
+  int size;
+  int capacity;
+} Pool;
+
+/* the files symbols were defined in, by name */
+typedef struct {
+  char** names;
+  int* offsets; /* of each name in the pool */
+  int count;
+  int* buckets;
+  int bucket_count;
+  int last; /* the file last found */
+} Files;
+
+static int add_string(Pool* pool, char* str);
+static int file_index(Files* files, Pool* pool, char* filename);
+static int compare_values(const void* a, const void* b);
+
+/* writes every defined symbol to fp as a symbol index */
+Status write_symbol_index(FILE* fp) {
+  Symindex_header header;
+  Symindex_symbol* symbols;
+  Symbol_value* list;
+  Files files = {NULL, NULL, 0, NULL, 0, -1};
+  int* buckets;
+  Pool pool = {NULL, 0, 0};
+  int count = list_symbols(&list);
+  int i;
+
+  qsort(list, count, sizeof(Symbol_value), compare_values);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SYMINDEX_MAGIC, sizeof(header.magic));
+  header.format = SYMINDEX_FORMAT;
+  header.symbol_count = count;
+  for(header.bucket_count = 1; header.bucket_count < count * 2;
+      header.bucket_count *= 2);
+
+  symbols = calloc(count + 1, sizeof(Symindex_symbol));
+  buckets = malloc(header.bucket_count * sizeof(int));
+  for(i = 0; i < header.bucket_count; i++)
+    buckets[i] = -1;
+
+  for(i = 0; i < count; i++) {
+    Symindex_symbol* s = &symbols[i];
+    Line* lp = list[i].line;
+    int b;
+
+    s->name = add_string(&pool, list[i].name);
+    s->hash = hash_str(list[i].name);
+    s->val = list[i].val;
+    s->file = -1;
+    s->line_num = 0;
+    if(lp && lp->filename) {
+      s->file = file_index(&files, &pool, lp->filename);
+      s->line_num = lp->line_num;
+    }
+
+    for(b = s->hash & (header.bucket_count - 1); buckets[b] >= 0;
+        b = (b + 1) & (header.bucket_count - 1));
+    buckets[b] = i;
+  }
+  header.file_count = files.count;
+  header.strings_size = pool.size;
+
+  fwrite(&header, sizeof(header), 1, fp);
+  fwrite(symbols, sizeof(Symindex_symbol), count, fp);
+  fwrite(buckets, sizeof(int), header.bucket_count, fp);
+  fwrite(files.offsets, sizeof(int), header.file_count, fp);
+  fwrite(pool.bytes, 1, pool.size, fp);
+
+  free(list);
+  free(symbols);
+  free(buckets);
+  free(files.names);
+  free(files.offsets);
+  free(files.buckets);
+  free(pool.bytes);
+  return OK;
+}
+
+/* copies str into the pool, NUL and all, and returns its offset */
+static int add_string(Pool* pool, char* str) {
+  int len = strlen(str) + 1;
+  int offset = pool->size;
+
+  if(pool->size + len > pool->capacity) {
+    pool->capacity = pool->capacity ? pool->capacity * 2 : 0x1000;
+    while(pool->size + len > pool->capacity)
+      pool->capacity *= 2;
+    pool->bytes = realloc(pool->bytes, pool->capacity);
+  }
+  memcpy(pool->bytes + offset, str, len);
+  pool->size += len;
+  return offset;
+}
+
+/* the index of filename among the files, adding it if it's new. a
+   file's lines share the one name, so the file last found is checked
+   first; the others are looked up by a hash of their names */
+static int file_index(Files* files, Pool* pool, char* filename) {
+  int i;
+
+  if(files->last >= 0 && (files->names[files->last] == filename ||
+                          strcmp(files->names[files->last], filename) == 0))
+    return files->last;
+
+  if((files->count + 1) * 2 > files->bucket_count) {
+    files->bucket_count = files->bucket_count ? files->bucket_count * 2
+                                              : FILE_BUCKETS;
+    files->buckets = realloc(files->buckets,
+                             files->bucket_count * sizeof(int));
+    memset(files->buckets, -1, files->bucket_count * sizeof(int));
+    for(i = 0; i < files->count; i++) {
+      int b = hash_str(files->names[i]) & (files->bucket_count - 1);
+      while(files->buckets[b] >= 0)
+        b = (b + 1) & (files->bucket_count - 1);
+      files->buckets[b] = i;
+    }
+  }
+
+  for(i = hash_str(filename) & (files->bucket_count - 1);
+      files->buckets[i] >= 0; i = (i + 1) & (files->bucket_count - 1))
+    if(strcmp(files->names[files->buckets[i]], filename) == 0)
+      return files->last = files->buckets[i];
+
+  files->names = realloc(files->names, (files->count + 1) * sizeof(char*));
+  files->offsets = realloc(files->offsets, (files->count + 1) * sizeof(int));
+  files->names[files->count] = filename;
+  files->offsets[files->count] = add_string(pool, filename);
+  files->buckets[i] = files->count;
+  return files->last = files->count++;
+}
+
+/* by value, then name */
+static int compare_values(const void* a, const void* b) {
+  Symbol_value* sa = (Symbol_value*)a;
+  Symbol_value* sb = (Symbol_value*)b;
+
+  if(sa->val != sb->val)
+    return sa->val < sb->val ? -1 : 1;
+  return strcmp(sa->name, sb->name);
+}
@@ -0,0 +1,40 @@
+#ifndef SYMINDEX_H
+#define SYMINDEX_H
+
+#include "error.h"
+
+#include <stdio.h>
+
+/* with --sym-index, the symbols are also written in a binary form that
+   tools can map in and search where it lies, without parsing anything:
+   sorted by value, for finding the symbol an address is in by binary
+   search, and hashed by name (with hash_str) for looking names up */
+#define SYMINDEX_MAGIC "SNAPSYM"
+#define SYMINDEX_FORMAT 1
+
+/* the file is the header, then the symbols in order of value, then the
+   hash buckets, then the files' names, then the strings. names are
+   offsets into the strings */
+typedef struct {
+  char magic[8];
+  int format;
+  int symbol_count;
+  int bucket_count; /* a power of two */
+  int file_count;
+  int strings_size;
+} Symindex_header;
+
+typedef struct {
+  int name;
+  unsigned int hash;
+  int val;
+  int file; /* where it was defined, or -1 if that isn't known */
+  int line_num;
+} Symindex_symbol;
+
+/* each bucket is the index of a symbol, or -1. a name is looked for from
+   bucket hash & (bucket_count - 1) on, until an empty one */
+
+Status write_symbol_index(FILE* fp);
+
+#endif
@@ -2,18 +2,29 @@
 
 #include <ctype.h>
 
+static unsigned int mix(unsigned int hash);
+
 /* a dumb ol' string hashing function */
 unsigned int hash_str(char* str) {
   unsigned int hash = 0;
   for(; *str; str++)
     hash = (hash * 32) - hash + *str;
-  return hash;
+  return mix(hash);
 }    
 
 unsigned int hash_stri(char* str) {
   unsigned int hash = 0;
   for(; *str; str++)
     hash = (hash * 32) - hash + tolower(*str);
+  return mix(hash);
+}
+
+/* scrambles the bits of a hash, so that similar names (Routine_1,
+   Routine_2...) don't pile up in neighbouring buckets */
+static unsigned int mix(unsigned int hash) {
+  hash ^= hash >> 16;
+  hash *= 0x45D9F3B;
+  hash ^= hash >> 16;
   return hash;
 }
 
@@ -0,0 +1,245 @@
+#include "timing.h"
+
+#include "error.h"
+#include "json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* a span is a phase of the build - parsing a file, a pass, writing the
+   output - with the wall and CPU time it took. spans nest, as INCSRC'd
+   files' parses do in their includers', and each also has the time it
+   took less what was nested in it, so a report's times add up */
+typedef struct {
+  char* name;
+  char* detail; /* a file name, or NULL */
+  int number; /* a pass number, or 0 */
+  long long start;
+  long long start_cpu;
+  long long wall;
+  long long cpu;
+  long long self_wall;
+  long long self_cpu;
+  int depth;
+  int parent; /* the span it's nested in, or -1 */
+  int kind; /* the first span like it, for adding them up */
+} Span;
+
+int timing = 0;
+
+static Span* spans = NULL;
+static int span_count = 0;
+static int span_capacity = 0;
+
+/* the spans begun but not ended, innermost last */
+static int* open_spans = NULL;
+static int open_count = 0;
+static int open_capacity = 0;
+
+static long long origin;
+static long long origin_cpu;
+
+static long long now(clockid_t clock);
+static int same_kind(Span* a, Span* b);
+static void span_name(Span* s, char* buffer, int size);
+static int kind_of(int span);
+static void print_report(FILE* fp);
+static void print_kinds(FILE* fp, int parent_kind);
+static Status write_trace(char* filename);
+
+void start_timing() {
+  timing = 1;
+  span_count = open_count = 0;
+  origin = now(CLOCK_MONOTONIC);
+  origin_cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/* starts a span inside whichever is open. name says what it is, and
+   detail or number, if given, which one */
+void begin_span(char* name, char* detail, int number) {
+  Span* s;
+
+  if(span_count == span_capacity) {
+    span_capacity = span_capacity ? span_capacity * 2 : 256;
+    spans = realloc(spans, span_capacity * sizeof(Span));
+  }
+  if(open_count == open_capacity) {
+    open_capacity = open_capacity ? open_capacity * 2 : 16;
+    open_spans = realloc(open_spans, open_capacity * sizeof(int));
+  }
+  s = &spans[span_count];
+  s->name = name;
+  s->detail = detail;
+  s->number = number;
+  s->depth = open_count;
+  s->parent = open_count ? open_spans[open_count - 1] : -1;
+  s->wall = s->cpu = s->self_wall = s->self_cpu = 0;
+  open_spans[open_count++] = span_count++;
+  s->start_cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+  s->start = now(CLOCK_MONOTONIC);
+}
+
+/* ends the innermost open span */
+void end_span() {
+  long long end = now(CLOCK_MONOTONIC);
+  long long end_cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+  Span* s;
+
+  if(!open_count)
+    return;
+  s = &spans[open_spans[--open_count]];
+  s->wall = end - s->start;
+  s->cpu = end_cpu - s->start_cpu;
+  s->self_wall += s->wall;
+  s->self_cpu += s->cpu;
+  if(open_count) {
+    Span* parent = &spans[open_spans[open_count - 1]];
+    parent->self_wall -= s->wall;
+    parent->self_cpu -= s->cpu;
+  }
+}
+
+/* stops recording, closing any spans left open by an error, then prints
+   the report to report and writes the trace to trace_file, either of
+   which may be NULL */
+Status finish_timing(FILE* report, char* trace_file) {
+  Status status = OK;
+
+  while(open_count)
+    end_span();
+  timing = 0;
+  if(report)
+    print_report(report);
+  if(trace_file)
+    status = write_trace(trace_file);
+  return status;
+}
+
+/* the time spent in each kind of span, less what's nested in it. spans
+   with the same name and file, nested in the same kind of span, are added
+   together, so the second build's passes come under its "assemble" */
+static void print_report(FILE* fp) {
+  int i;
+  int j;
+
+  for(i = 0; i < span_count; i++) {
+    Span* s = &spans[i];
+    int parent_kind = kind_of(s->parent);
+
+    s->kind = i;
+    for(j = 0; j < i; j++) {
+      if(spans[j].kind == j && kind_of(spans[j].parent) == parent_kind &&
+         same_kind(s, &spans[j])) {
+        s->kind = j;
+        break;
+      }
+    }
+  }
+
+  fprintf(fp, "   wall ms     cpu ms\n");
+  print_kinds(fp, -1);
+  fprintf(fp, "%10.3f %10.3f  total\n",
+          (now(CLOCK_MONOTONIC) - origin) / 1e6,
+          (now(CLOCK_PROCESS_CPUTIME_ID) - origin_cpu) / 1e6);
+}
+
+/* prints the kinds of span nested in parent_kind, each followed by its
+   own */
+static void print_kinds(FILE* fp, int parent_kind) {
+  char name[512];
+  int i;
+  int j;
+
+  for(i = 0; i < span_count; i++) {
+    Span* s = &spans[i];
+    long long wall = 0;
+    long long cpu = 0;
+    int count = 0;
+
+    if(s->kind != i || kind_of(s->parent) != parent_kind)
+      continue;
+    for(j = i; j < span_count; j++) {
+      if(spans[j].kind == i) {
+        wall += spans[j].self_wall;
+        cpu += spans[j].self_cpu;
+        count++;
+      }
+    }
+    span_name(s, name, sizeof(name));
+    fprintf(fp, "%10.3f %10.3f  %*s%s", wall / 1e6, cpu / 1e6,
+            s->depth * 2, "", name);
+    if(count > 1)
+      fprintf(fp, " (%d times)", count);
+    fprintf(fp, "\n");
+    print_kinds(fp, i);
+  }
+}
+
+/* writes the spans as Chrome's trace event JSON, for chrome://tracing or
+   Perfetto, with times in microseconds from the start */
+static Status write_trace(char* filename) {
+  Json_buffer b;
+  char name[512];
+  FILE* fp;
+  int pid = getpid();
+  int ok;
+  int i;
+
+  json_init(&b);
+  json_printf(&b, "{\"traceEvents\":[");
+  for(i = 0; i < span_count; i++) {
+    Span* s = &spans[i];
+
+    span_name(s, name, sizeof(name));
+    json_printf(&b, "%s\n{\"name\":", i ? "," : "");
+    json_string(&b, name);
+    json_printf(&b, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"cpu_ms\":%.3f}}",
+                s->name, pid, (s->start - origin) / 1e3, s->wall / 1e3,
+                s->cpu / 1e6);
+  }
+  json_printf(&b, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+  fp = fopen(filename, "w");
+  if(!fp) {
+    fprintf(stderr, "Error: could not open file %s for writing\n", filename);
+    free(b.text);
+    return ERROR;
+  }
+  ok = fwrite(b.text, 1, b.len, fp) == b.len;
+  ok = fclose(fp) == 0 && ok;
+  free(b.text);
+  if(!ok)
+    fprintf(stderr, "Error: writing %s\n", filename);
+  return ok ? OK : ERROR;
+}
+
+static int kind_of(int span) {
+  return span < 0 ? -1 : spans[span].kind;
+}
+
+static int same_kind(Span* a, Span* b) {
+  return a->number == b->number && strcmp(a->name, b->name) == 0 &&
+         (a->detail ? b->detail && strcmp(a->detail, b->detail) == 0
+                    : !b->detail);
+}
+
+/* "parse main.asm", "pass 2" or just the name */
+static void span_name(Span* s, char* buffer, int size) {
+  if(s->detail)
+    snprintf(buffer, size, "%s %s", s->name, s->detail);
+  else if(s->number)
+    snprintf(buffer, size, "%s %d", s->name, s->number);
+  else
+    snprintf(buffer, size, "%s", s->name);
+}
+
+static long long now(clockid_t clock) {
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
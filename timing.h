@@ -0,0 +1,18 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include "error.h"
+
+#include <stdio.h>
+
+/* set while the time spent in each phase of a build is being recorded,
+   for --time-report and --trace. everything that records a span checks
+   it first, so it costs nothing more than that when it's not */
+extern int timing;
+
+void start_timing();
+void begin_span(char* name, char* detail, int number);
+void end_span();
+Status finish_timing(FILE* report, char* trace_file);
+
+#endif
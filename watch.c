@@ -0,0 +1,509 @@
+#include "watch.h"
+
+#include "error.h"
+#include "files.h"
+#include "image.h"
+#include "labels.h"
+#include "lines.h"
+#include "push.h"
+#include "snap.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+/* how long to wait for an editor to finish saving before rebuilding */
+#define SETTLE_MS 20
+
+#define EVENT_BUFFER (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+typedef struct {
+  int wd;
+  char* dir;
+} Watched_dir;
+
+static Watched_dir* watched = NULL;
+static int watched_count = 0;
+
+/* canonical paths of every INCBIN'd file */
+static char** incbin_paths = NULL;
+static int incbin_count = 0;
+
+static Status rebuild(Image* image, int fd, char* sym_file, Line** starts,
+                      int start_count);
+static int find_changes(Line*** starts);
+static void watch_dirs(int ifd);
+static void watch_dir_of(int ifd, char* path);
+static int is_incbin_path(char* path);
+static double now_ms();
+
+/* an unchanged file included by one being reloaded, whose lines are set
+   aside to be spliced back in when it's included again */
+typedef struct {
+  Source* source;
+  Line* first;
+  Line* last;
+  Line* prev; /* the line its lines used to follow */
+} Kept;
+
+static Kept* kept = NULL;
+static int kept_count = 0;
+
+/* the files read again by the last reload_stale_sources() */
+static Source** reloaded = NULL;
+static int reloaded_count = 0;
+
+static Source* child_of(Source* s, Source* source);
+static int has_stale(Source* source);
+
+/* throws away the lines read from source and reads the file again in
+   their place. the files it includes are only read again if they've
+   changed too */
+Status reload_source(Source* source) {
+  Line* lp = source->prev ? source->prev->next : first_line;
+  Line* end = last_line;
+  Line* tail;
+  Source** anchored;
+  Source* backup_source = current_source;
+  Source* s;
+  Source* next;
+  Status status;
+  int anchored_count = 0;
+  int i;
+
+  /* files included after this one might start right after its last line */
+  for(s = first_source; s; s = s->next)
+    anchored_count++;
+  anchored = malloc(anchored_count * sizeof(Source*));
+  kept = realloc(kept, anchored_count * sizeof(Kept));
+  kept_count = 0;
+  anchored_count = 0;
+  for(s = first_source; s; s = s->next)
+    if(!within_source(s, source) && s->prev && from_source(s->prev, source))
+      anchored[anchored_count++] = s;
+
+  /* cut out the old lines, setting aside those of unchanged included
+     files */
+  lines_freed();
+  while(lp && from_source(lp, source)) {
+    Line* next_line = lp->next;
+    Source* child = child_of(lp->source, source);
+
+    if(child && !has_stale(child)) {
+      kept[kept_count].source = child;
+      kept[kept_count].first = lp;
+      kept[kept_count].prev = child->prev;
+      while(lp->next && from_source(lp->next, child))
+        lp = lp->next;
+      kept[kept_count].last = lp;
+      kept_count++;
+      next_line = lp->next;
+      lp->next = NULL;
+    }
+    else {
+      forget_line(lp);
+      free_line(lp);
+    }
+    lp = next_line;
+  }
+  tail = lp;
+
+  /* forget about the other files it included - they'll be found again if
+     they're still included */
+  for(s = first_source; s; s = next) {
+    next = s->next;
+    if(s != source && within_source(s, source) && !is_kept(s))
+      remove_source(s);
+  }
+
+  /* parse it again, in place */
+  if(source->prev) {
+    source->prev->next = NULL;
+    last_line = source->prev;
+  }
+  else
+    first_line = last_line = NULL;
+  current_source = source->parent;
+  current_label = source->label;
+  current_label_len = strlen(current_label);
+  source->stale = 0;
+  status = load_source(source);
+  current_source = backup_source;
+
+  /* drop whatever it no longer includes */
+  for(i = 0; i < kept_count; i++) {
+    if(!kept[i].source)
+      continue;
+    for(lp = kept[i].first; lp;) {
+      Line* next_line = lp->next;
+      forget_line(lp);
+      free_line(lp);
+      lp = next_line;
+    }
+    for(s = first_source; s; s = next) {
+      next = s->next;
+      if(within_source(s, kept[i].source))
+        remove_source(s);
+    }
+  }
+  kept_count = 0;
+
+  /* and stitch the rest of the program back on */
+  for(i = 0; i < anchored_count; i++)
+    anchored[i]->prev = last_line;
+  free(anchored);
+  if(last_line)
+    last_line->next = tail;
+  else
+    first_line = tail;
+  if(tail)
+    last_line = end;
+
+  return status;
+}
+
+/* if filename is being included again by the file being reloaded, in the
+   same place relative to global labels, splices its old lines back in
+   instead of reading it. returns whether it did */
+int reuse_source(char* filename) {
+  Line* lp;
+  Source* s;
+  int i;
+
+  for(i = 0; i < kept_count; i++) {
+    if(kept[i].source && kept[i].source->parent == current_source &&
+       strcmp(kept[i].source->filename, filename) == 0 &&
+       strcmp(kept[i].source->label, current_label) == 0)
+      break;
+  }
+  if(i == kept_count)
+    return 0;
+
+  for(s = first_source; s; s = s->next)
+    if(within_source(s, kept[i].source) && s->prev == kept[i].prev)
+      s->prev = last_line;
+  if(last_line)
+    last_line->next = kept[i].first;
+  else
+    first_line = kept[i].first;
+  last_line = kept[i].last;
+
+  /* the global label in effect afterwards is the last one it defined */
+  for(lp = kept[i].first; lp; lp = lp->next) {
+    if(lp->label && lp->label[0] != '.' &&
+       (!lp->instruction || strcasecmp(lp->instruction, "equ") != 0)) {
+      current_label = lp->label;
+      current_label_len = strlen(current_label);
+    }
+  }
+
+  kept[i].source = NULL;
+  return 1;
+}
+
+/* reloads every file marked stale, and returns how many it reloaded */
+int reload_stale_sources() {
+  Source* s;
+  int count = 0;
+  int i;
+
+  forget_file_stats();
+  for(s = first_source; s; s = s->next)
+    count++;
+  reloaded = realloc(reloaded, (count ? count : 1) * sizeof(Source*));
+
+  /* a file included by another stale file comes along with it */
+  count = 0;
+  for(s = first_source; s; s = s->next) {
+    Source* a;
+    for(a = s->parent; a && !a->stale; a = a->parent);
+    if(s->stale && !a)
+      reloaded[count++] = s;
+  }
+
+  for(i = 0; i < count; i++)
+    reload_source(reloaded[i]);
+  reloaded_count = count;
+  return count;
+}
+
+/* sets starts to a new array of the lines just before each place the last
+   reload changed, for reassemble(), and returns how many there are. the
+   new lines' symbols are noted along the way */
+static int find_changes(Line*** starts) {
+  Source* s;
+  Line* lp;
+  Line* prev;
+  int capacity = 16;
+  int count = 0;
+  int i;
+
+  *starts = malloc(capacity * sizeof(Line*));
+  for(i = 0; i < reloaded_count; i++) {
+    /* the file itself, and each file it includes, whether read again or
+       spliced back in, might now start somewhere else */
+    for(s = first_source; s; s = s->next) {
+      if(!within_source(s, reloaded[i]))
+        continue;
+      if(count == capacity) {
+        capacity *= 2;
+        *starts = realloc(*starts, capacity * sizeof(Line*));
+      }
+      (*starts)[count++] = s->prev;
+    }
+
+    /* and new lines can follow old ones anywhere in it */
+    prev = reloaded[i]->prev;
+    lp = prev ? prev->next : first_line;
+    for(; lp && from_source(lp, reloaded[i]); prev = lp, lp = lp->next) {
+      if(lp->assembled)
+        continue;
+      add_readers(lp);
+      if(prev && prev->assembled) {
+        if(count == capacity) {
+          capacity *= 2;
+          *starts = realloc(*starts, capacity * sizeof(Line*));
+        }
+        (*starts)[count++] = prev;
+      }
+    }
+  }
+  return count;
+}
+
+/* assembles the loaded program into out_file, then keeps everything
+   resident and reassembles whenever one of the files it was built from
+   changes. only the files that changed are parsed again, only the lines
+   the changes reach are assembled again, and only the bytes that changed
+   are rewritten (and, with --push, sent on). never returns unless
+   something goes wrong */
+Status watch(char* out_file, char* sym_file) {
+  Image image;
+  int fd;
+  int ifd;
+  char buffer[EVENT_BUFFER];
+
+  fd = open(out_file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0) {
+    fprintf(stderr, "Error: could not open file %s for writing\n", out_file);
+    return ERROR;
+  }
+  ifd = inotify_init1(IN_CLOEXEC);
+  if(ifd < 0) {
+    fprintf(stderr, "Error: could not watch for changes\n");
+    return ERROR;
+  }
+
+  init_image(&image);
+  rebuild(&image, fd, sym_file, NULL, 0);
+  watch_dirs(ifd);
+
+  for(;;) {
+    struct pollfd pfd;
+    Source* s;
+    Line** starts;
+    int start_count;
+    int reassemble = 0;
+    int incbin_changed = 0;
+    int i;
+    double start;
+
+    /* wait for something to happen, then give things a moment to settle */
+    pfd.fd = ifd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, -1) < 0)
+      return ERROR;
+
+    do {
+      int len = read(ifd, buffer, sizeof(buffer));
+      char* p;
+
+      for(p = buffer; len > 0 && p < buffer + len;) {
+        struct inotify_event* ev = (struct inotify_event*)p;
+        p += sizeof(struct inotify_event) + ev->len;
+        for(i = 0; i < watched_count && watched[i].wd != ev->wd; i++);
+        if(i == watched_count || !ev->len)
+          continue;
+
+        /* which of our files was it? */
+        {
+          char path[PATH_MAX];
+          snprintf(path, sizeof(path), "%s/%s", watched[i].dir, ev->name);
+          for(s = first_source; s; s = s->next) {
+            if(strcmp(source_path(s), path) == 0) {
+              s->stale = 1;
+              reassemble = 1;
+            }
+          }
+          if(is_incbin_path(path))
+            reassemble = incbin_changed = 1;
+        }
+      }
+    } while(poll(&pfd, 1, SETTLE_MS) > 0);
+
+    if(!reassemble)
+      continue;
+
+    /* reparse the changed files */
+    start = now_ms();
+    for(s = first_source; s; s = s->next)
+      if(s->stale)
+        printf("%s changed\n", s->filename);
+    reset_errors();
+    reload_stale_sources();
+
+    /* a changed INCBIN can change any line's size, so everything's
+       assembled again */
+    start_count = find_changes(&starts);
+    if(rebuild(&image, fd, sym_file, incbin_changed ? NULL : starts,
+               start_count) == OK)
+      printf("rebuilt %s in %.1f ms\n", out_file, now_ms() - start);
+    free(starts);
+    fflush(stdout);
+
+    /* included files may have come or gone */
+    watch_dirs(ifd);
+  }
+}
+
+/* reassembles the program from starts, see reassemble(), and brings the
+   output file, which holds image, up to date */
+static Status rebuild(Image* image, int fd, char* sym_file, Line** starts,
+                      int start_count) {
+  Image new_image;
+  int written;
+
+  if(reassemble(starts, start_count) != OK)
+    return ERROR;
+
+  init_image(&new_image);
+  if(build_output(&new_image, image) != OK) {
+    free_image(&new_image);
+    return ERROR;
+  }
+
+  written = write_image_changes(image, &new_image, fd);
+  if(written < 0) {
+    fprintf(stderr, "Error: writing output file\n");
+    free_image(&new_image);
+    return ERROR;
+  }
+  push_changes(image, &new_image);
+  free_image(image);
+  *image = new_image;
+
+  if(sym_file) {
+    FILE* fp = fopen(sym_file, "w");
+    if(!fp) {
+      fprintf(stderr,
+              "Error: could not open file %s for writing symbol info to\n",
+              sym_file);
+      return ERROR;
+    }
+    dump_symbols(fp);
+    fclose(fp);
+  }
+  return OK;
+}
+
+/* makes sure the directory of every source and INCBIN'd file is watched.
+   watching directories rather than the files themselves means editors that
+   save by renaming a new file into place are still noticed */
+static void watch_dirs(int ifd) {
+  Source* s;
+  Line* lp;
+  int i;
+
+  for(s = first_source; s; s = s->next)
+    watch_dir_of(ifd, source_path(s));
+
+  for(i = 0; i < incbin_count; i++)
+    free(incbin_paths[i]);
+  incbin_count = 0;
+  for(lp = first_line; lp; lp = lp->next) {
+    if(lp->instruction && lp->addr_mode == STRING &&
+       strcasecmp(lp->instruction, "incbin") == 0) {
+      char* path = realpath(lp->expr1->e.str, NULL);
+      if(path) {
+        watch_dir_of(ifd, path);
+        incbin_paths = realloc(incbin_paths,
+                               (incbin_count + 1) * sizeof(char*));
+        incbin_paths[incbin_count++] = path;
+      }
+    }
+  }
+}
+
+static void watch_dir_of(int ifd, char* path) {
+  char* slash = strrchr(path, '/');
+  char* dir;
+  int wd;
+  int i;
+
+  if(!slash)
+    return;
+  dir = strndup(path, slash == path ? 1 : slash - path);
+  wd = inotify_add_watch(ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+  if(wd < 0) {
+    free(dir);
+    return;
+  }
+  for(i = 0; i < watched_count; i++) {
+    if(watched[i].wd == wd) {
+      free(dir);
+      return;
+    }
+  }
+  watched = realloc(watched, (watched_count + 1) * sizeof(Watched_dir));
+  watched[watched_count].wd = wd;
+  watched[watched_count].dir = dir;
+  watched_count++;
+}
+
+/* the ancestor of s that source included directly, or NULL if s is source
+   itself */
+static Source* child_of(Source* s, Source* source) {
+  for(; s && s->parent != source; s = s->parent);
+  return s;
+}
+
+/* has source, or anything it includes, changed? */
+static int has_stale(Source* source) {
+  Source* s;
+  if(!source)
+    return 0;
+  for(s = first_source; s; s = s->next)
+    if(s->stale && within_source(s, source))
+      return 1;
+  return 0;
+}
+
+/* is s set aside, waiting to be spliced back in? */
+int is_kept(Source* s) {
+  int i;
+  for(i = 0; i < kept_count; i++)
+    if(within_source(s, kept[i].source))
+      return 1;
+  return 0;
+}
+
+static int is_incbin_path(char* path) {
+  int i;
+  for(i = 0; i < incbin_count; i++)
+    if(strcmp(incbin_paths[i], path) == 0)
+      return 1;
+  return 0;
+}
+
+static double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
@@ -0,0 +1,13 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "error.h"
+#include "lines.h"
+
+Status reload_source(Source* source);
+int reload_stale_sources();
+int reuse_source(char* filename);
+int is_kept(Source* s);
+Status watch(char* out_file, char* sym_file);
+
+#endif